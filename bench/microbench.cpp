@@ -0,0 +1,429 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+// Times the functions the rest of the program leans on hardest, on fixed inputs, so a change to one of them can be
+// judged by numbers instead of by feel. Each benchmark is calibrated to about 20ms a sample, then sampled repeatedly.
+//
+// microbench [name-substring] [samples=N] [save=file] [compare=file]
+//
+// save= writes each benchmark's median to file, compare= prints how far each one moved from a file written that way.
+
+#include "../parse.h"
+#include "../util.h"
+#include "../item.h"
+#include "../state.h"
+#include "../plan.h"
+#include "../debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static unsigned long long rngstate = 1;
+static unsigned int rng() {
+  rngstate = rngstate * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned int)(rngstate >> 33);
+}
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Somewhere for results to go so the compiler can't throw the work away
+static volatile long long sink;
+
+static string scratch;
+
+static void writeFile(const string &path, const vector<char> &data) {
+  FILE *fil = fopen(path.c_str(), "wb");
+  CHECK(fil);
+  CHECK(fwrite(&data[0], 1, data.size(), fil) == data.size());
+  fclose(fil);
+}
+
+static Checksum randomChecksum() {
+  Checksum cs;
+  for(int i = 0; i < sizeof(cs.bytes); i++)
+    cs.bytes[i] = rng();
+  for(int i = 0; i < sizeof(cs.signature); i++)
+    cs.signature[i] = rng();
+  cs.sample = (unsigned long long)rng() << 32 | rng();
+  cs.sampled = true;
+  return cs;
+}
+
+// A state file line, near enough
+static kvData fileLine(int i) {
+  kvData kvd;
+  kvd.category = "file";
+  kvd.kv["name"] = StringPrintf("/bench/d%02d/some directory/file number %06d.dat", i % 37, i);
+  kvd.kv["size"] = StringPrintf("%d", rng() % 10000000);
+  kvd.kv["timestamp"] = StringPrintf("%d", 1200000000 + i);
+  kvd.kv["checksum"] = randomChecksum().toString();
+  kvd.kv["dependencies"] = StringPrintf("%d %d", i % 5 + 1, i % 5 + 3);
+  return kvd;
+}
+
+/*************
+ * The benchmarks - each does iters repetitions of one thing
+ */
+
+static kvData kvd_line;
+static string kvd_string;
+static void setupKvd() {
+  kvd_line = fileLine(12345);
+  kvd_string = putkvDataInlineString(kvd_line, "name");
+}
+static void benchPutKvd(int iters) {
+  for(int i = 0; i < iters; i++)
+    sink += putkvDataInlineString(kvd_line, "name").size();
+}
+static void benchGetKvd(int iters) {
+  for(int i = 0; i < iters; i++)
+    sink += getkvDataInlineString(kvd_string).kv.size();
+}
+
+static Checksum cs_value;
+static string cs_string;
+static void setupChecksum() {
+  cs_value = randomChecksum();
+  cs_string = cs_value.toString();
+}
+static void benchChecksumString(int iters) {
+  for(int i = 0; i < iters; i++)
+    sink += cs_value.toString().size();
+}
+static void benchAtochecksum(int iters) {
+  for(int i = 0; i < iters; i++)
+    sink += atochecksum(cs_string.c_str()).bytes[0];
+}
+
+static string tok_string;
+static void setupTokenize() {
+  tok_string = "";
+  for(int i = 0; i < 64; i++)
+    tok_string += StringPrintf("token%d ", i);
+}
+static void benchTokenize(int iters) {
+  for(int i = 0; i < iters; i++)
+    sink += tokenize(tok_string, " ").size();
+}
+
+static void benchStringPrintf(int iters) {
+  for(int i = 0; i < iters; i++)
+    sink += StringPrintf("%s/%08d/%lld bytes at %d", "states", i, (long long)i * 4096, i & 0xff).size();
+}
+
+// Same size and contents, different timestamps - the comparison a touched file gets, all the way to the full hash
+static string if_left, if_right;
+static void setupIdentical() {
+  vector<char> data(1 << 20);
+  for(int i = 0; i < data.size(); i++)
+    data[i] = rng();
+  if_left = scratch + "/identical-left";
+  if_right = scratch + "/identical-right";
+  writeFile(if_left, data);
+  writeFile(if_right, data);
+}
+static void benchIdenticalFull(int iters) {
+  for(int i = 0; i < iters; i++) {
+    Item lhs = Item::MakeLocal(if_left, 1 << 20, Metadata(1));
+    Item rhs = Item::MakeLocal(if_right, 1 << 20, Metadata(2));
+    sink += identicalFile(lhs, rhs);
+  }
+}
+static void benchIdenticalCached(int iters) {
+  static Item lhs = Item::MakeLocal(if_left, 1 << 20, Metadata(1));
+  static Item rhs = Item::MakeLocal(if_right, 1 << 20, Metadata(2));
+  for(int i = 0; i < iters; i++)
+    sink += identicalFile(lhs, rhs);
+}
+
+static const int state_items = 20000;
+static string state_in, state_out;
+static State state_loaded;
+static void setupState() {
+  state_in = scratch + "/state-in";
+  state_out = scratch + "/state-out";
+  ofstream ofs(state_in.c_str());
+  for(int i = 0; i < state_items; i++)
+    putkvDataInline(ofs, fileLine(i), "name");
+  ofs.close();
+  state_loaded.readFile(state_in);
+}
+static void benchStateRead(int iters) {
+  for(int i = 0; i < iters; i++) {
+    State st;
+    st.readFile(state_in);
+    sink += st.getItemDb().size();
+  }
+}
+static void benchStateWrite(int iters) {
+  for(int i = 0; i < iters; i++)
+    state_loaded.writeOut(state_out);
+}
+
+// A plan with stores, deletes, plain copies and a few rings of copies that deloop() has to turn into rotates
+static vector<Instruction> plan_inst;
+static void setupPlan() {
+  Instruction fi;
+  fi.type = TYPE_CREATE;
+  for(int i = 0; i < 40; i++) {
+    vector<string> ring;
+    for(int j = 0; j < 3; j++) {
+      ring.push_back(StringPrintf("/bench/ring/%03d-%d", i, j));
+      fi.creates.push_back(make_pair(false, ring.back()));
+    }
+    for(int j = 0; j < 3; j++) {
+      Instruction ti;
+      ti.type = TYPE_COPY;
+      ti.copy_source = ring[j];
+      ti.copy_dest = ring[(j + 1) % 3];
+      ti.copy_dest_meta = Metadata(j);
+      ti.depends.push_back(make_pair(false, ring[j]));
+      ti.removes.push_back(make_pair(false, ring[(j + 1) % 3]));
+      ti.creates.push_back(make_pair(true, ring[(j + 1) % 3]));
+      plan_inst.push_back(ti);
+    }
+  }
+  for(int i = 0; i < 2000; i++) {
+    string path = StringPrintf("/bench/file/%05d", i);
+    fi.creates.push_back(make_pair(false, path));
+    Instruction ti;
+    if(i % 4 == 0) {
+      ti.type = TYPE_DELETE;
+      ti.delete_path = path;
+      ti.removes.push_back(make_pair(false, path));
+    } else if(i % 4 == 1) {
+      ti.type = TYPE_COPY;
+      ti.copy_source = path;
+      ti.copy_dest = path + "-copy";
+      ti.copy_dest_meta = Metadata(i);
+      ti.depends.push_back(make_pair(false, path));
+      ti.creates.push_back(make_pair(true, path + "-copy"));
+    } else {
+      ti.type = TYPE_STORE;
+      ti.store_path = path;
+      ti.store_size = i;
+      ti.store_meta = Metadata(i);
+      ti.store_source = NULL;
+      ti.removes.push_back(make_pair(false, path));
+      ti.creates.push_back(make_pair(true, path));
+    }
+    plan_inst.push_back(ti);
+  }
+  plan_inst.push_back(fi);
+}
+static void benchDeloop(int iters) {
+  for(int i = 0; i < iters; i++)
+    sink += deloop(plan_inst).size();
+}
+static void benchSortInst(int iters) {
+  for(int i = 0; i < iters; i++) {
+    vector<Instruction> inst = plan_inst;  // it sorts in place, so each pass pays for a copy
+    sortInst(inst);
+    sink += inst.size();
+  }
+}
+
+static string dl_path;
+static void setupDirList() {
+  dl_path = scratch + "/dirlist";
+  CHECK(!mkdir(dl_path.c_str(), 0755));
+  vector<char> data(100);
+  for(int i = 0; i < 1000; i++)
+    writeFile(StringPrintf("%s/entry%04d", dl_path.c_str(), i), data);
+}
+static void benchDirList(int iters) {
+  for(int i = 0; i < iters; i++)
+    sink += getDirList(dl_path).second.size();
+}
+
+struct Bench {
+  const char *name;
+  void (*setup)();
+  void (*run)(int iters);
+};
+
+static const Bench benches[] = {
+  { "putkvDataInlineString", setupKvd, benchPutKvd },
+  { "getkvDataInlineString", setupKvd, benchGetKvd },
+  { "Checksum::toString", setupChecksum, benchChecksumString },
+  { "atochecksum", setupChecksum, benchAtochecksum },
+  { "tokenize/64", setupTokenize, benchTokenize },
+  { "StringPrintf", NULL, benchStringPrintf },
+  { "identicalFile/1MB", setupIdentical, benchIdenticalFull },
+  { "identicalFile/cached", setupIdentical, benchIdenticalCached },
+  { "State::readFile/20000", setupState, benchStateRead },
+  { "State::writeOut/20000", setupState, benchStateWrite },
+  { "deloop/2120", setupPlan, benchDeloop },
+  { "sortInst/2120", setupPlan, benchSortInst },
+  { "getDirList/1000", setupDirList, benchDirList },
+};
+
+/*************
+ * Running and reporting
+ */
+
+struct Summary {
+  double min;
+  double median;
+  double mean;
+  double stddev;
+};
+
+// Nanoseconds per iteration over each sample
+static Summary measure(const Bench &bench, int samples) {
+  int iters = 1;
+  while(1) {
+    double start = now();
+    bench.run(iters);
+    double took = now() - start;
+    if(took >= 0.02 || iters >= (1 << 30) / 2)
+      break;
+    iters = took < 0.002 ? iters * 10 : iters * 2;
+  }
+  
+  vector<double> times;
+  for(int i = 0; i < samples; i++) {
+    double start = now();
+    bench.run(iters);
+    times.push_back((now() - start) * 1e9 / iters);
+  }
+  sort(times.begin(), times.end());
+  
+  Summary sum;
+  sum.min = times.front();
+  sum.median = times.size() % 2 ? times[times.size() / 2] : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2;
+  sum.mean = 0;
+  for(int i = 0; i < times.size(); i++)
+    sum.mean += times[i];
+  sum.mean /= times.size();
+  sum.stddev = 0;
+  for(int i = 0; i < times.size(); i++)
+    sum.stddev += (times[i] - sum.mean) * (times[i] - sum.mean);
+  sum.stddev = sqrt(sum.stddev / times.size());
+  return sum;
+}
+
+static map<string, double> readBaseline(const string &fname) {
+  map<string, double> rv;
+  ifstream ifs(fname.c_str());
+  if(!ifs) {
+    printf("Can't read baseline %s\n", fname.c_str());
+    exit(1);
+  }
+  kvData kvd;
+  while(getkvDataInline(ifs, kvd)) {
+    CHECK(kvd.category == "bench");
+    string name = kvd.consume("name");
+    rv[name] = atof(kvd.consume("median").c_str());
+  }
+  return rv;
+}
+
+int main(int argc, char **argv) {
+  string filter;
+  int samples = 15;
+  string savefile;
+  string comparefile;
+  for(int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if(arg.find("samples=") == 0)
+      samples = atoi(arg.c_str() + 8);
+    else if(arg.find("save=") == 0)
+      savefile = arg.substr(5);
+    else if(arg.find("compare=") == 0)
+      comparefile = arg.substr(8);
+    else
+      filter = arg;
+  }
+  CHECK(samples >= 1);
+  
+  map<string, double> baseline;
+  if(comparefile.size())
+    baseline = readBaseline(comparefile);
+  
+  char tmpl[] = "/tmp/microbench.XXXXXX";
+  CHECK(mkdtemp(tmpl));
+  scratch = tmpl;
+  
+  // deloop() and friends chatter on stdout, so the results get a copy of it and everything else goes nowhere
+  FILE *out = fdopen(dup(fileno(stdout)), "w");
+  CHECK(out);
+  CHECK(freopen("/dev/null", "w", stdout));
+  
+  ofstream save;
+  if(savefile.size()) {
+    save.open(savefile.c_str());
+    CHECK(save);
+  }
+  
+  fprintf(out, "%-24s %12s %12s %12s %8s", "benchmark", "min ns", "median ns", "mean ns", "stddev");
+  if(comparefile.size())
+    fprintf(out, " %10s", "vs base");
+  fprintf(out, "\n");
+  
+  set<void (*)()> done;
+  for(int i = 0; i < sizeof(benches) / sizeof(*benches); i++) {
+    const Bench &bench = benches[i];
+    if(filter.size() && string(bench.name).find(filter) == string::npos)
+      continue;
+    if(bench.setup && !done.count(bench.setup)) {
+      rngstate = 1;  // so every fixture comes out the same no matter which benchmarks got filtered out
+      bench.setup();
+      done.insert(bench.setup);
+    }
+    
+    Summary sum = measure(bench, samples);
+    fprintf(out, "%-24s %12.1f %12.1f %12.1f %7.1f%%", bench.name, sum.min, sum.median, sum.mean, 100 * sum.stddev / sum.mean);
+    if(comparefile.size()) {
+      if(baseline.count(bench.name))
+        fprintf(out, " %+9.1f%%", 100 * (sum.median / baseline[bench.name] - 1));
+      else
+        fprintf(out, " %10s", "new");
+    }
+    fprintf(out, "\n");
+    fflush(out);
+    
+    if(save.is_open()) {
+      kvData kvd;
+      kvd.category = "bench";
+      kvd.kv["name"] = bench.name;
+      kvd.kv["median"] = StringPrintf("%.1f", sum.median);
+      putkvDataInline(save, kvd, "name");
+    }
+  }
+  
+  system(StringPrintf("rm -rf %s", scratch.c_str()).c_str());
+  return 0;
+}
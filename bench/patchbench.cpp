@@ -0,0 +1,152 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+// Times signature generation, diffing and delta application on synthetic files with small edits, and checks
+// that every delta rebuilds the file exactly.
+//
+// patchbench [megabytes [edits [editsize]]]
+
+#include "../patch.h"
+#include "../debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <vector>
+#include <openssl/sha.h>
+
+using namespace std;
+
+static unsigned long long rngstate = 1;
+static unsigned int rng() {
+  rngstate = rngstate * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned int)(rngstate >> 33);
+}
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static BlockSignature makeSignature(const vector<unsigned char> &data) {
+  SignatureBuilder sb(data.size());
+  for(long long pos = 0; pos < data.size(); pos += 1 << 20)
+    sb.feed((const char *)&data[pos], (int)min((long long)data.size() - pos, 1LL << 20));
+  Checksum cs;
+  SHA1(&data[0], data.size(), cs.bytes);
+  return sb.finish(cs);
+}
+
+static void runCase(const char *name, const vector<unsigned char> &old, const vector<unsigned char> &cur) {
+  double start = now();
+  BlockSignature sig = makeSignature(old);
+  double sigtime = now() - start;
+  
+  start = now();
+  long long literal;
+  vector<DeltaOp> ops = diffBuffer(&cur[0], cur.size(), sig, &literal);
+  double difftime = now() - start;
+  
+  FILE *oldf = tmpfile();
+  FILE *delta = tmpfile();
+  FILE *out = tmpfile();
+  CHECK(oldf && delta && out);
+  CHECK(fwrite(&old[0], 1, old.size(), oldf) == old.size());
+  long long deltasize = 0;
+  for(int i = 0; i < ops.size(); i++) {
+    string header = deltaOpHeader(ops[i]);
+    CHECK(fwrite(header.data(), 1, header.size(), delta) == header.size());
+    deltasize += header.size();
+    if(!ops[i].copy) {
+      CHECK(fwrite(&cur[ops[i].offset], 1, ops[i].len, delta) == ops[i].len);
+      deltasize += ops[i].len;
+    }
+  }
+  string end = deltaEnd();
+  CHECK(fwrite(end.data(), 1, end.size(), delta) == end.size());
+  deltasize += end.size();
+  rewind(delta);
+  
+  start = now();
+  applyDelta(delta, oldf, out);
+  double applytime = now() - start;
+  
+  vector<unsigned char> rebuilt(cur.size());
+  rewind(out);
+  CHECK(fread(&rebuilt[0], 1, rebuilt.size(), out) == rebuilt.size());
+  CHECK(fgetc(out) == EOF);
+  CHECK(rebuilt == cur);
+  fclose(oldf);
+  fclose(delta);
+  fclose(out);
+  
+  double mb = cur.size() / 1048576.0;
+  printf("%-10s %6d blocks of %5d: sig %7.1f MB/s, diff %7.1f MB/s, apply %7.1f MB/s, %5d ops, %9lld literal, delta %9lld (%.3f%%)\n",
+    name, (int)sig.weak.size(), sig.blocksize, mb / sigtime, mb / difftime, mb / applytime, (int)ops.size(), literal, deltasize, 100.0 * deltasize / cur.size());
+}
+
+int main(int argc, char **argv) {
+  long long size = (argc > 1 ? atoi(argv[1]) : 8) << 20;
+  int edits = argc > 2 ? atoi(argv[2]) : 16;
+  int editsize = argc > 3 ? atoi(argv[3]) : 64;
+  
+  printf("%lld bytes, %d edits of %d bytes\n", size, edits, editsize);
+  
+  vector<unsigned char> old(size);
+  for(long long i = 0; i < size; i++)
+    old[i] = rng() & 0xff;
+  
+  // In place - the case a database or a disk image mostly sees
+  {
+    vector<unsigned char> cur = old;
+    for(int i = 0; i < edits; i++) {
+      long long pos = ((long long)rng() << 16 ^ rng()) % (size - editsize);
+      for(int j = 0; j < editsize; j++)
+        cur[pos + j] = rng() & 0xff;
+    }
+    runCase("overwrite", old, cur);
+  }
+  
+  // Insertions, which shift everything after them off the block grid
+  {
+    vector<unsigned char> cur = old;
+    for(int i = 0; i < edits; i++) {
+      long long pos = ((long long)rng() << 16 ^ rng()) % cur.size();
+      vector<unsigned char> ins(editsize);
+      for(int j = 0; j < editsize; j++)
+        ins[j] = rng() & 0xff;
+      cur.insert(cur.begin() + pos, ins.begin(), ins.end());
+    }
+    runCase("insert", old, cur);
+  }
+  
+  // Nothing in common, the worst case for the diff loop
+  {
+    vector<unsigned char> cur(size);
+    for(long long i = 0; i < size; i++)
+      cur[i] = rng() & 0xff;
+    runCase("unrelated", old, cur);
+  }
+  
+  // Unchanged, the best case
+  runCase("identical", old, old);
+  
+  return 0;
+}
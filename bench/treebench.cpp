@@ -0,0 +1,414 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+// Builds deterministic synthetic trees and times purebackup against them, one incremental backup per round of
+// changes. The same seed and settings always produce the same tree and the same changes.
+//
+// treebench gen <dir> [key=value ...]            writes a fresh tree into dir
+// treebench mutate <dir> <round> [key=value ...] applies one round of changes to it
+// treebench run [key=value ...]                  builds a tree under dir=, backs it up, then mutates and backs up
+//                                                cycles-1 more times and prints where each run's time went
+//
+// Tree:    seed files depth fanout minsize maxsize redundancy dups
+// Changes: appends renames touches modifies deletes creates - each the chance per file, creates per existing file
+// Run:     cycles dir exe
+
+#include "../util.h"
+#include "../stats.h"
+#include "../debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct TreeOptions {
+  unsigned long long seed;
+  int files;
+  int depth;
+  int fanout;
+  long long minsize;
+  long long maxsize;
+  double redundancy;  // chance a 4k block repeats the one before it, so deflate has something to do
+  double dups;        // chance a new file is a copy of one we already wrote
+  
+  double appends;
+  double renames;
+  double touches;
+  double modifies;
+  double deletes;
+  double creates;
+  
+  int cycles;
+  string dir;
+  string exe;
+  
+  TreeOptions();
+};
+
+TreeOptions::TreeOptions() {
+  seed = 1;
+  files = 2000;
+  depth = 3;
+  fanout = 4;
+  minsize = 0;
+  maxsize = 1 << 20;
+  redundancy = 0.5;
+  dups = 0.05;
+  appends = 0.02;
+  renames = 0.02;
+  touches = 0.05;
+  modifies = 0.02;
+  deletes = 0.01;
+  creates = 0.02;
+  cycles = 4;
+  dir = "/tmp/purebackup-bench";
+  exe = "purebackup.exe";
+}
+
+static void parseOption(TreeOptions *opt, const string &arg) {
+  size_t eq = arg.find('=');
+  if(eq == string::npos) {
+    printf("Expected key=value, got %s\n", arg.c_str());
+    exit(1);
+  }
+  string key = arg.substr(0, eq);
+  const char *val = arg.c_str() + eq + 1;
+  if(key == "seed") opt->seed = strtoull(val, NULL, 10);
+  else if(key == "files") opt->files = atoi(val);
+  else if(key == "depth") opt->depth = atoi(val);
+  else if(key == "fanout") opt->fanout = atoi(val);
+  else if(key == "minsize") opt->minsize = atoll(val);
+  else if(key == "maxsize") opt->maxsize = atoll(val);
+  else if(key == "redundancy") opt->redundancy = atof(val);
+  else if(key == "dups") opt->dups = atof(val);
+  else if(key == "appends") opt->appends = atof(val);
+  else if(key == "renames") opt->renames = atof(val);
+  else if(key == "touches") opt->touches = atof(val);
+  else if(key == "modifies") opt->modifies = atof(val);
+  else if(key == "deletes") opt->deletes = atof(val);
+  else if(key == "creates") opt->creates = atof(val);
+  else if(key == "cycles") opt->cycles = atoi(val);
+  else if(key == "dir") opt->dir = val;
+  else if(key == "exe") opt->exe = val;
+  else {
+    printf("Unknown option %s\n", key.c_str());
+    exit(1);
+  }
+}
+
+static unsigned long long rngstate = 1;
+static unsigned long long rng64() {
+  rngstate = rngstate * 6364136223846793005ULL + 1442695040888963407ULL;
+  unsigned long long z = rngstate;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  return z ^ (z >> 31);
+}
+static double rngUnit() {
+  return (rng64() >> 11) / 9007199254740992.0;
+}
+static long long rngRange(long long n) {
+  return (long long)(rng64() % (unsigned long long)n);
+}
+
+// Every round gets its own stream, so changing how much one round does doesn't shift all the rounds after it
+static void reseed(unsigned long long seed, int round) {
+  rngstate = seed * 0x9e3779b97f4a7c15ULL + round;
+  rng64();
+}
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static string absolutePath(const string &path) {
+  if(path.size() && path[0] == '/')
+    return path;
+  char buf[4096];
+  CHECK(getcwd(buf, sizeof(buf)));
+  return string(buf) + "/" + path;
+}
+
+// Log-uniform, so there are lots of small files and a few big ones, like a real disk
+static long long pickSize(const TreeOptions &opt) {
+  double lo = log((double)opt.minsize + 1);
+  double hi = log((double)opt.maxsize + 1);
+  return (long long)exp(lo + rngUnit() * (hi - lo)) - 1;
+}
+
+static void writeContent(FILE *fil, long long size, double redundancy) {
+  vector<unsigned long long> block(512);
+  for(long long pos = 0; pos < size; pos += block.size() * 8) {
+    if(!pos || rngUnit() >= redundancy)
+      for(int i = 0; i < block.size(); i++)
+        block[i] = rng64();
+    long long len = min((long long)block.size() * 8, size - pos);
+    CHECK(fwrite(&block[0], 1, len, fil) == len);
+  }
+}
+
+static void setTime(const string &path, long long stamp) {
+  struct utimbuf ut;
+  ut.actime = stamp;
+  ut.modtime = stamp;
+  CHECK(!utime(path.c_str(), &ut));
+}
+
+static void copyFile(const string &source, const string &dest) {
+  FILE *in = fopen(source.c_str(), "rb");
+  FILE *out = fopen(dest.c_str(), "wb");
+  CHECK(in && out);
+  vector<char> buf(1 << 16);
+  int rv;
+  while((rv = fread(&buf[0], 1, buf.size(), in)) > 0)
+    CHECK(fwrite(&buf[0], 1, rv, out) == rv);
+  fclose(in);
+  fclose(out);
+}
+
+// Sorted, since readdir() order isn't something we can reproduce
+static void listTree(const string &path, vector<string> *files, vector<string> *dirs) {
+  dirs->push_back(path);
+  vector<DirListOut> dlo = getDirList(path).second;
+  for(int i = 0; i < dlo.size(); i++) {
+    if(dlo[i].directory)
+      listTree(dlo[i].full_path, files, dirs);
+    else
+      files->push_back(dlo[i].full_path);
+  }
+}
+
+static void listSorted(const string &path, vector<string> *files, vector<string> *dirs) {
+  listTree(path, files, dirs);
+  sort(files->begin(), files->end());
+  sort(dirs->begin(), dirs->end());
+}
+
+// New files go in random directories. Some of them are copies of ones we've already written.
+static long long createFiles(const TreeOptions &opt, const vector<string> &dirs, int count, const string &prefix, long long stamp, vector<string> *written) {
+  long long bytes = 0;
+  for(int i = 0; i < count; i++) {
+    string path = StringPrintf("%s/%s%06d", dirs[rngRange(dirs.size())].c_str(), prefix.c_str(), i);
+    if(written->size() && rngUnit() < opt.dups) {
+      copyFile((*written)[rngRange(written->size())], path);
+    } else {
+      FILE *fil = fopen(path.c_str(), "wb");
+      CHECK(fil);
+      long long size = pickSize(opt);
+      writeContent(fil, size, opt.redundancy);
+      fclose(fil);
+      bytes += size;
+    }
+    setTime(path, stamp + i);
+    written->push_back(path);
+  }
+  return bytes;
+}
+
+static const long long basestamp = 1200000000;
+
+static void genTree(const TreeOptions &opt, const string &root) {
+  reseed(opt.seed, 0);
+  
+  vector<string> dirs;
+  dirs.push_back(root);
+  CHECK(!mkdir(root.c_str(), 0755));
+  for(int i = 0; i < dirs.size(); i++) {
+    int level = count(dirs[i].begin() + root.size(), dirs[i].end(), '/');
+    if(level >= opt.depth)
+      continue;
+    for(int j = 0; j < opt.fanout; j++) {
+      string sub = StringPrintf("%s/d%d", dirs[i].c_str(), j);
+      CHECK(!mkdir(sub.c_str(), 0755));
+      dirs.push_back(sub);
+    }
+  }
+  
+  vector<string> written;
+  long long bytes = createFiles(opt, dirs, opt.files, "f", basestamp, &written);
+  printf("Generated %d files in %d directories, %lld bytes written\n", opt.files, (int)dirs.size(), bytes);
+}
+
+static void mutateTree(const TreeOptions &opt, const string &root, int round) {
+  reseed(opt.seed, round);
+  long long stamp = basestamp + round * 86400LL;
+  
+  vector<string> files;
+  vector<string> dirs;
+  listSorted(root, &files, &dirs);
+  
+  int deleted = 0, renamed = 0, appended = 0, modified = 0, touched = 0;
+  long long bytes = 0;
+  for(int i = 0; i < files.size(); i++) {
+    const string &path = files[i];
+    double roll = rngUnit();
+    if((roll -= opt.deletes) < 0) {
+      CHECK(!unlink(path.c_str()));
+      deleted++;
+    } else if((roll -= opt.renames) < 0) {
+      // rename() keeps the timestamp, so this is a move the planner should spot as a copy
+      string dest = StringPrintf("%s/m%d_%06d", dirs[rngRange(dirs.size())].c_str(), round, i);
+      CHECK(!rename(path.c_str(), dest.c_str()));
+      renamed++;
+    } else if((roll -= opt.appends) < 0) {
+      struct stat stt;
+      CHECK(!stat(path.c_str(), &stt));
+      long long len = max(100LL, (long long)(stt.st_size * rngUnit() / 10));
+      FILE *fil = fopen(path.c_str(), "ab");
+      CHECK(fil);
+      writeContent(fil, len, opt.redundancy);
+      fclose(fil);
+      setTime(path, stamp + i);
+      bytes += len;
+      appended++;
+    } else if((roll -= opt.modifies) < 0) {
+      struct stat stt;
+      CHECK(!stat(path.c_str(), &stt));
+      if(stt.st_size) {
+        long long len = min((long long)stt.st_size, 1 + rngRange(4096));
+        FILE *fil = fopen(path.c_str(), "r+b");
+        CHECK(fil);
+        CHECK(!fseeko(fil, rngRange(stt.st_size - len + 1), SEEK_SET));
+        writeContent(fil, len, 0);
+        fclose(fil);
+        bytes += len;
+      }
+      setTime(path, stamp + i);
+      modified++;
+    } else if((roll -= opt.touches) < 0) {
+      setTime(path, stamp + i);
+      touched++;
+    }
+  }
+  
+  vector<string> written;
+  for(int i = 0; i < files.size(); i++)
+    if(!access(files[i].c_str(), F_OK))
+      written.push_back(files[i]);
+  int created = (int)(files.size() * opt.creates);
+  bytes += createFiles(opt, dirs, created, StringPrintf("n%d_", round), stamp + files.size(), &written);
+  
+  printf("Round %d: %d deleted, %d renamed, %d appended, %d modified, %d touched, %d created, %lld bytes written\n", round, deleted, renamed, appended, modified, touched, created, bytes);
+}
+
+// Just enough JSON to read our own run reports back
+static double reportNumber(const string &line, const string &key, size_t from = 0) {
+  size_t pos = line.find("\"" + key + "\":", from);
+  if(pos == string::npos)
+    return 0;
+  return atof(line.c_str() + pos + key.size() + 3);
+}
+
+static double reportPhase(const string &line, int phase) {
+  size_t pos = line.find(StringPrintf("\"%s\":{", phaseName(phase)));
+  if(pos == string::npos)
+    return 0;
+  return reportNumber(line, "wall", pos);
+}
+
+static int runBench(const TreeOptions &opt) {
+  string root = absolutePath(opt.dir);
+  string exe = absolutePath(opt.exe);
+  string src = root + "/src";
+  string drive = root + "/drive";
+  string work = root + "/work";
+  
+  system(StringPrintf("rm -rf %s", root.c_str()).c_str());
+  CHECK(!mkdir(root.c_str(), 0755));
+  CHECK(!mkdir(drive.c_str(), 0755));
+  CHECK(!mkdir(work.c_str(), 0755));
+  CHECK(!mkdir((work + "/states").c_str(), 0755));
+  genTree(opt, src);
+  
+  {
+    FILE *conf = fopen((work + "/purebackup.conf").c_str(), "w");
+    CHECK(conf);
+    fprintf(conf, "drive {\n  path=%s\n  size=%lld\n}\n\n", drive.c_str(), 1LL << 40);
+    fprintf(conf, "mountpoint {\n  mount=/bench\n  type=file\n  source=%s\n}\n", src.c_str());
+    fclose(conf);
+  }
+  
+  CHECK(!chdir(work.c_str()));
+  for(int i = 0; i < opt.cycles; i++) {
+    if(i)
+      mutateTree(opt, src, i);
+    double start = now();
+    if(system(StringPrintf("%s backup > backup%d.log 2>&1", exe.c_str(), i).c_str())) {
+      printf("Backup %d failed, see %s/backup%d.log\n", i, work.c_str(), i);
+      return 1;
+    }
+    printf("Backup %d took %.2fs\n", i, now() - start);
+    // What burning the disc would have done
+    CHECK(!system(StringPrintf("cp -r temp/* %s", drive.c_str()).c_str()));
+  }
+  
+  ifstream ifs("states/reports");
+  string line;
+  printf("\n%5s %8s", "cycle", "wall");
+  for(int i = 0; i < PHASE_END; i++)
+    printf(" %10s", phaseName(i));
+  printf(" %10s %10s %10s %8s\n", "read MB", "hashed MB", "zipped MB", "MB/s");
+  for(int cycle = 0; getline(ifs, line); cycle++) {
+    double wall = reportNumber(line, "wall");
+    printf("%5d %8.2f", cycle, wall);
+    for(int i = 0; i < PHASE_END; i++)
+      printf(" %10.2f", reportPhase(line, i));
+    double read = reportNumber(line, statName(STAT_BYTESREAD)) / 1048576;
+    printf(" %10.1f %10.1f %10.1f %8.1f\n", read, reportNumber(line, statName(STAT_BYTESHASHED)) / 1048576, reportNumber(line, statName(STAT_BYTESCOMPRESSED)) / 1048576, wall > 0 ? read / wall : 0.0);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if(argc < 2) {
+    printf("treebench gen <dir> [key=value ...], treebench mutate <dir> <round> [key=value ...], or treebench run [key=value ...]\n");
+    return 1;
+  }
+  string command = argv[1];
+  TreeOptions opt;
+  if(command == "gen" && argc >= 3) {
+    for(int i = 3; i < argc; i++)
+      parseOption(&opt, argv[i]);
+    genTree(opt, argv[2]);
+  } else if(command == "mutate" && argc >= 4) {
+    for(int i = 4; i < argc; i++)
+      parseOption(&opt, argv[i]);
+    mutateTree(opt, argv[2], atoi(argv[3]));
+  } else if(command == "run") {
+    for(int i = 2; i < argc; i++)
+      parseOption(&opt, argv[i]);
+    return runBench(opt);
+  } else {
+    printf("Don't know how to %s\n", command.c_str());
+    return 1;
+  }
+  return 0;
+}
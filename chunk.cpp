@@ -0,0 +1,205 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "chunk.h"
+
+#include "parse.h"
+#include "stats.h"
+#include "debug.h"
+
+#include <fstream>
+#include <algorithm>
+#include <openssl/sha.h>
+
+using namespace std;
+
+
+string ChunkRef::hex() const {
+  string rv;
+  for(int i = 0; i < sizeof(hash); i++)
+    rv += StringPrintf("%02x", hash[i]);
+  return rv;
+}
+
+string chunkListString(const vector<ChunkRef> &chunks) {
+  string rv;
+  for(int i = 0; i < chunks.size(); i++) {
+    if(i)
+      rv += " ";
+    rv += chunks[i].hex();
+  }
+  return rv;
+}
+
+// Gear hash - one shift and one add per byte. The table has to be identical on every run or the cut points move and
+// nothing dedups against older backups, so it comes from a fixed seed rather than anything random.
+static unsigned long long gear[256];
+static bool gear_ready = false;
+
+static void initGear() {
+  if(gear_ready)
+    return;
+  unsigned long long seed = 0x7075726562616b75ULL;
+  for(int i = 0; i < 256; i++) {
+    seed += 0x9e3779b97f4a7c15ULL;
+    unsigned long long z = seed;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+  gear_ready = true;
+}
+
+// The shift pushes old bytes out the top, so the top bits depend on the last 64 bytes and make a good window.
+// Cuts are harder to hit before the average size and easier after, which keeps chunk sizes bunched around it.
+static const unsigned long long mask_small = ~0ULL << (64 - 20);
+static const unsigned long long mask_large = ~0ULL << (64 - 16);
+
+// Looks for a cut point in buf. pos is how much of the current chunk we've seen already. Returns how many bytes of buf
+// end the current chunk, or -1 if all of buf belongs to it.
+static int findCut(const unsigned char *buf, int len, int *pos, unsigned long long *hash) {
+  int p = *pos;
+  unsigned long long h = *hash;
+  int i = 0;
+  if(p < chunkminsize) {
+    // nothing can cut here, so don't bother hashing it
+    int skip = min(len, chunkminsize - p);
+    i += skip;
+    p += skip;
+  }
+  for(; i < len; i++) {
+    h = (h << 1) + gear[buf[i]];
+    p++;
+    if(p >= chunkmaxsize || !(h & (p < chunkavgsize ? mask_small : mask_large))) {
+      *pos = 0;
+      *hash = 0;
+      return i + 1;
+    }
+  }
+  *pos = p;
+  *hash = h;
+  return -1;
+}
+
+// Everything chunkItem() carries from one buffer to the next
+struct ChunkScan {
+  Digest *whole;
+  SHA_CTX part;
+  long long done;
+  int pos;
+  unsigned long long hash;
+  ChunkRef cur;
+  vector<ChunkRef> *rv;
+};
+
+static void chunkFeed(const char *data, int got, void *ctx) {
+  ChunkScan *cs = (ChunkScan *)ctx;
+  const unsigned char *buf = (const unsigned char *)data;
+  cs->whole->update(buf, got);
+
+  int at = 0;
+  while(at < got) {
+    int cut = findCut(&buf[at], got - at, &cs->pos, &cs->hash);
+    if(cut == -1) {
+      SHA1_Update(&cs->part, &buf[at], got - at);
+      break;
+    }
+    SHA1_Update(&cs->part, &buf[at], cut);
+    at += cut;
+    cs->cur.len = (int)(cs->done + at - cs->cur.offset);
+    SHA1_Final(cs->cur.hash, &cs->part);
+    cs->rv->push_back(cs->cur);
+    cs->cur.offset = cs->done + at;
+    SHA1_Init(&cs->part);
+  }
+  cs->done += got;
+}
+
+vector<ChunkRef> chunkItem(const Item *item, long long len) {
+  initGear();
+
+  vector<ChunkRef> rv;
+
+  // Chunk ids stay SHA-1 whatever the config says, since the store keys on them; only the whole file follows it
+  Digest whole(checksumconfig.algorithm);
+  ChunkScan cs;
+  cs.whole = &whole;
+  SHA1_Init(&cs.part);
+  cs.done = 0;
+  cs.pos = 0;
+  cs.hash = 0;
+  cs.cur.offset = 0;
+  cs.rv = &rv;
+
+  item->scan(0, len, chunkFeed, NULL, &cs);
+  if(cs.done != len) {
+    printf("Trying to chunk %lld bytes, only picked up %lld!\n", len, cs.done);
+    CHECK(0);
+  }
+
+  if(cs.cur.offset < len) {
+    cs.cur.len = (int)(len - cs.cur.offset);
+    SHA1_Final(cs.cur.hash, &cs.part);
+    rv.push_back(cs.cur);
+  }
+
+  Checksum tcs = item->signaturePart(len);
+  whole.final(&tcs);
+  item->cacheChecksum(len, tcs);
+  countStat(STAT_BYTESHASHED, len);
+
+  return rv;
+}
+
+void ChunkStore::readFile(const string &fil) {
+  ifstream ifs(fil.c_str());
+  kvData kvd;
+  while(getkvDataInline(ifs, kvd)) {
+    CHECK(kvd.category == "chunk");
+    string hex = kvd.consume("hash");
+    known[hex] = kvd.consume("location");
+    CHECK(kvd.isDone());
+  }
+  added.clear();
+}
+
+void ChunkStore::appendNew(const string &fil) {
+  if(!added.size())
+    return;
+  ofstream ofs(fil.c_str(), ios::app);
+  CHECK(ofs);
+  for(int i = 0; i < added.size(); i++) {
+    kvData kvd;
+    kvd.category = "chunk";
+    kvd.kv["hash"] = added[i];
+    kvd.kv["location"] = location(added[i]);
+    putkvDataInline(ofs, kvd, "hash");
+  }
+  added.clear();
+}
+
+const string &ChunkStore::location(const string &hex) const {
+  CHECK(known.count(hex));
+  return known.find(hex)->second;
+}
+
+void ChunkStore::add(const string &hex, const string &location) {
+  CHECK(!known.count(hex));
+  known[hex] = location;
+  added.push_back(hex);
+}
@@ -0,0 +1,67 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_CHUNK
+#define PUREBACKUP_CHUNK
+
+#include "item.h"
+
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+// Files at least this big don't get stored whole. Instead they're cut into content-defined chunks, and only chunks
+// we've never stored before go into the archive - so a VM image that changed in the middle costs only the changed chunks.
+const long long chunkthreshold = 16 << 20;
+
+const int chunkminsize = 64 << 10;
+const int chunkavgsize = 256 << 10;
+const int chunkmaxsize = 1 << 20;
+
+class ChunkRef {
+public:
+  unsigned char hash[20]; // SHA-1 of the chunk's contents
+  long long offset;
+  int len;
+
+  string hex() const;
+};
+
+// Reads the first len bytes of the item once, cutting it into chunks and filling in the item's checksum along the way
+vector<ChunkRef> chunkItem(const Item *item, long long len);
+
+string chunkListString(const vector<ChunkRef> &chunks); // space-separated hashes, in file order
+
+// Every chunk that's ever been stored, and where. Lives next to the states, one line per chunk.
+class ChunkStore {
+public:
+  void readFile(const string &fil);
+  void appendNew(const string &fil);  // writes out everything added since readFile() or the last appendNew()
+
+  bool has(const string &hex) const { return known.count(hex); }
+  const string &location(const string &hex) const;  // "session/archive@offset", relative to the backup root
+  void add(const string &hex, const string &location);
+
+private:
+  map<string, string> known;
+  vector<string> added;
+};
+
+#endif
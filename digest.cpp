@@ -0,0 +1,225 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "digest.h"
+#include "debug.h"
+
+#include <string.h>
+
+static const unsigned int blake3_iv[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const int blake3_permutation[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+
+enum { B3_CHUNK_START = 1, B3_CHUNK_END = 2, B3_PARENT = 4, B3_ROOT = 8 };
+
+static const int b3_blocklen = 64;
+static const int b3_chunklen = 1024;
+
+static inline unsigned int rotr(unsigned int x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline void b3mix(unsigned int *s, int a, int b, int c, int d, unsigned int mx, unsigned int my) {
+  s[a] = s[a] + s[b] + mx;
+  s[d] = rotr(s[d] ^ s[a], 16);
+  s[c] = s[c] + s[d];
+  s[b] = rotr(s[b] ^ s[c], 12);
+  s[a] = s[a] + s[b] + my;
+  s[d] = rotr(s[d] ^ s[a], 8);
+  s[c] = s[c] + s[d];
+  s[b] = rotr(s[b] ^ s[c], 7);
+}
+
+static void b3compress(const unsigned int *cv, const unsigned int *block, unsigned long long counter, unsigned int blocklen, unsigned int flags, unsigned int *out) {
+  unsigned int s[16] = {
+    cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+    blake3_iv[0], blake3_iv[1], blake3_iv[2], blake3_iv[3],
+    (unsigned int)counter, (unsigned int)(counter >> 32), blocklen, flags
+  };
+  unsigned int m[16];
+  memcpy(m, block, sizeof(m));
+  for(int r = 0; r < 7; r++) {
+    b3mix(s, 0, 4, 8, 12, m[0], m[1]);
+    b3mix(s, 1, 5, 9, 13, m[2], m[3]);
+    b3mix(s, 2, 6, 10, 14, m[4], m[5]);
+    b3mix(s, 3, 7, 11, 15, m[6], m[7]);
+    b3mix(s, 0, 5, 10, 15, m[8], m[9]);
+    b3mix(s, 1, 6, 11, 12, m[10], m[11]);
+    b3mix(s, 2, 7, 8, 13, m[12], m[13]);
+    b3mix(s, 3, 4, 9, 14, m[14], m[15]);
+    unsigned int t[16];
+    for(int i = 0; i < 16; i++)
+      t[i] = m[blake3_permutation[i]];
+    memcpy(m, t, sizeof(m));
+  }
+  for(int i = 0; i < 8; i++) {
+    out[i] = s[i] ^ s[i + 8];
+    out[i + 8] = s[i + 8] ^ cv[i];
+  }
+}
+
+static void b3words(const unsigned char *bytes, unsigned int *words) {
+  for(int i = 0; i < 16; i++)
+    words[i] = bytes[i * 4] | (bytes[i * 4 + 1] << 8) | (bytes[i * 4 + 2] << 16) | ((unsigned int)bytes[i * 4 + 3] << 24);
+}
+
+static void b3parent(const unsigned int *left, const unsigned int *right, unsigned int *cv) {
+  unsigned int block[16];
+  memcpy(block, left, 8 * sizeof(unsigned int));
+  memcpy(block + 8, right, 8 * sizeof(unsigned int));
+  unsigned int out[16];
+  b3compress(blake3_iv, block, 0, b3_blocklen, B3_PARENT, out);
+  memcpy(cv, out, 8 * sizeof(unsigned int));
+}
+
+Blake3::Blake3(unsigned long long first_chunk) {
+  stack_len = 0;
+  startChunk(first_chunk);
+}
+
+void Blake3::startChunk(unsigned long long chunk) {
+  memcpy(chunk_cv, blake3_iv, sizeof(chunk_cv));
+  chunk_counter = chunk;
+  memset(block, 0, sizeof(block));
+  block_len = 0;
+  blocks_done = 0;
+}
+
+void Blake3::chunkOutput(Output *out) const {
+  memcpy(out->cv, chunk_cv, sizeof(out->cv));
+  b3words(block, out->block);
+  out->counter = chunk_counter;
+  out->blocklen = block_len;
+  out->flags = (blocks_done ? 0 : B3_CHUNK_START) | B3_CHUNK_END;
+}
+
+// The chunk in progress, merged up through every subtree still waiting on the stack
+void Blake3::rootOutput(Output *out) const {
+  chunkOutput(out);
+  for(int i = stack_len - 1; i >= 0; i--) {
+    unsigned int full[16];
+    b3compress(out->cv, out->block, out->counter, out->blocklen, out->flags, full);
+    memcpy(out->block, stack[i], 8 * sizeof(unsigned int));
+    memcpy(out->block + 8, full, 8 * sizeof(unsigned int));
+    memcpy(out->cv, blake3_iv, sizeof(out->cv));
+    out->counter = 0;
+    out->blocklen = b3_blocklen;
+    out->flags = B3_PARENT;
+  }
+}
+
+// total is the number of chunks finished, this one included. Every trailing zero bit is a pair of equal-sized
+// subtrees that can be merged now.
+void Blake3::pushChaining(const unsigned int *cv, unsigned long long total) {
+  unsigned int merged[8];
+  memcpy(merged, cv, sizeof(merged));
+  while(!(total & 1)) {
+    CHECK(stack_len > 0);
+    b3parent(stack[--stack_len], merged, merged);
+    total >>= 1;
+  }
+  memcpy(stack[stack_len++], merged, sizeof(merged));
+}
+
+void Blake3::update(const void *in_data, long long len) {
+  const unsigned char *data = (const unsigned char *)in_data;
+  while(len) {
+    // A full chunk only gets finished once we know it isn't the last one, since the last one is the root
+    if(blocks_done * b3_blocklen + block_len == b3_chunklen) {
+      Output out;
+      chunkOutput(&out);
+      unsigned int full[16];
+      b3compress(out.cv, out.block, out.counter, out.blocklen, out.flags, full);
+      pushChaining(full, chunk_counter + 1);
+      startChunk(chunk_counter + 1);
+    }
+    if(block_len == b3_blocklen) {
+      unsigned int words[16];
+      b3words(block, words);
+      unsigned int full[16];
+      b3compress(chunk_cv, words, chunk_counter, b3_blocklen, blocks_done ? 0 : B3_CHUNK_START, full);
+      memcpy(chunk_cv, full, sizeof(chunk_cv));
+      blocks_done++;
+      memset(block, 0, sizeof(block));
+      block_len = 0;
+    }
+    int take = b3_blocklen - block_len;
+    if(take > len)
+      take = (int)len;
+    memcpy(block + block_len, data, take);
+    block_len += take;
+    data += take;
+    len -= take;
+  }
+}
+
+void Blake3::final(unsigned char *dest, int len) const {
+  Output out;
+  rootOutput(&out);
+  for(unsigned long long counter = 0; len > 0; counter++) {
+    unsigned int full[16];
+    b3compress(out.cv, out.block, counter, out.blocklen, out.flags | B3_ROOT, full);
+    for(int i = 0; i < 64 && len > 0; i++, len--)
+      *dest++ = full[i / 4] >> (i % 4 * 8);
+  }
+}
+
+void Blake3::subtree(unsigned int *cv) const {
+  Output out;
+  rootOutput(&out);
+  unsigned int full[16];
+  b3compress(out.cv, out.block, out.counter, out.blocklen, out.flags, full);
+  memcpy(cv, full, 8 * sizeof(unsigned int));
+}
+
+void Blake3::addSubtree(const unsigned int *cv, int chunks) {
+  CHECK(!blocks_done && !block_len);
+  CHECK(chunks > 0 && !(chunks & (chunks - 1)) && !(chunk_counter & (chunks - 1)));
+  unsigned long long total = chunk_counter + chunks;
+  int level = 0;
+  while((1 << level) < chunks)
+    level++;
+  pushChaining(cv, total >> level);
+  startChunk(total);
+}
+
+Digest::Digest(int in_algo) {
+  algo = in_algo;
+  CHECK(algo >= 0 && algo < HASH_END);
+  if(algo == HASH_SHA1)
+    SHA1_Init(&sha);
+}
+
+void Digest::update(const void *data, long long len) {
+  if(algo == HASH_SHA1)
+    SHA1_Update(&sha, data, len);
+  else
+    blake.update(data, len);
+}
+
+void Digest::final(Checksum *cs) const {
+  cs->algo = algo;
+  if(algo == HASH_SHA1) {
+    SHA_CTX snap = sha;
+    SHA1_Final(cs->bytes, &snap);
+  } else {
+    blake.final(cs->bytes, sizeof(cs->bytes));
+  }
+}
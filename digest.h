@@ -0,0 +1,83 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_DIGEST
+#define PUREBACKUP_DIGEST
+
+#include "util.h"
+
+#include <openssl/sha.h>
+
+using namespace std;
+
+// BLAKE3, straight C++ with no SIMD. It's a Merkle tree over 1KB chunks, so a big file can be cut into pieces that
+// get hashed separately - see subtree() and addSubtree() - and it comes out the same as hashing it front to back.
+class Blake3 {
+public:
+  void update(const void *data, long long len);
+  void final(unsigned char *out, int len) const;
+
+  // For hashing a piece of a bigger input: a hasher started at the piece's first chunk, fed exactly the piece, whose
+  // length has to be a power of two number of chunks, returns the piece's chaining value from subtree(). The hasher
+  // for the whole thing then takes those in order with addSubtree() in place of the bytes, and needs at least one
+  // more byte after the last of them.
+  void subtree(unsigned int *cv) const;
+  void addSubtree(const unsigned int *cv, int chunks);
+
+  Blake3(unsigned long long first_chunk = 0);
+
+private:
+  struct Output {
+    unsigned int cv[8];
+    unsigned int block[16];
+    unsigned long long counter;
+    unsigned int blocklen;
+    unsigned int flags;
+  };
+
+  void startChunk(unsigned long long chunk);
+  void chunkOutput(Output *out) const;
+  void rootOutput(Output *out) const;
+  void pushChaining(const unsigned int *cv, unsigned long long total);
+
+  unsigned int chunk_cv[8];
+  unsigned long long chunk_counter;
+  unsigned char block[64];
+  int block_len;
+  int blocks_done;
+
+  unsigned int stack[54][8];  // one per set bit of the chunk count
+  int stack_len;
+};
+
+// Whichever hash a checksum is using, behind one interface. Copying one takes a snapshot that can be finished
+// without disturbing the original.
+class Digest {
+public:
+  void update(const void *data, long long len);
+  void final(Checksum *cs) const;  // fills in bytes and algo
+
+  Digest(int algo);
+
+private:
+  int algo;
+  SHA_CTX sha;
+  Blake3 blake;
+};
+
+#endif
@@ -0,0 +1,214 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "exclude.h"
+#include "mask.h"
+#include "parse.h"
+#include "debug.h"
+
+#include <fstream>
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+enum { ET_FILE = 1, ET_SYMLINK = 2, ET_FIFO = 4, ET_SOCKET = 8, ET_DEVICE = 16 };
+
+class ExcludeRule {
+public:
+  string name;
+
+  MaskSet pattern;  // empty if any path will do
+  long long larger;
+  long long olderthan;
+  long long newerthan;
+  int types;
+  string tagfile;
+  bool cachedirtag;
+
+  long long files;
+  long long bytes;
+  long long dirs;
+
+  bool forDirectories() const { return tagfile.size() || cachedirtag; }
+
+  ExcludeRule() {
+    larger = -1;
+    olderthan = -1;
+    newerthan = -1;
+    types = 0;
+    cachedirtag = false;
+    files = 0;
+    bytes = 0;
+    dirs = 0;
+  }
+};
+
+static vector<ExcludeRule> rules;
+static time_t scan_time = time(NULL);
+static set<string> recheck;
+
+void addExcludeRule(kvData kvd) {
+  ExcludeRule rule;
+  if(kvd.kv.count("pattern")) {
+    vector<string> pats = tokenize(kvd.consume("pattern"), "\n");
+    for(int i = 0; i < pats.size(); i++)
+      rule.pattern.addGlob(pats[i]);
+  }
+  if(kvd.kv.count("larger"))
+    rule.larger = atoll(kvd.consume("larger").c_str());
+  if(kvd.kv.count("olderthan"))
+    rule.olderthan = atoll(kvd.consume("olderthan").c_str());
+  if(kvd.kv.count("newerthan"))
+    rule.newerthan = atoll(kvd.consume("newerthan").c_str());
+  if(kvd.kv.count("type")) {
+    vector<string> types = tokenize(kvd.consume("type"), " ");
+    for(int i = 0; i < types.size(); i++) {
+      if(types[i] == "file")
+        rule.types |= ET_FILE;
+      else if(types[i] == "symlink")
+        rule.types |= ET_SYMLINK;
+      else if(types[i] == "fifo")
+        rule.types |= ET_FIFO;
+      else if(types[i] == "socket")
+        rule.types |= ET_SOCKET;
+      else if(types[i] == "device")
+        rule.types |= ET_DEVICE;
+      else
+        CHECK(0);
+    }
+  }
+  if(kvd.kv.count("tagfile"))
+    rule.tagfile = kvd.consume("tagfile");
+  if(kvd.kv.count("cachedirtag"))
+    rule.cachedirtag = atoi(kvd.consume("cachedirtag").c_str());
+  if(kvd.kv.count("name"))
+    rule.name = kvd.consume("name");
+  CHECK(kvd.isDone());
+  
+  // A rule that says nothing would drop everything, which is probably a typo
+  CHECK(rule.pattern.patterns() || rule.larger != -1 || rule.olderthan != -1 || rule.newerthan != -1 || rule.types || rule.forDirectories());
+  // and directories don't have sizes or ages worth going by
+  CHECK(!rule.forDirectories() || (rule.larger == -1 && rule.olderthan == -1 && rule.newerthan == -1 && !rule.types));
+  
+  if(!rule.name.size())
+    rule.name = StringPrintf("rule %d", (int)rules.size() + 1);
+  rules.push_back(rule);
+}
+
+static int typeOf(int mode) {
+  if(mode == S_IFLNK)
+    return ET_SYMLINK;
+  if(mode == S_IFIFO)
+    return ET_FIFO;
+  if(mode == S_IFSOCK)
+    return ET_SOCKET;
+  if(mode == S_IFCHR || mode == S_IFBLK)
+    return ET_DEVICE;
+  return ET_FILE;
+}
+
+static bool patternMatches(ExcludeRule *rule, const string &path) {
+  return !rule->pattern.patterns() || rule->pattern.matches(rule->pattern.step(rule->pattern.start(), path));
+}
+
+bool excludeFile(const string &path, const DirListOut &dlo) {
+  if(dlo.null || dlo.mode == S_IFDIR)
+    return false;
+  for(int i = 0; i < rules.size(); i++) {
+    ExcludeRule &rule = rules[i];
+    if(rule.forDirectories())
+      continue;
+    if(rule.larger != -1 && dlo.size <= rule.larger)
+      continue;
+    if(rule.olderthan != -1 && dlo.timestamp >= scan_time - rule.olderthan)
+      continue;
+    if(rule.newerthan != -1 && dlo.timestamp <= scan_time - rule.newerthan)
+      continue;
+    if(rule.types && !(rule.types & typeOf(dlo.mode)))
+      continue;
+    if(!patternMatches(&rule, path))
+      continue;
+    rule.files++;
+    rule.bytes += dlo.size;
+    if(rule.newerthan != -1)
+      recheck.insert(path.substr(0, path.rfind('/')));
+    return true;
+  }
+  return false;
+}
+
+static bool isCacheDirTag(const string &fname) {
+  static const char signature[] = "Signature: 8a477f597d28d172789f06886806bc55";
+  char buf[sizeof(signature) - 1];
+  ifstream ifs(fname.c_str(), ios::binary);
+  return ifs.read(buf, sizeof(buf)) && !memcmp(buf, signature, sizeof(buf));
+}
+
+bool excludeDirectory(const string &path, const string &source, const vector<DirListOut> &fils) {
+  for(int i = 0; i < rules.size(); i++) {
+    ExcludeRule &rule = rules[i];
+    if(!rule.forDirectories() || !patternMatches(&rule, path))
+      continue;
+    bool tagged = false;
+    for(int j = 0; j < fils.size() && !tagged; j++) {
+      if(fils[j].directory || fils[j].null)
+        continue;
+      if(rule.tagfile.size() && fils[j].itemname == rule.tagfile)
+        tagged = true;
+      if(rule.cachedirtag && fils[j].itemname == "CACHEDIR.TAG" && isCacheDirTag(source + "/CACHEDIR.TAG"))
+        tagged = true;
+    }
+    if(!tagged)
+      continue;
+    // We don't list what's beneath, so only the top level gets counted
+    rule.dirs++;
+    for(int j = 0; j < fils.size(); j++) {
+      if(!fils[j].directory && !fils[j].null) {
+        rule.files++;
+        rule.bytes += fils[j].size;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+const set<string> &excludeRecheck() {
+  return recheck;
+}
+
+void resetExcludeStats() {
+  for(int i = 0; i < rules.size(); i++) {
+    rules[i].files = 0;
+    rules[i].bytes = 0;
+    rules[i].dirs = 0;
+  }
+  recheck.clear();
+  scan_time = time(NULL);
+}
+
+void printExcludeStats() {
+  for(int i = 0; i < rules.size(); i++) {
+    if(rules[i].forDirectories())
+      printf("Excluded by %s: %lld directories, %lld files and %lld bytes directly in them\n", rules[i].name.c_str(), rules[i].dirs, rules[i].files, rules[i].bytes);
+    else
+      printf("Excluded by %s: %lld files, %lld bytes\n", rules[i].name.c_str(), rules[i].files, rules[i].bytes);
+  }
+}
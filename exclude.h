@@ -0,0 +1,58 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_EXCLUDE
+#define PUREBACKUP_EXCLUDE
+
+#include "util.h"
+
+#include <string>
+#include <vector>
+#include <set>
+
+using namespace std;
+
+class kvData;
+
+// Things that aren't worth backing up, going by what they are rather than where. Each "exclude" category in the
+// config is one rule, which drops whatever meets every condition it has:
+//
+//   pattern=*.tmp      the path matches, as with mask patterns
+//   larger=N           files over N bytes
+//   olderthan=N        files last changed more than N seconds before the scan
+//   newerthan=N        or less than N seconds before it
+//   type=fifo socket   files of these types - file, symlink, fifo, socket, device
+//   tagfile=NAME       directories holding a file called NAME, and everything in them
+//   cachedirtag=1      directories with a CACHEDIR.TAG, per the Cache Directory Tagging spec
+//
+// name= labels the rule in the per-run counts.
+void addExcludeRule(kvData kvd);
+
+// Called by the scan before anything gets an Item. A directory is checked once it's been listed, and dropped whole.
+bool excludeFile(const string &path, const DirListOut &dlo);
+bool excludeDirectory(const string &path, const string &source, const vector<DirListOut> &fils);
+
+// Directories where a newerthan rule dropped something. It'll be old enough eventually without the directory
+// changing, so the next scan has to list them whatever the journal says.
+const set<string> &excludeRecheck();
+
+// Clears the counts, and sets the time the age rules measure from
+void resetExcludeStats();
+void printExcludeStats();
+
+#endif
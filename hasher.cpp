@@ -0,0 +1,255 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "hasher.h"
+
+#include "thread.h"
+#include "stats.h"
+#include "debug.h"
+
+#include <openssl/sha.h>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#ifdef PUREBACKUP_URING
+#include <liburing.h>
+#endif
+
+using namespace std;
+
+
+static vector<long long> jobPoints(const HashJob &job) {
+  vector<long long> points(1, job.item->size());
+  if(job.prefix != -1)
+    points.push_back(job.prefix);
+  return points;
+}
+
+static void hashOne(int task, void *data) {
+  const HashJob &job = (*(const vector<HashJob> *)data)[task];
+  if(job.item->isReadable())
+    job.item->checksumPoints(jobPoints(job));
+}
+
+#ifdef PUREBACKUP_URING
+
+const int uringdepth = 32;  // reads in flight per thread
+const int uringfiles = 8;   // files open at once per thread
+const int uringperfile = 4; // so one big file can't take the whole queue
+
+class UringFile {
+public:
+  const Item *item;
+  int fd;
+  long long submitted;
+  long long end;
+  int inflight;
+  bool failed;
+  ChecksumPoints points;
+  map<long long, pair<int, int> > ready; // completed but not yet hashed: offset -> buffer, length
+};
+
+class UringRead {
+public:
+  int file;
+  int buf;
+  long long offset;
+  int len;
+};
+
+class UringSlice {
+public:
+  vector<HashJob> jobs;
+  bool done;
+};
+
+// Only hands back what got hashed, same as ItemShunt - a file that failed partway may still be cached past that
+static void closeFile(UringFile *uf) {
+#ifdef POSIX_FADV_DONTNEED
+  if(ioconfig.fadvise && uf->points.done())
+    posix_fadvise(uf->fd, 0, uf->points.done(), POSIX_FADV_DONTNEED);
+#endif
+  close(uf->fd);
+  uf->item = NULL;
+}
+
+// Returns false if we couldn't get a ring at all, in which case nothing's been touched
+static bool hashSliceUring(const vector<HashJob> &jobs) {
+  io_uring ring;
+  if(io_uring_queue_init(uringdepth, &ring, 0) < 0)
+    return false;
+  
+  const int bufsize = ioconfig.readsize;
+  vector<char *> bufs(uringdepth);
+  vector<iovec> iov(uringdepth);
+  vector<int> freebufs;
+  for(int i = 0; i < uringdepth; i++) {
+    CHECK(!posix_memalign((void **)&bufs[i], 4096, bufsize));
+    iov[i].iov_base = bufs[i];
+    iov[i].iov_len = bufsize;
+    freebufs.push_back(i);
+  }
+  // Registered buffers save the kernel mapping them on every read, but they count against the memlock limit
+  bool fixed = !io_uring_register_buffers(&ring, &iov[0], uringdepth);
+  
+  vector<UringFile> files(uringfiles);
+  for(int i = 0; i < files.size(); i++)
+    files[i].item = NULL;
+  vector<UringRead> reads(uringdepth);
+  int next = 0;
+  
+  while(1) {
+    int active = 0;
+    for(int i = 0; i < files.size(); i++) {
+      UringFile &uf = files[i];
+      while(!uf.item && next < jobs.size()) {
+        const HashJob &job = jobs[next++];
+        const Item *item = job.item;
+        if(!item->isReadable())
+          continue;
+        ChecksumPoints points(item, jobPoints(job), checksumconfig.algorithm);
+        if(points.done() == points.end())
+          continue;  // already cached, or empty
+        int fd = open(item->localPath(), O_RDONLY);
+        if(fd == -1)
+          continue;
+#ifdef POSIX_FADV_SEQUENTIAL
+        if(ioconfig.fadvise)
+          posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        uf.item = item;
+        uf.fd = fd;
+        uf.submitted = 0;
+        uf.end = points.end();
+        uf.inflight = 0;
+        uf.failed = false;
+        uf.ready.clear();
+        uf.points = points;
+      }
+      if(!uf.item)
+        continue;
+      active++;
+      
+      while(!uf.failed && uf.inflight < uringperfile && freebufs.size() && uf.submitted < uf.end) {
+        int buf = freebufs.back();
+        freebufs.pop_back();
+        UringRead &rd = reads[buf];
+        rd.file = i;
+        rd.buf = buf;
+        rd.offset = uf.submitted;
+        rd.len = (int)min((long long)bufsize, uf.end - uf.submitted);
+        io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        CHECK(sqe);
+        if(fixed)
+          io_uring_prep_read_fixed(sqe, uf.fd, bufs[buf], rd.len, rd.offset, buf);
+        else
+          io_uring_prep_read(sqe, uf.fd, bufs[buf], rd.len, rd.offset);
+        io_uring_sqe_set_data(sqe, &rd);
+        uf.submitted += rd.len;
+        uf.inflight++;
+      }
+    }
+    
+    if(!active)
+      break;
+    
+    if(freebufs.size() != uringdepth) {
+      CHECK(io_uring_submit(&ring) >= 0);
+      
+      io_uring_cqe *cqe;
+      CHECK(!io_uring_wait_cqe(&ring, &cqe));
+      do {
+        UringRead *rd = (UringRead *)io_uring_cqe_get_data(cqe);
+        UringFile &uf = files[rd->file];
+        uf.inflight--;
+        if(cqe->res != rd->len) {
+          // Short or failed - leave this one for the ordinary path, which will report it properly
+          uf.failed = true;
+          freebufs.push_back(rd->buf);
+        } else {
+          countStat(STAT_BYTESREAD, rd->len);
+          uf.ready[rd->offset] = make_pair(rd->buf, rd->len);
+        }
+        io_uring_cqe_seen(&ring, cqe);
+      } while(!io_uring_peek_cqe(&ring, &cqe));
+    }
+    
+    // Hash whatever's arrived in order, and retire files that are finished
+    for(int i = 0; i < files.size(); i++) {
+      UringFile &uf = files[i];
+      if(!uf.item)
+        continue;
+      while(uf.ready.size() && uf.ready.begin()->first == uf.points.done()) {
+        pair<int, int> got = uf.ready.begin()->second;
+        uf.points.feed(bufs[got.first], got.second);
+        freebufs.push_back(got.first);
+        uf.ready.erase(uf.ready.begin());
+      }
+      if(uf.inflight)
+        continue;
+      if(uf.failed) {
+        for(map<long long, pair<int, int> >::iterator itr = uf.ready.begin(); itr != uf.ready.end(); itr++)
+          freebufs.push_back(itr->second.first);
+        uf.ready.clear();
+        closeFile(&uf);
+      } else if(uf.points.done() == uf.end) {
+        countStat(STAT_BYTESHASHED, uf.end);
+        closeFile(&uf);
+      }
+    }
+  }
+  
+  if(fixed)
+    io_uring_unregister_buffers(&ring);
+  io_uring_queue_exit(&ring);
+  for(int i = 0; i < uringdepth; i++)
+    free(bufs[i]);
+  return true;
+}
+
+static void hashSlice(int task, void *data) {
+  UringSlice &slice = (*(vector<UringSlice> *)data)[task];
+  slice.done = hashSliceUring(slice.jobs);
+}
+
+#endif
+
+void batchChecksum(const vector<HashJob> &jobs) {
+#ifdef PUREBACKUP_URING
+  {
+    // Several slices per thread, so a slice full of big files doesn't leave the other threads idle at the end
+    vector<UringSlice> slices(threadCount() * 4);
+    for(int i = 0; i < jobs.size(); i++)
+      slices[i % slices.size()].jobs.push_back(jobs[i]);
+    parallelFor(slices.size(), hashSlice, &slices);
+    
+    vector<HashJob> left;
+    for(int i = 0; i < slices.size(); i++)
+      if(!slices[i].done)
+        left.insert(left.end(), slices[i].jobs.begin(), slices[i].jobs.end());
+    if(!left.size())
+      return;
+    printf("No io_uring for %d files, hashing them with threads\n", (int)left.size());
+    parallelFor(left.size(), hashOne, &left);
+    return;
+  }
+#endif
+  parallelFor(jobs.size(), hashOne, (void *)&jobs);
+}
@@ -0,0 +1,38 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_HASHER
+#define PUREBACKUP_HASHER
+
+#include "item.h"
+
+#include <vector>
+
+using namespace std;
+
+// Computes the full checksum of every item and leaves it in the item's cache, keeping many reads in flight across
+// many files instead of one blocking read at a time. Built with PUREBACKUP_URING it drives an io_uring per worker
+// thread; otherwise, or if the kernel won't give us a ring, each thread hashes one file at a time.
+// Items that can't be read are skipped - whoever asks for their checksum later will find out.
+struct HashJob {
+  const Item *item;
+  long long prefix;  // a shorter length to cache the checksum at on the way past, for files that grew; -1 if none
+};
+void batchChecksum(const vector<HashJob> &jobs);
+
+#endif
@@ -19,8 +19,48 @@
 #include "item.h"
 #include "debug.h"
 #include "parse.h"
+#include "stats.h"
+#include "thread.h"
 
-#include <openssl/sha.h>
+#include <algorithm>
+#include <functional>
+#include <set>
+
+#ifndef WIN32API
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+IoConfig ioconfig;
+
+IoConfig::IoConfig() {
+  readsize = 1 << 20;
+  fadvise = true;
+  direct = false;
+  directmin = 64 << 20;
+  mmap = true;
+  mmapmin = 4 << 20;
+  sparse = true;
+  zerorun = 64 << 10;
+}
+
+ChecksumConfig checksumconfig;
+
+ChecksumConfig::ChecksumConfig() {
+  algorithm = HASH_SHA1;
+  parallelmin = 64 << 20;
+}
 
 string Metadata::toKvd() const {
   kvData kvd;
@@ -36,6 +76,165 @@ Metadata metaParseFromKvd(kvData kvd) {
   return mtd;
 }
 
+string holeMapString(const HoleMap &holes) {
+  string rv;
+  for(int i = 0; i < holes.size(); i++)
+    rv += StringPrintf("%s%lld+%lld", i ? "," : "", holes[i].first, holes[i].second);
+  return rv;
+}
+
+HoleMap holeMapParse(const string &str) {
+  HoleMap rv;
+  vector<string> toks = tokenize(str, ",");
+  for(int i = 0; i < toks.size(); i++) {
+    pair<long long, long long> hole;
+    CHECK(sscanf(toks[i].c_str(), "%lld+%lld", &hole.first, &hole.second) == 2);
+    CHECK(hole.second > 0 && (rv.empty() || rv.back().first + rv.back().second < hole.first));
+    rv.push_back(hole);
+  }
+  return rv;
+}
+
+// This gets asked about every block we archive, nearly all of which aren't zero, so it ORs everything together a
+// vector at a time and only looks at the result once at the end
+bool allZero(const char *data, int len) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for(; i + 16 <= len; i += 16)
+    acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(data + i)));
+  if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+    return false;
+#else
+  unsigned long long acc = 0;
+  for(; i + 8 <= len; i += 8) {
+    unsigned long long word;
+    memcpy(&word, data + i, sizeof(word));
+    acc |= word;
+  }
+  if(acc)
+    return false;
+#endif
+  for(; i < len; i++)
+    if(data[i])
+      return false;
+  return true;
+}
+
+static const char zeros[65536] = { 0 };
+
+void feedZeros(long long len, void (*func)(const char *data, int len, void *ctx), void *ctx) {
+  while(len) {
+    int piece = (int)min((long long)sizeof(zeros), len);
+    func(zeros, piece, ctx);
+    len -= piece;
+  }
+}
+
+// Blocks, not bytes, so a few stray zeros in the middle of real data don't make us look any harder
+static const int zeroblock = 4096;
+
+ZeroRuns::ZeroRuns(long long in_pos, void (*in_literal)(const char *data, int len, void *ctx), void (*in_run)(long long start, long long len, void *ctx), void *in_ctx) {
+  pos = in_pos;
+  zerostart = -1;
+  known = false;
+  literal = in_literal;
+  run = in_run;
+  ctx = in_ctx;
+}
+
+void ZeroRuns::feed(const char *data, int len) {
+  if(!ioconfig.zerorun && zerostart == -1) {
+    if(len)
+      literal(data, len, ctx);
+    pos += len;
+    return;
+  }
+  int written = 0;
+  for(int at = 0; at < len; ) {
+    int block = (int)min((long long)(len - at), zeroblock - (pos + at) % zeroblock);
+    if(ioconfig.zerorun && allZero(data + at, block)) {
+      if(zerostart == -1) {
+        if(at > written)
+          literal(data + written, at - written, ctx);
+        zerostart = pos + at;
+      }
+    } else if(zerostart != -1) {
+      settle(pos + at);
+      written = at;
+    }
+    at += block;
+  }
+  if(zerostart == -1 && len > written)
+    literal(data + written, len - written, ctx);
+  pos += len;
+}
+
+void ZeroRuns::hole(long long len) {
+  if(zerostart == -1)
+    zerostart = pos;
+  known = true;
+  pos += len;
+}
+
+void ZeroRuns::finish() {
+  settle(pos);
+}
+
+void ZeroRuns::settle(long long end) {
+  if(zerostart == -1)
+    return;
+  long long len = end - zerostart;
+  if(known || len >= ioconfig.zerorun)
+    run(zerostart, len, ctx);
+  else
+    feedZeros(len, literal, ctx);
+  zerostart = -1;
+  known = false;
+}
+
+long long ItemShunt::scan(long long start, long long end, void (*func)(const char *data, int len, void *ctx), void *ctx) {
+  seek(start);
+  vector<char> buf((int)min((long long)ioconfig.readsize, end - start));
+  long long pos = start;
+  while(pos < end) {
+    int desired = (int)min((long long)buf.size(), end - pos);
+    int rv = read(&buf[0], desired);
+    if(rv)
+      func(&buf[0], rv, ctx);
+    pos += rv;
+    if(rv != desired)
+      break;
+  }
+  return pos - start;
+}
+
+// The filesystem hands back its holes at block granularity. Anything past the end of the file isn't a hole - if the
+// file shrank since we planned, the read that hits the end has to be the one that notices.
+void findHoles(int fd, long long start, long long end, HoleMap *out) {
+#if !defined(WIN32API) && defined(SEEK_HOLE)
+  if(!ioconfig.sparse)
+    return;
+  long long pos = start;
+  while(pos < end) {
+    long long hole = lseek(fd, pos, SEEK_HOLE);
+    if(hole < 0 || hole >= end)
+      break;  // either there aren't any more, or the filesystem can't tell us
+    long long data = lseek(fd, hole, SEEK_DATA);
+    if(data < 0) {
+      struct stat stt;
+      CHECK(!fstat(fd, &stt));
+      data = stt.st_size;  // hole runs to the end of the file
+    }
+    data = min(data, end);
+    if(data <= hole)
+      break;
+    out->push_back(make_pair(hole, data - hole));
+    pos = data;
+  }
+#endif
+}
+
 #ifdef WIN32API
 void ItemShunt::seek(long long pos) {
   LONG low = pos;
@@ -49,11 +248,28 @@ int ItemShunt::read(char *buffer, int len) {
     printf("Problem with reading from %s\n", fname.c_str());
     CHECK(0);
   }
+  countStat(STAT_BYTESREAD, out);
   return out;
 }
+void ItemShunt::readWindows(const long long *offsets, const int *lens, int count, char *dest) {
+  // Positioned reads, so there's no seek between windows
+  for(int i = 0; i < count; i++) {
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)offsets[i];
+    ov.OffsetHigh = (DWORD)(offsets[i] >> 32);
+    DWORD out;
+    if(!ReadFile(local_file, dest, lens[i], &out, &ov) || out != lens[i]) {
+      printf("Problem with reading windows from %s\n", fname.c_str());
+      CHECK(0);
+    }
+    countStat(STAT_BYTESREAD, out);
+    dest += lens[i];
+  }
+}
 
 ItemShunt* ItemShunt::LocalFile(const string &local_fname) {
-  HANDLE local_file = CreateFile(local_fname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+  HANDLE local_file = CreateFile(local_fname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, ioconfig.fadvise ? FILE_FLAG_SEQUENTIAL_SCAN : 0, NULL);
   if(local_file == INVALID_HANDLE_VALUE) {
     printf("Failure at opening %s!\n", local_fname.c_str());
     return NULL;
@@ -64,6 +280,9 @@ ItemShunt* ItemShunt::LocalFile(const string &local_fname) {
   isr->fname = local_fname;
   return isr;
 }
+// FSCTL_QUERY_ALLOCATED_RANGES would do it, but nothing we back up on Windows is sparse yet
+void ItemShunt::holes(long long start, long long end, HoleMap *out) const {
+}
 ItemShunt::ItemShunt() {
   local_file = NULL;
 }
@@ -71,140 +290,660 @@ ItemShunt::~ItemShunt() {
   CloseHandle(local_file);
 }
 #else
-void ItemShunt::seek(long long pos) {
-  fseeko(local_file, pos, SEEK_SET);
+// Raw fds and positioned reads, so there's no stdio buffer copying everything one more time
+static const long long dropinterval = 8 << 20;
+static const int directalign = 4096;
+
+void ItemShunt::seek(long long in_pos) {
+  flushConsumed();
+  pos = in_pos;
+  dropped = pos;  // only hand back what we read ourselves - someone else may be partway through the rest
 }
 int ItemShunt::read(char *buffer, int len) {
-  return fread(buffer, 1, len, local_file);
+  int done = 0;
+  while(done < len) {
+    int rv;
+    if(bounce) {
+      if(pos < bounce_start || pos >= bounce_start + bounce_len) {
+        bounce_start = pos & ~(long long)(directalign - 1);
+        bounce_len = pread(local_file, bounce, ioconfig.readsize, bounce_start);
+        if(bounce_len < 0) {
+          printf("Problem with reading from %s\n", fname.c_str());
+          CHECK(0);
+        }
+        if(pos >= bounce_start + bounce_len)
+          break;
+      }
+      rv = (int)min((long long)(len - done), bounce_start + bounce_len - pos);
+      memcpy(buffer + done, bounce + (pos - bounce_start), rv);
+    } else {
+      rv = pread(local_file, buffer + done, min(len - done, ioconfig.readsize), pos);
+      if(rv < 0) {
+        printf("Problem with reading from %s\n", fname.c_str());
+        CHECK(0);
+      }
+      if(!rv)
+        break;
+    }
+    done += rv;
+    pos += rv;
+  }
+  countStat(STAT_BYTESREAD, done);
+  dropConsumed();
+  return done;
+}
+void ItemShunt::readWindows(const long long *offsets, const int *lens, int count, char *dest) {
+  for(int i = 0; i < count; i++) {
+    seek(offsets[i]);
+    CHECK(read(dest, lens[i]) == lens[i]);
+    dest += lens[i];
+  }
+}
+
+void ItemShunt::holes(long long start, long long end, HoleMap *out) const {
+  findHoles(local_file, start, end, out);
+}
+
+// We're never going to read it again, so don't let it push everyone else's pages out of the cache
+void ItemShunt::dropConsumed() {
+  if(pos - dropped >= dropinterval)
+    flushConsumed();
+}
+// Hands back [dropped, pos), and nothing else - a file we only peeked at keeps whatever was cached before
+void ItemShunt::flushConsumed() {
+#ifdef POSIX_FADV_DONTNEED
+  if(ioconfig.fadvise && !bounce && pos > dropped)
+    posix_fadvise(local_file, dropped, pos - dropped, POSIX_FADV_DONTNEED);
+#endif
+  dropped = pos;
 }
 
-ItemShunt::ItemShunt(const string &local_fname) {
-  local_file = fopen(local_fname.c_str(), "rb");
-  CHECK(local_file);
+ItemShunt* ItemShunt::LocalFile(const string &local_fname) {
+  int local_file = -1;
+  bool direct = false;
+#ifdef O_DIRECT
+  if(ioconfig.direct) {
+    struct stat stt;
+    if(!stat(local_fname.c_str(), &stt) && stt.st_size >= ioconfig.directmin) {
+      local_file = open(local_fname.c_str(), O_RDONLY | O_DIRECT);
+      direct = (local_file != -1);  // not every filesystem will do it, and that's fine
+    }
+  }
+#endif
+  if(local_file == -1)
+    local_file = open(local_fname.c_str(), O_RDONLY);
+  if(local_file == -1) {
+    printf("Failure at opening %s!\n", local_fname.c_str());
+    return NULL;
+  }
+  
+#ifdef POSIX_FADV_SEQUENTIAL
+  if(ioconfig.fadvise && !direct)
+    posix_fadvise(local_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  
+  ItemShunt *isr = new ItemShunt;
+  isr->local_file = local_file;
+  isr->fname = local_fname;
+  if(direct)
+    CHECK(!posix_memalign((void **)&isr->bounce, directalign, ioconfig.readsize));
+  return isr;
+}
+ItemShunt::ItemShunt() {
+  local_file = -1;
+  pos = 0;
+  dropped = 0;
+  bounce = NULL;
+  bounce_start = 0;
+  bounce_len = 0;
 }
 ItemShunt::~ItemShunt() {
-  fclose(local_file);
+  flushConsumed();
+  free(bounce);
+  close(local_file);
+}
+#endif
+
+#ifdef WIN32API
+// Windows won't let anyone truncate a file while it's mapped, but it'll throw an in-page exception instead if the
+// volume goes away, and there's no catching that without SEH. Everything goes through ItemShunt there.
+long long ItemMapping::scan(long long start, long long end, void (*func)(const char *data, int len, void *ctx), void *ctx) {
+  CHECK(0);
+}
+void ItemMapping::holes(long long start, long long end, HoleMap *out) const {
+  CHECK(0);
+}
+ItemMapping* ItemMapping::LocalFile(const string &local_fname, long long len) {
+  return NULL;
+}
+ItemMapping::ItemMapping() { }
+ItemMapping::~ItemMapping() { }
+#else
+// Set while this thread is inside ItemMapping::scan(), so a SIGBUS from a truncated file can unwind back out of it
+static __thread sigjmp_buf *mapping_guard = NULL;
+static pthread_once_t mapping_once = PTHREAD_ONCE_INIT;
+
+static void mappingFault(int sig, siginfo_t *info, void *uctx) {
+  if(mapping_guard)
+    siglongjmp(*mapping_guard, 1);
+  signal(sig, SIG_DFL); // not one of ours, so die the way we would have anyway
+  raise(sig);
+}
+
+static void installMappingFault() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = mappingFault;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  CHECK(!sigaction(SIGBUS, &sa, NULL));
+}
+
+long long ItemMapping::scan(long long start, long long end, void (*func)(const char *data, int len, void *ctx), void *ctx) {
+  CHECK(start >= 0 && start <= end && end <= len);
+  if(start != scanned) {
+    dropConsumed(scanned);  // as ItemShunt::seek(), only what we got through ourselves
+    dropped = start;
+  }
+  volatile long long pos = start;  // has to survive the longjmp
+  sigjmp_buf guard;
+  if(sigsetjmp(guard, 1)) {
+    mapping_guard = NULL;
+    scanned = pos;
+    printf("%s shrank while it was being read, stopped at %lld of %lld\n", fname.c_str(), (long long)pos, end);
+    return pos - start;
+  }
+  mapping_guard = &guard;
+  while(pos < end) {
+    int piece = (int)min((long long)ioconfig.readsize, end - pos);
+    func(base + pos, piece, ctx);
+    pos += piece;
+    countStat(STAT_BYTESREAD, piece);
+    
+    if(pos - dropped >= dropinterval)
+      dropConsumed(pos);
+  }
+  mapping_guard = NULL;
+  scanned = end;
+  return end - start;
+}
+
+// Same as ItemShunt::flushConsumed() - the pages have to come out of our mapping before the kernel will let them go
+void ItemMapping::dropConsumed(long long upto) {
+  if(ioconfig.fadvise && upto > dropped) {
+    long long from = dropped - dropped % sysconf(_SC_PAGESIZE);
+    madvise((void *)(base + from), upto - from, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(local_file, from, upto - from, POSIX_FADV_DONTNEED);
+#endif
+  }
+  dropped = upto;
+}
+
+void ItemMapping::holes(long long start, long long end, HoleMap *out) const {
+  findHoles(local_file, start, end, out);
+}
+
+ItemMapping* ItemMapping::LocalFile(const string &local_fname, long long len) {
+  if(!ioconfig.mmap || len < ioconfig.mmapmin || len <= 0)
+    return NULL;
+  if(ioconfig.direct && len >= ioconfig.directmin)
+    return NULL;  // they asked for these to stay out of the page cache
+  
+  pthread_once(&mapping_once, installMappingFault);
+  
+  int local_file = open(local_fname.c_str(), O_RDONLY);
+  if(local_file == -1)
+    return NULL;  // let ItemShunt complain about it
+  void *base = mmap(NULL, len, PROT_READ, MAP_SHARED, local_file, 0);
+  if(base == MAP_FAILED) {
+    close(local_file);
+    return NULL;
+  }
+  if(ioconfig.fadvise)
+    madvise(base, len, MADV_SEQUENTIAL);
+  
+  ItemMapping *imr = new ItemMapping;
+  imr->local_file = local_file;
+  imr->base = (const char *)base;
+  imr->len = len;
+  imr->fname = local_fname;
+  return imr;
+}
+ItemMapping::ItemMapping() {
+  local_file = -1;
+  base = NULL;
+  len = 0;
+  dropped = 0;
+  scanned = 0;
+}
+ItemMapping::~ItemMapping() {
+  if(base)
+    dropConsumed(scanned);
+  munmap((void *)base, len);
+  close(local_file);
 }
 #endif
 
+ChecksumCache::Entry *ChecksumCache::entry(int i) {
+  if(i < INLINE_ENTRIES)
+    return &local[i];
+  return &(*spill)[i - INLINE_ENTRIES];
+}
+const ChecksumCache::Entry *ChecksumCache::entry(int i) const {
+  if(i < INLINE_ENTRIES)
+    return &local[i];
+  return &(*spill)[i - INLINE_ENTRIES];
+}
+
+const Checksum *ChecksumCache::find(long long len, bool full, int algo) const {
+  for(int i = 0; i < count; i++) {
+    const Entry *ent = entry(i);
+    if(ent->len == len && (!full || (ent->full && (algo == -1 || ent->cs.algo == algo))))
+      return &ent->cs;
+  }
+  return NULL;
+}
+
+static int cache_spills = 0;  // the state load and the scan can both bump these at once
+
+void ChecksumCache::insert(long long len, const Checksum &cs, bool full) {
+  for(int i = 0; i < count; i++) {
+    Entry *ent = entry(i);
+    if(ent->len != len)
+      continue;
+    // The signature doesn't depend on the hash, so a signature-only entry can be filled in by either, but a full
+    // checksum of the other kind stays alongside
+    if(full && ent->full && ent->cs.algo != cs.algo)
+      continue;
+    if(full || !ent->full) {
+      ent->cs = cs;
+      ent->full = full;
+    }
+    return;
+  }
+  if(count == INLINE_ENTRIES) {
+    CHECK(!spill);
+    spill = new vector<Entry>;
+    __sync_fetch_and_add(&cache_spills, 1);
+  }
+  if(count >= INLINE_ENTRIES)
+    spill->resize(count - INLINE_ENTRIES + 1);
+  Entry *ent = entry(count++);
+  ent->len = len;
+  ent->cs = cs;
+  ent->full = full;
+}
+
+bool ChecksumCache::hasFull() const {
+  for(int i = 0; i < count; i++)
+    if(entry(i)->full)
+      return true;
+  return false;
+}
+
+ChecksumCache::ChecksumCache() {
+  count = 0;
+  spill = NULL;
+}
+ChecksumCache::ChecksumCache(const ChecksumCache &cc) {
+  count = 0;
+  spill = NULL;
+  *this = cc;
+}
+void ChecksumCache::operator=(const ChecksumCache &cc) {
+  if(&cc == this)
+    return;
+  delete spill;
+  spill = NULL;
+  for(int i = 0; i < INLINE_ENTRIES; i++)
+    local[i] = cc.local[i];
+  count = cc.count;
+  if(cc.spill) {
+    spill = new vector<Entry>(*cc.spill);
+    __sync_fetch_and_add(&cache_spills, 1);
+  }
+}
+ChecksumCache::~ChecksumCache() {
+  delete spill;
+}
+
+// Local paths are never freed, and there are millions of them, so we pack them into large blocks rather than
+// giving each its own allocation. Blocks never move, so the pointers stay valid forever. Only the scan makes local
+// items, so there's no lock.
+static const int pool_blocksize = 1 << 20;
+static char *pool_pos = NULL;
+static int pool_left = 0;
+static int pool_blocks = 0;
+static long long pool_bytes = 0;
+
+static const char *internPath(const string &path) {
+  int len = path.size() + 1;
+  if(len > pool_left) {
+    int blen = max(len, pool_blocksize);
+    pool_pos = new char[blen];
+    pool_left = blen;
+    pool_blocks++;
+  }
+  char *rv = pool_pos;
+  memcpy(rv, path.c_str(), len);
+  pool_pos += len;
+  pool_left -= len;
+  pool_bytes += len;
+  return rv;
+}
+
+static int version_allocs = 0;
+
 ItemShunt *Item::open() const {
   CHECK(type == MTI_LOCAL);
   return ItemShunt::LocalFile(local_path);
 }
+ItemMapping *Item::map(long long len) const {
+  CHECK(type == MTI_LOCAL);
+  return ItemMapping::LocalFile(local_path, len);
+}
+
+// Reads the data between the holes through whichever of mapping and shunt we were given
+static long long scanExtents(ItemMapping *mapping, ItemShunt *shunt, long long start, long long end, void (*func)(const char *data, int len, void *ctx), void (*hole)(long long len, void *ctx), void *ctx) {
+  HoleMap holes;
+  if(mapping)
+    mapping->holes(start, end, &holes);
+  else
+    shunt->holes(start, end, &holes);
+  
+  long long pos = start;
+  for(int i = 0; i <= holes.size(); i++) {
+    long long dataend = (i < holes.size()) ? holes[i].first : end;
+    if(pos < dataend) {
+      long long got = mapping ? mapping->scan(pos, dataend, func, ctx) : shunt->scan(pos, dataend, func, ctx);
+      pos += got;
+      if(pos != dataend)
+        break;
+    }
+    if(i < holes.size()) {
+      if(hole)
+        hole(holes[i].second, ctx);
+      else
+        feedZeros(holes[i].second, func, ctx);
+      pos += holes[i].second;
+    }
+  }
+  return pos - start;
+}
+
+long long Item::scan(long long start, long long end, void (*func)(const char *data, int len, void *ctx), void (*hole)(long long len, void *ctx), void *ctx) const {
+  CHECK(type == MTI_LOCAL);
+  if(start == end)
+    return 0;
+  ItemMapping *mapping = map(end);
+  ItemShunt *shunt = mapping ? NULL : open();
+  if(!mapping && !shunt) {
+    printf("Couldn't open %s to read it\n", local_path);
+    return 0;
+  }
+  long long got = scanExtents(mapping, shunt, start, end, func, hole, ctx);
+  delete mapping;
+  delete shunt;
+  return got;
+}
 
 Checksum Item::signature() const {
   return signaturePart(size());
 }
 
+// Head, tail, and evenly spaced windows between them. Small files are sampled whole.
+static const int samplewindows = 8;
+static const int samplewindowsize = 256;
+
+static int sampleWindows(long long len, long long *offsets, int *lens) {
+  if(len <= samplewindows * samplewindowsize) {
+    offsets[0] = 0;
+    lens[0] = len;
+    return 1;
+  }
+  for(int i = 0; i < samplewindows; i++) {
+    offsets[i] = (len - samplewindowsize) * i / (samplewindows - 1);
+    lens[i] = samplewindowsize;
+  }
+  return samplewindows;
+}
+
+// 64-bit FNV-1a, seeded with the length so prefixes of different lengths don't collide
+static unsigned long long sampleHash(long long len, const char *data, int bytes) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for(int i = 0; i < 8; i++)
+    hash = (hash ^ ((len >> (i * 8)) & 0xff)) * 1099511628211ULL;
+  for(int i = 0; i < bytes; i++)
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+  return hash;
+}
+
 Checksum Item::signaturePart(long long len) const {
   if(!isReadable()) {
-    printf("Isn't readable: %s\n", local_path.c_str());
+    printf("Isn't readable: %s\n", local_path);
     CHECK(0);
   }
   
-  for(int i = 0; i < sss.size(); i++) {
-    if(sss[i].first == len)
-      return sss[i].second;
-  }
-  
-  for(int i = 0; i < css.size(); i++) {
-    if(css[i].first == len) {
-      Checksum cst = css[i].second;
+  {
+    const Checksum *cached = cache.find(len, false);
+    if(cached) {
+      countStat(STAT_CACHEHITS, 1);
+      Checksum cst = *cached;
       memset(cst.bytes, 0, sizeof(cst.bytes));
-      sss.push_back(make_pair(len, cst));
+      cst.algo = HASH_SHA1;
       return cst;
     }
   }
   
   CHECK(type == MTI_LOCAL);
+  countStat(STAT_CACHEMISSES, 1);
   
   Checksum tcs;
   memset(tcs.bytes, 0, sizeof(tcs.bytes));
   memset(tcs.signature, 0, sizeof(tcs.signature));
   
-  long long poss = (len - sizeof(tcs.signature)) / 2;
+  long long poss = (len - (long long)sizeof(tcs.signature)) / 2;
   if(poss < 0)
     poss = 0;
   long long pose = poss + 32;
   if(pose > size())
     pose = size();
   
+  // The middle chunk and the sample windows all go out in one request
+  long long offsets[samplewindows + 1];
+  int lens[samplewindows + 1];
+  offsets[0] = poss;
+  lens[0] = pose - poss;
+  int windows = sampleWindows(len, offsets + 1, lens + 1);
+  int total = 0;
+  for(int i = 0; i <= windows; i++)
+    total += lens[i];
+  
+  vector<char> buf(total + 1);
   ItemShunt *snt = open();
-  snt->seek(poss);
-  snt->read((char*)tcs.signature, pose - poss);
+  snt->readWindows(offsets, lens, windows + 1, &buf[0]);
   delete snt;
   
-  sss.push_back(make_pair(len, tcs));
+  memcpy(tcs.signature, &buf[0], lens[0]);
+  tcs.sample = sampleHash(len, &buf[lens[0]], total - lens[0]);
+  tcs.sampled = true;
+  
+  cache.insert(len, tcs, false);
   
   return tcs;
 }
 
-Checksum Item::checksum() const {
-  return checksumPart(size());
+void Item::cacheChecksum(long long len, const Checksum &cs) const {
+  cache.insert(len, cs, true);
 }
 
-extern long long cssi;
+bool Item::hasChecksum(long long len) const {
+  return cache.find(len, true, type == MTI_LOCAL ? checksumconfig.algorithm : -1);
+}
 
-Checksum Item::checksumPart(long long len) const {
-  if(!isReadable()) {
-    printf("Isn't readable: %s", local_path.c_str());
+Checksum Item::checksum(int algo) const {
+  return checksumPart(size(), algo);
+}
+
+ChecksumPoints::ChecksumPoints() : c(HASH_SHA1) {
+  item = NULL;
+  next = 0;
+  pos = 0;
+}
+
+ChecksumPoints::ChecksumPoints(const Item *in_item, const vector<long long> &in_lens, int algo) : c(algo) {
+  item = in_item;
+  for(int i = 0; i < in_lens.size(); i++)
+    if(!item->cache.find(in_lens[i], true, algo))
+      lens.push_back(in_lens[i]);
+  sort(lens.begin(), lens.end());
+  lens.erase(unique(lens.begin(), lens.end()), lens.end());
+  next = 0;
+  pos = 0;
+  settle();
+}
+
+// The digest finishes into the checksum at this length without stopping, and carries on past it
+void ChecksumPoints::settle() {
+  while(next < lens.size() && lens[next] == pos) {
+    Checksum tcs = item->signaturePart(pos);
+    c.final(&tcs);
+    item->cache.insert(pos, tcs, true);
+    next++;
+  }
+}
+
+void ChecksumPoints::feed(const char *data, int len) {
+  while(len) {
+    int take = len;
+    if(next < lens.size() && lens[next] - pos < take)
+      take = (int)(lens[next] - pos);
+    c.update(data, take);
+    data += take;
+    len -= take;
+    pos += take;
+    settle();
+  }
+}
+
+static void pointsFeed(const char *data, int len, void *ctx) {
+  ((ChecksumPoints *)ctx)->feed(data, len);
+}
+
+Checksum Item::checksumPart(long long len, int algo) const {
+  if(algo == -1 && type == MTI_LOCAL)
+    algo = checksumconfig.algorithm;
+  {
+    const Checksum *cached = cache.find(len, true, algo);
+    if(cached) {
+      countStat(STAT_CACHEHITS, 1);
+      return *cached;
+    }
+  }
+  
+  checksumPoints(vector<long long>(1, len), algo);
+  const Checksum *cached = cache.find(len, true, algo);
+  CHECK(cached);
+  return *cached;
+}
+
+// BLAKE3 pieces are a power of two chunks long, so each one is a whole subtree
+static const int piecechunks = 16 << 10;
+static const long long piecesize = piecechunks * 1024LL;
+
+struct PieceHash {
+  const char *path;
+  vector<unsigned int> cvs;  // eight words per piece
+};
+
+static void blake3Feed(const char *data, int len, void *ctx) {
+  ((Blake3 *)ctx)->update(data, len);
+}
+
+static void hashPiece(int task, void *data) {
+  PieceHash *ph = (PieceHash *)data;
+  ItemShunt *shunt = ItemShunt::LocalFile(ph->path);
+  if(!shunt) {
+    printf("Couldn't open %s during checksum\n", ph->path);
     CHECK(0);
   }
+  Blake3 b3(task * (unsigned long long)piecechunks);
+  if(scanExtents(NULL, shunt, task * piecesize, (task + 1) * piecesize, blake3Feed, NULL, &b3) != piecesize) {
+    printf("%s got shorter while we were hashing it\n", ph->path);
+    CHECK(0);
+  }
+  delete shunt;
+  b3.subtree(&ph->cvs[task * 8]);
+}
 
-  for(int i = 0; i < css.size(); i++) {
-    if(css[i].first == len)
-      return css[i].second;
+// Every piece but the last gets hashed on whichever thread is free, each with its own handle, and then they're
+// stitched together in order. The last piece goes through here, since the root of the tree has to come out of it.
+void Item::checksumPieces(long long len) const {
+  PieceHash ph;
+  ph.path = local_path;
+  int pieces = (int)((len - 1) / piecesize);
+  ph.cvs.resize(pieces * 8);
+  parallelFor(pieces, hashPiece, &ph);
+  
+  Blake3 b3;
+  for(int i = 0; i < pieces; i++)
+    b3.addSubtree(&ph.cvs[i * 8], piecechunks);
+  
+  if(scan(pieces * piecesize, len, blake3Feed, NULL, &b3) != len - pieces * piecesize) {
+    printf("%s got shorter while we were hashing it\n", local_path);
+    CHECK(0);
   }
   
-  if(type != MTI_LOCAL) {
-    printf("Invalid type %d, size %lld\n", type, size());
-    for(int i = 0; i < css.size(); i++)
-      printf("Css %lld\n", css[i].first);
+  Checksum tcs = signaturePart(len);
+  b3.final(tcs.bytes, sizeof(tcs.bytes));
+  tcs.algo = HASH_BLAKE3;
+  cache.insert(len, tcs, true);
+  countStat(STAT_BYTESHASHED, len);
+}
+
+void Item::checksumPoints(const vector<long long> &lens, int algo) const {
+  if(!isReadable()) {
+    printf("Isn't readable: %s", local_path);
     CHECK(0);
   }
-  //printf("Doing full checksum of %s\n", local_path.c_str());
   
-  long long bytu = 0;
+  if(algo == -1)
+    algo = checksumconfig.algorithm;
+  ChecksumPoints points(this, lens, algo);
+  long long len = points.end();
+  if(points.done() == len)
+    return;
+  countStat(STAT_CACHEMISSES, 1);
   
-  SHA_CTX c;
-  SHA1_Init(&c);
-  ItemShunt *phil = open();
-  if(!phil) {
-    printf("Couldn't open %s during checksum\n", local_path.c_str());
-    CHECK(isReadable());
+  if(type != MTI_LOCAL) {
+    printf("Invalid type %d, size %lld, asked for %lld\n", type, size(), len);
     CHECK(0);
   }
-  while(1) {
-    char buf[1024*512];
-    int rv = phil->read(buf, sizeof(buf));
-    
-    if(bytu + rv >= len) {
-      SHA1_Update(&c, buf, len - bytu);
-      Checksum tcs = signaturePart(len);
-      SHA1_Final(tcs.bytes, &c);
-      delete phil;
-      cssi += len;
-      css.push_back(make_pair(len, tcs));
-      return tcs;
-    } else {
-      SHA1_Update(&c, buf, rv);
-    }
-    
-    if(rv != sizeof(buf)) {
-      printf("Trying to read %lld from %s, only picked up %lld, last value %d!\n", len, local_path.c_str(), bytu + rv, rv);
-      CHECK(0);
-    }
-    
-    bytu += rv;
+  //printf("Doing full checksum of %s\n", local_path);
+  
+  if(algo == HASH_BLAKE3 && lens.size() == 1 && len >= checksumconfig.parallelmin && len > piecesize && threadCount() > 1) {
+    checksumPieces(len);
+    return;
   }
   
-  CHECK(0);
+  long long got = scan(0, len, pointsFeed, NULL, &points);
+  if(got != len) {
+    printf("Trying to read %lld from %s, only picked up %lld!\n", len, local_path, got);
+    CHECK(0);
+  }
+  countStat(STAT_BYTESHASHED, len);
 }
 
 void Item::addVersion(int x) {
-  needed_versions.insert(x);
+  vector<int>::iterator itr = lower_bound(needed_versions.begin(), needed_versions.end(), x);
+  if(itr != needed_versions.end() && *itr == x)
+    return;
+  if(needed_versions.size() == needed_versions.capacity())
+    __sync_fetch_and_add(&version_allocs, 1);
+  needed_versions.insert(itr, x);
 }
-const set<int> &Item::getVersions() const {
+const vector<int> &Item::getVersions() const {
   return needed_versions;
 }
 
@@ -214,7 +953,7 @@ bool Item::isReadable() const {
       readable = 1;
       ItemShunt *fil = open();
       if(!fil) {
-        printf("Cannot read %s\n", local_path.c_str());
+        printf("Cannot read %s\n", local_path);
         readable = 0;
       } else {
         delete fil;
@@ -229,29 +968,48 @@ bool Item::isReadable() const {
 };
 
 bool Item::isChecksummable() const {
-  return css.size() || isReadable();
+  return cache.hasFull() || isReadable();
 }
 
 string Item::toString() const {
   return StringPrintf("%lld %lld %s", size(), metadata().timestamp, checksum().toString().c_str());
 }
 
-Item Item::MakeLocal(const string &full_path, long long size, const Metadata &meta) {
+Item Item::MakeLocal(const string &full_path, long long size, const Metadata &meta, long long dev, long long ino) {
   Item item;
   item.type = MTI_LOCAL;
-  item.local_path = full_path;
+  item.local_path = internPath(full_path);
+  item.p_dev = dev;
+  item.p_ino = ino;
   item.p_size = size;
   item.p_metadata = meta;
   return item;
 }
 
-Item Item::MakeOriginal(long long size, const Metadata &meta, const Checksum &checksum, const set<int> &versions) {
+Item Item::RemakeLocal(const Item &prior, long long size, const Metadata &meta, long long dev, long long ino) {
+  CHECK(prior.type == MTI_LOCAL);
+  Item item;
+  item.type = MTI_LOCAL;
+  item.local_path = prior.local_path;
+  item.p_dev = dev;
+  item.p_ino = ino;
+  item.p_size = size;
+  item.p_metadata = meta;
+  return item;
+}
+
+Item Item::MakeOriginal(long long size, const Metadata &meta, const Checksum &checksum, const vector<int> &versions) {
   Item item;
   item.type = MTI_ORIGINAL;
   item.p_size = size;
   item.p_metadata = meta;  
-  item.css.push_back(make_pair(size, checksum));
-  item.needed_versions = versions;
+  item.cache.insert(size, checksum, true);
+  if(versions.size()) {
+    item.needed_versions.reserve(versions.size() + 1);  // there's usually one more on the way
+    __sync_fetch_and_add(&version_allocs, 1);
+    item.needed_versions = versions;
+  }
+  CHECK(adjacent_find(item.needed_versions.begin(), item.needed_versions.end(), greater_equal<int>()) == item.needed_versions.end());
   return item;
 }
 
@@ -271,28 +1029,93 @@ Item Item::MakeSsh(const string &user, const string &pass, const string &host, c
 Item::Item() {
   type = MTI_NONEXISTENT;
   readable = -1;
+  local_path = NULL;
+  p_dev = 0;
+  p_ino = 0;
+  p_size = 0;
+}
+
+void printItemStats(int items) {
+  // What the same fields cost when they were two vectors, a set and an owned string
+  int oldsize = 2 * sizeof(vector<pair<long long, Checksum> >) + sizeof(set<int>) + sizeof(string) + 2 * sizeof(int) + sizeof(long long) + sizeof(Metadata);
+  dprintf("Item is %d bytes (was at least %d, plus a heap allocation per cached checksum, path and version)\n", (int)sizeof(Item), oldsize);
+  dprintf("%d items: %lld bytes of paths pooled in %d blocks, %d checksum cache spills, %d version list allocations\n", items, pool_bytes, pool_blocks, cache_spills, version_allocs);
 }
 
 int if_presig = 0;
 int if_mid = 0;
+int if_sample = 0;
+int if_falsepos = 0;
 int if_full = 0;
 
+static bool sampleMismatch(const Checksum &lhs, const Checksum &rhs) {
+  return lhs.sampled && rhs.sampled && lhs.sample != rhs.sample;
+}
+
+// An original only has the checksum its state recorded, so the live side gets hashed whichever way that was
+static int compareAlgorithm(const Item &lhs, const Item &rhs, long long len) {
+  if(!lhs.localPath() && !rhs.localPath())
+    return -1;
+  if(!lhs.localPath())
+    return lhs.checksumPart(len).algo;
+  if(!rhs.localPath())
+    return rhs.checksumPart(len).algo;
+  return checksumconfig.algorithm;
+}
+
+static bool sameChecksum(const Item &lhs, const Item &rhs, long long len) {
+  int algo = compareAlgorithm(lhs, rhs, len);
+  return lhs.checksumPart(len, algo) == rhs.checksumPart(len, algo);
+}
+
 bool identicalFile(const Item &lhs, const Item &rhs, long long bytes) {
   if(bytes == -1) {
     if(lhs.size() != rhs.size())
       return false; // this shouldn't actually happen
     if_presig++;
-    if(!(lhs.signature() == rhs.signature()))
+    Checksum lsig = lhs.signature();
+    Checksum rsig = rhs.signature();
+    if(!(lsig == rsig))
       return false;
     if_mid++;
-    if(!(lhs.checksum() == rhs.checksum())) {
+    if(sampleMismatch(lsig, rsig))
+      return false;
+    if_sample++;
+    if(!sameChecksum(lhs, rhs, lhs.size())) {
       //Checksum cs = lhs.signature();
       //printf("%s\n", cs.toString().c_str());
       //printf("%s and %s\n", lhs.local_path.c_str(), rhs.local_path.c_str());
+      if_falsepos++;
       return false;
     }
     if_full++;
     return true;
   }
-  return lhs.signaturePart(bytes) == rhs.signaturePart(bytes) && lhs.checksumPart(bytes) == rhs.checksumPart(bytes);
+  Checksum lsig = lhs.signaturePart(bytes);
+  Checksum rsig = rhs.signaturePart(bytes);
+  if(!(lsig == rsig) || sampleMismatch(lsig, rsig))
+    return false;
+  // Whoever asks about a prefix is about to want the whole file too - an append, or failing that a copy or a store -
+  // so both come out of the same read, as long as the old checksum is the kind we'd make now
+  int algo = compareAlgorithm(lhs, rhs, bytes);
+  if(lhs.localPath() && bytes < lhs.size() && algo == checksumconfig.algorithm) {
+    vector<long long> points;
+    points.push_back(bytes);
+    points.push_back(lhs.size());
+    lhs.checksumPoints(points);
+  }
+  return lhs.checksumPart(bytes, algo) == rhs.checksumPart(bytes, algo);
+}
+
+bool similarFile(const Item &lhs, const Item &rhs) {
+  if(lhs.size() != rhs.size())
+    return false;
+  Checksum lsig = lhs.signature();
+  Checksum rsig = rhs.signature();
+  return lsig == rsig && !sampleMismatch(lsig, rsig);
+}
+
+void printFilterStats() {
+  dprintf("%d compared, %d passed the middle chunk, %d passed the sample, %d identical, %d false positives (%.2f%% of full checksums)\n",
+    if_presig, if_mid, if_sample, if_full, if_falsepos, if_sample ? 100.0 * if_falsepos / if_sample : 0.0);
 }
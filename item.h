@@ -21,7 +21,6 @@
 
 #include <string>
 #include <vector>
-#include <set>
 
 #ifdef WIN32API
 #define WIN32_LEAN_AND_MEAN
@@ -31,6 +30,7 @@
 #endif
 
 #include "util.h"
+#include "digest.h"
 
 using namespace std;
 
@@ -59,10 +59,75 @@ inline bool operator!=(const Metadata &lhs, const Metadata &rhs) {
   return !(lhs.timestamp == rhs.timestamp);
 }
 
+// How local files get read. Set from the "io" category of the config file.
+class IoConfig {
+public:
+  int readsize;         // bytes per read request - a multiple of 4096
+  bool fadvise;         // tell the kernel we read once, front to back, and hand pages back as we finish with them
+  bool direct;          // bypass the page cache entirely for big files, where the filesystem allows it
+  long long directmin;
+  bool mmap;            // hash and compress big files straight out of a read-only mapping instead of copying them through a buffer
+  long long mmapmin;
+  bool sparse;          // ask the filesystem where the holes are, and never read them
+  long long zerorun;    // runs of zeros at least this long get left out of archives like holes, 0 to store them as they are
+
+  IoConfig();
+};
+
+extern IoConfig ioconfig;
+
+// Which hash full checksums use. Set from the "checksum" category of the config file. Every checksum in a state
+// records which one it is, so switching only changes how files get hashed from then on.
+class ChecksumConfig {
+public:
+  int algorithm;          // HASH_SHA1 or HASH_BLAKE3
+  long long parallelmin;  // BLAKE3 files at least this big get cut into pieces and hashed on every processor at once
+
+  ChecksumConfig();
+};
+
+extern ChecksumConfig checksumconfig;
+
+// Where a file is all zeros without having to be read: offset and length, sorted, and never touching each other
+typedef vector<pair<long long, long long> > HoleMap;
+
+string holeMapString(const HoleMap &holes);
+HoleMap holeMapParse(const string &str);
+
+void findHoles(int fd, long long start, long long end, HoleMap *out);  // nothing if the filesystem can't say
+bool allZero(const char *data, int len);
+void feedZeros(long long len, void (*func)(const char *data, int len, void *ctx), void *ctx);  // without a buffer that big
+
+// Splits a stream into literal data and runs of zeros. It looks a block at a time, lined up with the offset into the
+// file, so literal data never gets chopped any finer than it has to. Runs shorter than ioconfig.zerorun aren't worth
+// it, and come back out as literal zeros.
+class ZeroRuns {
+public:
+  void feed(const char *data, int len);
+  void hole(long long len);  // zeros we didn't have to read, which make a run however short they are
+  void finish();
+  long long position() const { return pos; }
+
+  ZeroRuns(long long pos, void (*literal)(const char *data, int len, void *ctx), void (*run)(long long start, long long len, void *ctx), void *ctx);
+
+private:
+  void settle(long long end);
+
+  long long pos;
+  long long zerostart;  // where the run we haven't decided about yet started, or -1
+  bool known;           // some of that run is a hole
+  void (*literal)(const char *data, int len, void *ctx);
+  void (*run)(long long start, long long len, void *ctx);
+  void *ctx;
+};
+
 class ItemShunt {
 public:
   void seek(long long pos);
   int read(char *buffer, int len);
+  void readWindows(const long long *offsets, const int *lens, int count, char *dest);  // packed into dest, in order
+  long long scan(long long start, long long end, void (*func)(const char *data, int len, void *ctx), void *ctx);  // same as ItemMapping's
+  void holes(long long start, long long end, HoleMap *out) const;
 
   ~ItemShunt();
 
@@ -73,7 +138,17 @@ private:
 #ifdef WIN32API
   HANDLE local_file;
 #else
-  FILE *local_file;
+  int local_file;
+  long long pos;
+  long long dropped;  // everything before this has been handed back to the page cache
+
+  // Only for O_DIRECT, which needs aligned offsets, sizes and memory - holds [bounce_start, bounce_start + bounce_len)
+  char *bounce;
+  long long bounce_start;
+  int bounce_len;
+
+  void dropConsumed();
+  void flushConsumed();
 #endif
 
   string fname;
@@ -83,6 +158,91 @@ private:
   void operator=(const ItemShunt &is); // do not implement
 };
 
+// A local file mapped read-only. If the file gets truncated underneath us, touching the missing pages raises SIGBUS;
+// scan() catches that and stops short, so the caller sees it the same way it would see a short read.
+class ItemMapping {
+public:
+  // Hands [start, end) to func in pieces of at most ioconfig.readsize. Returns how many bytes it got through.
+  long long scan(long long start, long long end, void (*func)(const char *data, int len, void *ctx), void *ctx);
+  void holes(long long start, long long end, HoleMap *out) const;
+
+  ~ItemMapping();
+
+  static ItemMapping* LocalFile(const string &fname, long long len);  // NULL if it's too small, or can't be mapped
+
+private:
+
+#ifndef WIN32API
+  int local_file;
+  const char *base;
+  long long len;
+  long long dropped;  // as ItemShunt, everything before this has been handed back
+  long long scanned;  // where the last scan() stopped
+
+  void dropConsumed(long long upto);
+#endif
+
+  string fname;
+
+  ItemMapping();
+  ItemMapping(const ItemMapping &im); // do not implement
+  void operator=(const ItemMapping &im); // do not implement
+};
+
+// Checksums we've already computed, keyed by length and hash. Nearly every item has at most two - its full length, and the
+// length of its previous version when we're looking for an append - so those live inline and only extras hit the heap.
+class ChecksumCache {
+public:
+  // full == false will also return signature-only entries, and algo == -1 takes a full checksum of either kind
+  const Checksum *find(long long len, bool full, int algo = -1) const;
+  void insert(long long len, const Checksum &cs, bool full);
+  bool hasFull() const;
+
+  ChecksumCache();
+  ChecksumCache(const ChecksumCache &cc);
+  void operator=(const ChecksumCache &cc);
+  ~ChecksumCache();
+
+private:
+  struct Entry {
+    long long len;
+    Checksum cs;
+    bool full;  // if false, only the signature is valid
+  };
+  enum { INLINE_ENTRIES = 2 };
+
+  Entry *entry(int i);
+  const Entry *entry(int i) const;
+
+  Entry local[INLINE_ENTRIES];
+  int count;
+  vector<Entry> *spill;
+};
+
+class Item;
+
+// Checksum of a file from the start, fed in order, that caches the full checksum at each of the given lengths as it goes
+// past them - so one read can answer "what did the old version hash to" and "what does this one hash to" both.
+// Lengths that are already cached get dropped.
+class ChecksumPoints {
+public:
+  void feed(const char *data, int len);
+  long long done() const { return pos; }
+  long long end() const { return lens.size() ? lens.back() : 0; }  // no point reading past this
+
+  ChecksumPoints();
+  ChecksumPoints(const Item *item, const vector<long long> &lens, int algo);
+
+private:
+  void settle();
+
+  const Item *item;
+  vector<long long> lens;
+  int next;
+  long long pos;
+  Digest c;
+};
+
 class Item {
 public:
   
@@ -90,39 +250,57 @@ public:
   const Metadata &metadata() const { return p_metadata; }
 
   ItemShunt *open() const;
+  ItemMapping *map(long long len) const;  // NULL if the first len bytes should be read through open() instead
+
+  // Hands [start, end) to func front to back, through whichever of those the config prefers. Holes aren't read - they
+  // go to hole, or to func as zeros if hole is NULL. Returns how far it got, which is short if the file shrank.
+  long long scan(long long start, long long end, void (*func)(const char *data, int len, void *ctx), void (*hole)(long long len, void *ctx), void *ctx) const;
 
-  Checksum checksum() const;
-  Checksum checksumPart(long long len) const;
+  // algo == -1 is whatever the config says for a local file, and whatever the state recorded for an original
+  Checksum checksum(int algo = -1) const;
+  Checksum checksumPart(long long len, int algo = -1) const;
+  void checksumPoints(const vector<long long> &lens, int algo = -1) const;  // one pass, every length ends up cached
   
   Checksum signature() const;
   Checksum signaturePart(long long len) const;  // Same as a checksum, but with the checksum part 0'ed.
+  void cacheChecksum(long long len, const Checksum &cs) const;  // for callers that hashed the file some other way
+  bool hasChecksum(long long len) const;  // whether checksumPart(len) would be answered without reading anything
   
   void addVersion(int x);
-  const set<int> &getVersions() const;
+  const vector<int> &getVersions() const; // sorted, no duplicates
 
   bool exists() const { return type != MTI_NONEXISTENT; }
+  const char *localPath() const { return type == MTI_LOCAL ? local_path : NULL; }
+
+  // Local files with more than one link only - two items with the same nonzero inode are the same file on disk
+  long long device() const { return p_dev; }
+  long long inode() const { return p_ino; }
   bool isReadable() const;
   bool isChecksummable() const;
 
   string toString() const;
 
-  static Item MakeLocal(const string &full_path, long long size, const Metadata &meta);
+  static Item MakeLocal(const string &full_path, long long size, const Metadata &meta, long long dev = 0, long long ino = 0);
+  // The same file as prior, which has changed - nothing carries over but the pooled path
+  static Item RemakeLocal(const Item &prior, long long size, const Metadata &meta, long long dev = 0, long long ino = 0);
   static Item MakeSsh(const string &user, const string &pass, const string &host, const string &full_path, long long size, const Metadata &meta);
-  static Item MakeOriginal(long long size, const Metadata &meta, const Checksum &checksum, const set<int> &versions);
+  static Item MakeOriginal(long long size, const Metadata &meta, const Checksum &checksum, const vector<int> &versions);
   
   Item();
 
 private:
-  mutable vector<pair<long long, Checksum> > css;
-  mutable vector<pair<long long, Checksum> > sss;
+  friend class ChecksumPoints;
+
+  void checksumPieces(long long len) const;  // BLAKE3 only, on every processor
+
+  mutable ChecksumCache cache;
 
-  int type;
   long long p_size;
   Metadata p_metadata;
 
-  mutable int readable;  // 0 for not readable, 1 for readable, -1 for unknown
-
-  string local_path;
+  const char *local_path; // lives in the path pool, shared by every copy of this item
+  long long p_dev;
+  long long p_ino;
 
 /*
   string ssh_user;
@@ -130,7 +308,10 @@ private:
   string ssh_host;
   string ssh_path;*/
 
-  set<int> needed_versions;
+  vector<int> needed_versions;
+
+  char type;
+  mutable char readable;  // 0 for not readable, 1 for readable, -1 for unknown
 
 };
 
@@ -140,5 +321,12 @@ inline bool operator==(const Item &lhs, const Item &rhs) {
 
 // Various optimizations possible
 bool identicalFile(const Item &lhs, const Item &rhs, long long bytes = -1);
+bool similarFile(const Item &lhs, const Item &rhs);  // just the middle chunk and the sample windows, nothing hashed whole
+
+// Prints the size of an Item and how many heap allocations item storage has needed so far
+void printItemStats(int items);
+
+// How identicalFile() comparisons fell through the cheap filters to the full checksum
+void printFilterStats();
 
 #endif
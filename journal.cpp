@@ -0,0 +1,208 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "journal.h"
+#include "digest.h"
+#include "parse.h"
+#include "debug.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+static const char journal_fname[] = "states/journal";      // the watcher appends here
+static const char taken_fname[] = "states/journal.taken";  // what the backup in progress is working from
+static const char watcher_fname[] = "states/watcher";      // which watcher the last backup trusted
+
+Journal::Journal() {
+  complete = true;
+}
+
+bool Journal::changed(const string &path) const {
+  if(dirty.count(path))
+    return true;
+  for(string parent = path; parent.size(); parent.erase(parent.rfind('/')))
+    if(recursive.count(parent))
+      return true;
+  return false;
+}
+
+// Anyone changing the config has to restart the watcher, since it might be watching the wrong things
+static string configHash(const string &conffile) {
+  ifstream ifs(conffile.c_str());
+  stringstream dat;
+  dat << ifs.rdbuf();
+  Digest dig(HASH_SHA1);
+  dig.update(dat.str().data(), dat.str().size());
+  Checksum cs;
+  dig.final(&cs);
+  return outputHex(cs.bytes, sizeof(cs.bytes));
+}
+
+// The journal, locked. A backup may rename it out from under us between the open and the lock, in which case we
+// try again with whatever's there now.
+static int lockJournal(bool create) {
+  while(1) {
+    int fd = open(journal_fname, O_RDWR | O_APPEND | (create ? O_CREAT : 0), 0644);
+    if(fd == -1)
+      return -1;
+    CHECK(!flock(fd, LOCK_EX));
+    struct stat held, named;
+    if(!fstat(fd, &held) && !stat(journal_fname, &named) && held.st_dev == named.st_dev && held.st_ino == named.st_ino)
+      return fd;
+    close(fd);
+  }
+}
+
+static void writeRecords(const string &dat) {
+  int fd = lockJournal(true);
+  CHECK(fd != -1);
+  CHECK(write(fd, dat.data(), dat.size()) == dat.size());
+  close(fd);
+}
+
+Journal takeJournal(const string &conffile) {
+  {
+    int fd = lockJournal(false);
+    if(fd != -1) {
+      string dat;
+      char buf[65536];
+      int rv;
+      while((rv = read(fd, buf, sizeof(buf))) > 0)
+        dat.append(buf, rv);
+      FILE *taken = fopen(taken_fname, "a");
+      CHECK(taken);
+      CHECK(fwrite(dat.data(), 1, dat.size(), taken) == dat.size());
+      fclose(taken);
+      unlink(journal_fname);
+      close(fd);
+    }
+  }
+  
+  Journal jn;
+  int pid = 0;
+  string config;
+  {
+    ifstream ifs(watcher_fname);
+    kvData kvd;
+    if(getkvDataInline(ifs, kvd)) {
+      CHECK(kvd.category == "watcher");
+      pid = atoi(kvd.consume("pid").c_str());
+      config = kvd.consume("config");
+      CHECK(kvd.isDone());
+    }
+  }
+  
+  {
+    ifstream ifs(taken_fname);
+    kvData kvd;
+    while(getkvDataInline(ifs, kvd)) {
+      if(kvd.category == "start") {
+        pid = atoi(kvd.consume("pid").c_str());
+        config = kvd.consume("config");
+        if(jn.complete)
+          jn.reason = "the watcher started since the last backup";
+        jn.complete = false;
+      } else if(kvd.category == "dirty") {
+        string path = kvd.consume("path");
+        if(kvd.kv.count("recursive") && atoi(kvd.consume("recursive").c_str()))
+          jn.recursive.insert(path);
+        else
+          jn.dirty.insert(path);
+      } else if(kvd.category == "gap") {
+        string reason = kvd.consume("reason");
+        if(jn.complete)
+          jn.reason = reason;
+        jn.complete = false;
+      } else {
+        CHECK(0);
+      }
+      CHECK(kvd.isDone());
+    }
+  }
+  
+  if(jn.complete) {
+    if(!pid) {
+      jn.complete = false;
+      jn.reason = "no watcher";
+    } else if(kill(pid, 0) && errno == ESRCH) {
+      jn.complete = false;
+      jn.reason = "the watcher isn't running";
+    } else if(config != configHash(conffile)) {
+      jn.complete = false;
+      jn.reason = "the watcher was started with a different config";
+    }
+  }
+  
+  if(pid) {
+    kvData kvd;
+    kvd.category = "watcher";
+    kvd.kv["pid"] = StringPrintf("%d", pid);
+    kvd.kv["config"] = config;
+    ofstream ofs(watcher_fname);
+    putkvDataInline(ofs, kvd);
+  }
+  
+  return jn;
+}
+
+void finishJournal(const set<string> &leftover) {
+  unlink(taken_fname);
+  if(leftover.size())
+    journalDirty(leftover, set<string>());
+}
+
+void journalStart(const string &conffile) {
+  kvData kvd;
+  kvd.category = "start";
+  kvd.kv["pid"] = StringPrintf("%d", (int)getpid());
+  kvd.kv["config"] = configHash(conffile);
+  writeRecords(putkvDataInlineString(kvd) + "\n");
+}
+
+void journalDirty(const set<string> &dirty, const set<string> &recursive) {
+  string dat;
+  for(set<string>::const_iterator itr = dirty.begin(); itr != dirty.end(); itr++) {
+    kvData kvd;
+    kvd.category = "dirty";
+    kvd.kv["path"] = *itr;
+    dat += putkvDataInlineString(kvd) + "\n";
+  }
+  for(set<string>::const_iterator itr = recursive.begin(); itr != recursive.end(); itr++) {
+    kvData kvd;
+    kvd.category = "dirty";
+    kvd.kv["path"] = *itr;
+    kvd.kv["recursive"] = "1";
+    dat += putkvDataInlineString(kvd) + "\n";
+  }
+  writeRecords(dat);
+}
+
+void journalGap(const string &reason) {
+  kvData kvd;
+  kvd.category = "gap";
+  kvd.kv["reason"] = reason;
+  writeRecords(putkvDataInlineString(kvd) + "\n");
+}
@@ -0,0 +1,55 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_JOURNAL
+#define PUREBACKUP_JOURNAL
+
+#include <string>
+#include <set>
+
+using namespace std;
+
+// Which directories have changed since the last backup, going by what "purebackup watch" wrote down. If the watcher
+// wasn't running the whole time, fell behind, or was started with some other config, the journal isn't complete and
+// the backup has to scan everything.
+class Journal {
+public:
+  bool complete;
+  string reason;          // why it isn't
+  set<string> dirty;      // list these again
+  set<string> recursive;  // and everything beneath these
+
+  bool changed(const string &path) const;
+
+  Journal();
+};
+
+// Takes everything the watcher has written since the last backup finished, along with anything a backup that didn't
+// finish had already taken. The watcher carries on in a fresh file.
+Journal takeJournal(const string &conffile);
+
+// Once the new state is written, the taken journal can go. Directories holding anything that didn't make it into
+// the state get carried over to the next run.
+void finishJournal(const set<string> &leftover);
+
+// What the watcher writes
+void journalStart(const string &conffile);
+void journalDirty(const set<string> &dirty, const set<string> &recursive);
+void journalGap(const string &reason);
+
+#endif
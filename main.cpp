@@ -20,6 +20,15 @@
 #include "debug.h"
 #include "tree.h"
 #include "state.h"
+#include "restore.h"
+#include "hasher.h"
+#include "stats.h"
+#include "plan.h"
+#include "journal.h"
+#include "watch.h"
+#include "mask.h"
+#include "exclude.h"
+#include "thread.h"
 
 #include "minizip/zip.h"
 #include "minizip/unzip.h"
@@ -138,6 +147,16 @@ void printAll() {
   getRoot()->print(2);
 }
 
+// Where finished sessions end up, and how much fits there. Set from the "drive" category of the config file.
+string drivepath = "/cygdrive/m";
+//string drivepath = "/cygdrive/c/werk/sea/purebackup/temp";
+long long drivesize = 4482ll*1024*1024;
+
+// How many seconds continuous mode lets changes pile up before backing them up, and how often it writes a full
+// state. Set from the "continuous" category.
+int continuouswindow = 5;
+int continuouscheckpoint = 600;
+
 void readConfig(const string &conffile) {
   // First we init root
   {
@@ -150,7 +169,56 @@ void readConfig(const string &conffile) {
     if(kvd.category == "mountpoint") {
       createMountpoint(kvd.consume("mount"), kvd.consume("type"), kvd.consume("source"));
     } else if(kvd.category == "mask") {
-      createMask(kvd.consume("remove"));
+      if(kvd.kv.count("remove"))
+        createMask(kvd.consume("remove"));
+      if(kvd.kv.count("pattern")) {
+        vector<string> pats = tokenize(kvd.consume("pattern"), "\n");
+        for(int i = 0; i < pats.size(); i++)
+          masks.addGlob(pats[i]);
+      }
+      if(kvd.kv.count("regex")) {
+        vector<string> pats = tokenize(kvd.consume("regex"), "\n");
+        for(int i = 0; i < pats.size(); i++)
+          masks.addRegex(pats[i]);
+      }
+    } else if(kvd.category == "exclude") {
+      addExcludeRule(kvd);
+    } else if(kvd.category == "io") {
+      if(kvd.kv.count("readsize"))
+        ioconfig.readsize = atoi(kvd.consume("readsize").c_str());
+      if(kvd.kv.count("fadvise"))
+        ioconfig.fadvise = atoi(kvd.consume("fadvise").c_str());
+      if(kvd.kv.count("direct"))
+        ioconfig.direct = atoi(kvd.consume("direct").c_str());
+      if(kvd.kv.count("directmin"))
+        ioconfig.directmin = atoll(kvd.consume("directmin").c_str());
+      if(kvd.kv.count("mmap"))
+        ioconfig.mmap = atoi(kvd.consume("mmap").c_str());
+      if(kvd.kv.count("mmapmin"))
+        ioconfig.mmapmin = atoll(kvd.consume("mmapmin").c_str());
+      if(kvd.kv.count("sparse"))
+        ioconfig.sparse = atoi(kvd.consume("sparse").c_str());
+      if(kvd.kv.count("zerorun"))
+        ioconfig.zerorun = atoll(kvd.consume("zerorun").c_str());
+      CHECK(ioconfig.readsize >= 4096 && ioconfig.readsize % 4096 == 0);
+    } else if(kvd.category == "checksum") {
+      if(kvd.kv.count("algorithm")) {
+        string algo = kvd.consume("algorithm");
+        checksumconfig.algorithm = find(hash_names, hash_names + HASH_END, algo) - hash_names;
+        CHECK(checksumconfig.algorithm < HASH_END);
+      }
+      if(kvd.kv.count("parallelmin"))
+        checksumconfig.parallelmin = atoll(kvd.consume("parallelmin").c_str());
+    } else if(kvd.category == "continuous") {
+      if(kvd.kv.count("window"))
+        continuouswindow = atoi(kvd.consume("window").c_str());
+      if(kvd.kv.count("checkpoint"))
+        continuouscheckpoint = atoi(kvd.consume("checkpoint").c_str());
+    } else if(kvd.category == "drive") {
+      if(kvd.kv.count("path"))
+        drivepath = kvd.consume("path");
+      if(kvd.kv.count("size"))
+        drivesize = atoll(kvd.consume("size").c_str());
     } else {
       CHECK(0);
     }
@@ -158,240 +226,170 @@ void readConfig(const string &conffile) {
   
   CHECK(getRoot()->checkSanity());
   printAll();
+  if(masks.patterns())
+    printf("%d mask patterns\n", masks.patterns());
 }
 
-void scanPaths() {
-  getRoot()->scan();
+void scanPaths(const Journal *journal, const map<string, Item> *previous, void (*finished)(const string &path, const MountTree &dir, void *ctx), void *ctx) {
+  scan_listed = 0;
+  scan_reused = 0;
+  scan_masked = 0;
+  resetExcludeStats();
+  getRoot()->scan("", journal, previous, -1, finished, ctx);
   CHECK(getRoot()->checkSanity());
   //printAll();
 }
 
-void loopprocess(int pos, vector<int> *loop, const vector<Instruction> &inst,
-    const map<pair<bool, string>, vector<int> > &depon, 
-    const map<pair<bool, string>, int> &creates,
-    const set<pair<bool, string> > &removed,
-    vector<bool> *noprob) {
-      
-  //printf("Entering loopprocess %d\n", pos);
-  //printf("%s\n", inst[pos].textout().c_str());
-      
-  if((*noprob)[pos])
-    return;
-  
-  if(loop->size() && loop->back() == pos)
-    return;
-  
-  //printf("Pushback %d\n", pos);
-  
-  loop->push_back(pos);
-  
-  if(set<int>(loop->begin(), loop->end()).size() != loop->size()) {
-    //printf("LOOP!\n");
-    //for(int i = 0; i < loop->size(); i++)
-      //printf("%d\n", (*loop)[i]);
-    return;
-  }
-  
-  //printf("Starting depends %d\n", pos);
-  vector<int> bku = *loop;
-  // Anything this depends on must exist
-  for(int i = 0; i < inst[pos].depends.size(); i++) {
-    CHECK(creates.count(inst[pos].depends[i]));
-    loopprocess(creates.find(inst[pos].depends[i])->second, loop, inst, depon, creates, removed, noprob);
-    if(*loop != bku)
-      return;
-  }
-  
-  //printf("Starting removes %d\n", pos);
-  // Anything this removes must have its dependencies complete
-  for(int i = 0; i < inst[pos].removes.size(); i++) {
-    if(!depon.count(inst[pos].removes[i]))
-      continue;
-    const vector<int> &dpa = depon.find(inst[pos].removes[i])->second;
-    for(int j = 0; j < dpa.size(); j++) {
-      loopprocess(dpa[j], loop, inst, depon, creates, removed, noprob);
-      if(*loop != bku)
-        return;
-    }
-  }
-  //printf("Done %d\n", pos);
-  
-  loop->pop_back();
+struct ZipFeed {
+  Digest *c;
+  SignatureBuilder *sigb;
+  zipFile dest;
+  ZeroRuns *runs;  // NULL for the part that's only hashed
+  HoleMap *holes;
+};
 
-  (*noprob)[pos] = true;
+void zipFeed(const char *data, int len, void *ctx) {
+  ZipFeed *feed = (ZipFeed *)ctx;
+  feed->c->update(data, len);
+  if(feed->sigb)
+    feed->sigb->feed(data, len);
+  if(feed->runs)
+    feed->runs->feed(data, len);
 }
 
-vector<Instruction> deloop(const vector<Instruction> &inst) {
-  map<pair<bool, string>, vector<int> > depon;
-  map<pair<bool, string>, int> creates;
-  set<pair<bool, string> > removed;
-  vector<bool> noprob(inst.size());
-  for(int i = 0; i < inst.size(); i++) {
-    for(int j = 0; j < inst[i].depends.size(); j++)
-      depon[inst[i].depends[j]].push_back(i);
-    for(int j = 0; j < inst[i].creates.size(); j++) {
-      CHECK(!creates.count(inst[i].creates[j]));
-      creates[inst[i].creates[j]] = i;
-    }
-    for(int j = 0; j < inst[i].removes.size(); j++) {
-      CHECK(!removed.count(inst[i].removes[j]));
-      removed.insert(inst[i].removes[j]);
-    }
-  }
-  for(int i = 0; i < inst.size(); i++) {
-    vector<int> loop;
-    loopprocess(i, &loop, inst, depon, creates, removed, &noprob);
-    if(loop.size()) {
-      printf("Loop! %d\n", loop.size());
-      CHECK(loop.size() >= 3);
-      CHECK(loop.front() == loop.back());
-      CHECK(set<int>(loop.begin(), loop.end()).size() == loop.size() - 1);
-      
-      loop.pop_back();
-      
-      Instruction rotinstr;
-      rotinstr.type = TYPE_ROTATE;
-      for(int i = 0; i < loop.size(); i++) {
-        const Instruction &insta = inst[loop[i]];
-        const Instruction &instb = inst[loop[(i+1) % loop.size()]];
-        
-        CHECK(insta.type == TYPE_COPY);
-        CHECK(instb.type == TYPE_COPY);
-        
-        CHECK(instb.copy_source == insta.copy_dest);
-        
-        rotinstr.depends.insert(rotinstr.depends.end(), insta.depends.begin(), insta.depends.end());
-        rotinstr.removes.insert(rotinstr.removes.end(), insta.removes.begin(), insta.removes.end());
-        rotinstr.creates.insert(rotinstr.creates.end(), insta.creates.begin(), insta.creates.end());
-        
-        rotinstr.rotate_paths.push_back(make_pair(insta.copy_source, insta.copy_dest_meta));
-      }
-      CHECK((set<pair<bool, string> >(rotinstr.depends.begin(), rotinstr.depends.end()).size() == rotinstr.depends.size()));
-      CHECK((set<pair<bool, string> >(rotinstr.removes.begin(), rotinstr.removes.end()).size() == rotinstr.removes.size()));
-      CHECK((set<pair<bool, string> >(rotinstr.creates.begin(), rotinstr.creates.end()).size() == rotinstr.creates.size()));
-      
-      vector<Instruction> nistr;
-      for(int i = 0; i < inst.size(); i++)
-        if(!count(loop.begin(), loop.end(), i))
-          nistr.push_back(inst[i]);
-      nistr.push_back(rotinstr);
-      return deloop(nistr);
-    }
-  }
-  return inst;
+// A hole the filesystem told us about, which we still have to hash, but never have to read
+void zipHole(long long len, void *ctx) {
+  ZipFeed *feed = (ZipFeed *)ctx;
+  ZeroRuns *runs = feed->runs;
+  feed->runs = NULL;
+  feedZeros(len, zipFeed, ctx);
+  feed->runs = runs;
+  if(feed->runs)
+    feed->runs->hole(len);
 }
 
-void sortInst(vector<Instruction> &oinst) {
-  oinst = deloop(oinst);
-  
-  vector<Instruction> buckets[TYPE_END];
-  map<pair<bool, string>, int> leftToUse;
-  for(int i = 0; i < oinst.size(); i++) {
-    CHECK(oinst[i].type >= 0 && oinst[i].type < TYPE_END);
-    buckets[oinst[i].type].push_back(oinst[i]);
-    for(int j = 0; j < oinst[i].depends.size(); j++)
-      leftToUse[oinst[i].depends[j]]++;
-  }
-  CHECK(buckets[0].size() == 1);
-  
-  vector<Instruction>().swap(oinst);  // deallocate
+void zipLiteral(const char *data, int len, void *ctx) {
+  zipWriteInFileInZip(((ZipFeed *)ctx)->dest, data, len);
+  countStat(STAT_BYTESCOMPRESSED, len);
+}
+
+void zipRun(long long start, long long len, void *ctx) {
+  HoleMap *holes = ((ZipFeed *)ctx)->holes;
+  if(holes->size() && holes->back().first + holes->back().second == start)
+    holes->back().second += len;
+  else
+    holes->push_back(make_pair(start, len));
+  countStat(STAT_BYTESSPARSE, len);
+}
+
+// Whatever the file has in [start, end) goes into dest, except for holes and long runs of zeros, which go into holes
+// instead. Those are offsets into the whole file, not into what we wrote.
+Checksum writeToZip(const Item *source, long long start, long long end, zipFile dest, const string &outfname, HoleMap *holes, SignatureBuilder *sigb = NULL) {
+  // One problem here - we have to read the entire file just to get the right checksum. This is something that should be fixed in the future, but isn't yet, and I'm not quite sure how.
+  //printf("%lld, %lld\n", start, end);
+  Digest c(checksumconfig.algorithm);
   
-  set<pair<bool, string> > live;
+  ZipFeed feed;
+  feed.c = &c;
+  feed.sigb = sigb;
+  feed.dest = dest;
+  feed.runs = NULL;
+  feed.holes = holes;
+  long long got = source->scan(0, start, zipFeed, zipHole, &feed);
+  if(got == start) {
+    ZeroRuns runs(start, zipLiteral, zipRun, &feed);
+    feed.runs = &runs;
+    got += source->scan(start, end, zipFeed, zipHole, &feed);
+    runs.finish();
+  }
+  if(got != end) {
+    printf("%s got shorter since it was planned, %lld of %lld\n", outfname.c_str(), got, end);
+    CHECK(0);
+  }
   
-  while(1) {
-    int tcl = 0;
-    for(int i = 0; i < TYPE_END; i++)
-      tcl += buckets[i].size();
-    if(!tcl)
-      break;
-    printf("Starting pass, %d instructions left. Instruction size is %d, oinst is %d\n", tcl, sizeof(Instruction), oinst.size());
-    {
-      int tsize = 0;
-      for(int i = 0; i < oinst.size(); i++)
-        tsize += oinst[i].bytesused();
-      printf("ts is %d\n", tsize);
-    }
-    bool didinexpensive = false;
-    for(int i = 0; i < TYPE_END; i++) {
-      if(didinexpensive && type_expensive[i]) {
-        printf("Skipping mode due to expensive commands, will return\n");
-        continue;
+  Checksum csr = source->signaturePart(end); // because I'm lazy
+  c.final(&csr);
+  return csr;
+}
+
+// Same idea as writeToZip, but only the literal runs of the delta get written. We still read the whole file so we can
+// check it's what we planned against, and so the next run has a signature to diff against.
+Checksum writePatchToZip(const Instruction &inst, zipFile dest, SignatureBuilder *sigb) {
+  Digest c(checksumconfig.algorithm);
+  ItemShunt *shunt = inst.patch_source->open();
+  CHECK(shunt);
+  vector<char> bufv(ioconfig.readsize);
+  char *buf = &bufv[0];
+  for(int i = 0; i < inst.patch_ops.size(); i++) {
+    const DeltaOp &op = inst.patch_ops[i];
+    string header = deltaOpHeader(op);
+    zipWriteInFileInZip(dest, header.data(), header.size());
+    long long left = op.len;
+    while(left) {
+      int desired = (int)min((long long)bufv.size(), left);
+      int rv = shunt->read(buf, desired);
+      if(rv != desired) {
+        printf("%s got shorter since it was diffed\n", inst.patch_path.c_str());
+        CHECK(0);
       }
-      vector<Instruction> buckupd;
-      for(int j = 0; j < buckets[i].size(); j++) {
-        bool good = true;
-        for(int k = 0; good && k < buckets[i][j].depends.size(); k++)
-          if(!live.count(buckets[i][j].depends[k]))
-            good = false;
-        for(int k = 0; good && k < buckets[i][j].removes.size(); k++)
-          if(!(leftToUse[buckets[i][j].removes[k]] == 0 || leftToUse[buckets[i][j].removes[k]] == 1 && count(buckets[i][j].depends.begin(), buckets[i][j].depends.end(), buckets[i][j].removes[k])))
-            good = false;
-        if(!good) {
-          buckupd.push_back(buckets[i][j]);
-          continue;
-        }
-        //dprintf("%s\n", buckets[i][j].textout().c_str());
-        for(int k = 0; k < buckets[i][j].depends.size(); k++)
-          leftToUse[buckets[i][j].depends[k]]--;
-        for(int k = 0; k < buckets[i][j].removes.size(); k++) {
-          CHECK(live.count(buckets[i][j].removes[k]));
-          live.erase(buckets[i][j].removes[k]);
-        }
-        for(int k = 0; k < buckets[i][j].creates.size(); k++) {
-          pair<bool, string> ite = buckets[i][j].creates[k];
-          CHECK(!live.count(ite));
-          live.insert(buckets[i][j].creates[k]);
-        }
-        if(i != TYPE_CREATE) {  // these don't get output
-          oinst.push_back(buckets[i][j]);
-          if(!type_expensive[i])
-            didinexpensive = true;
-        }
+      if(!op.copy) {
+        zipWriteInFileInZip(dest, buf, rv);
+        countStat(STAT_BYTESCOMPRESSED, rv);
       }
-      buckets[i].swap(buckupd);
+      c.update(buf, rv);
+      sigb->feed(buf, rv);
+      left -= rv;
     }
-    for(int i = 0; i < TYPE_END; i++)
-      tcl -= buckets[i].size();
-    CHECK(tcl != 0);
   }
+  string end = deltaEnd();
+  zipWriteInFileInZip(dest, end.data(), end.size());
+  delete shunt;
+  
+  Checksum csr = inst.patch_source->signaturePart(inst.patch_size);
+  c.final(&csr);
+  return csr;
 }
 
-Checksum writeToZip(const Item *source, long long start, long long end, zipFile dest, const string &outfname) {
-  // One problem here - we have to read the entire file just to get the right checksum. This is something that should be fixed in the future, but isn't yet, and I'm not quite sure how.
-  //printf("%lld, %lld\n", start, end);
-  SHA_CTX c;
-  SHA1_Init(&c);
-  ItemShunt *shunt = source->open();
-  CHECK(shunt);
-  long long pos = 0;
-  while(pos != start) {
-    char buf[1024*128];
-    int desired = (int)min((long long)sizeof(buf), start - pos);
-    int rv = shunt->read(buf, desired);
-    CHECK(rv == desired);
-    pos += rv;
-    SHA1_Update(&c, buf, rv);
-  }
-  
-  while(pos != end) {
-    char buf[1024*128];
-    int desired = (int)min((long long)sizeof(buf), end - pos);
-    int rv = shunt->read(buf, desired);
-    if(rv != desired) {
-      printf("rv isn't desired! %d, %d\n", rv, desired);
-      printf("in the middle %s\n", outfname.c_str());
+bool wantsSignature(long long size) {
+  return size >= patchminsize && size < chunkthreshold;
+}
+
+// Writes each chunk we haven't stored before as its own member, named by its hash, and records where it went
+void writeChunksToZip(const Item *source, const vector<ChunkRef> &chunks, zipFile dest, const string &archivename, int tversion, ChunkStore *store, long long *data) {
+  ItemShunt *shunt = NULL;
+  vector<char> buf;
+  for(int i = 0; i < chunks.size(); i++) {
+    string hex = chunks[i].hex();
+    if(store->has(hex))
+      continue;
+    
+    if(!shunt) {
+      shunt = source->open();
+      CHECK(shunt);
+    }
+    buf.resize(chunks[i].len);
+    shunt->seek(chunks[i].offset);
+    CHECK(shunt->read(&buf[0], chunks[i].len) == chunks[i].len);
+    
+    unsigned char hash[20];
+    SHA1((const unsigned char *)&buf[0], chunks[i].len, hash);
+    if(memcmp(hash, chunks[i].hash, sizeof(hash))) {
+      printf("Chunk at %lld changed since it was planned\n", chunks[i].offset);
       CHECK(0);
     }
-    pos += rv;
-    zipWriteInFileInZip(dest, buf, rv);
-    SHA1_Update(&c, buf, rv);
+    
+    zip_fileinfo zfi;
+    zfi.dosDate = time(NULL);
+    zfi.internal_fa = 0;
+    zfi.external_fa = 0;
+    CHECK(!zipOpenNewFileInZip(dest, hex.c_str(), &zfi, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_DEFAULT_COMPRESSION));
+    store->add(hex, StringPrintf("%08d/%s@%lu", tversion, archivename.c_str(), (unsigned long)zipGetLocalHeaderOffset(dest)));
+    zipWriteInFileInZip(dest, &buf[0], chunks[i].len);
+    countStat(STAT_BYTESCOMPRESSED, chunks[i].len);
+    CHECK(!zipCloseFileInZip(dest));
+    *data += chunks[i].len;
   }
-  
   delete shunt;
-  
-  Checksum csr = source->signaturePart(end); // because I'm lazy
-  SHA1_Final(csr.bytes, &c);
-  return csr;
 }
 
 long long filesize(const string &fsz) {
@@ -410,7 +408,7 @@ public:
 
   long long getCSize() const;
 
-  ArchiveState(const string &origstate, State *newstate, const string &destpath);
+  ArchiveState(State *newstate, ChunkStore *chunks, SignatureStore *sigs, const string &destpath);
   ~ArchiveState();
 
 private:
@@ -419,8 +417,15 @@ private:
   int archivemode;
   zipFile archivefile;
   string fname;
+  string archivename;
+
+  map<string, SessionIndexEntry> index;
+  SessionIndexEntry currentEntry(const pair<bool, string> &src) const;
+  void indexInst(const Instruction &inst, const string &member);
 
   State *newstate;
+  ChunkStore *chunks;
+  SignatureStore *sigs;
   string destpath;
 
   long long used;
@@ -428,10 +433,81 @@ private:
   int entries;
 
   int archives;
-
-  string origstate;
 };
 
+// What a file that an instruction depends on looks like, relative to the previous session
+SessionIndexEntry ArchiveState::currentEntry(const pair<bool, string> &src) const {
+  if(src.first && index.count(src.second))
+    return index.find(src.second)->second;
+  SessionIndexEntry sie;
+  sie.origin = src.second;
+  return sie;
+}
+
+void ArchiveState::indexInst(const Instruction &inst, const string &member) {
+  if(inst.type == TYPE_STORE) {
+    SessionIndexEntry sie;
+    sie.store = member;
+    sie.meta = inst.store_meta;
+    index[inst.store_path] = sie;
+  } else if(inst.type == TYPE_CHUNK) {
+    SessionIndexEntry sie;
+    for(int i = 0; i < inst.chunk_list.size(); i++)
+      sie.chunks.push_back(chunks->location(inst.chunk_list[i].hex()));
+    sie.meta = inst.chunk_meta;
+    index[inst.chunk_path] = sie;
+  } else if(inst.type == TYPE_APPEND) {
+    SessionIndexEntry sie = currentEntry(make_pair(false, inst.append_path));
+    sie.appends.push_back(member);
+    sie.meta = inst.append_meta;
+    index[inst.append_path] = sie;
+  } else if(inst.type == TYPE_PATCH) {
+    SessionIndexEntry sie = currentEntry(make_pair(false, inst.patch_path));
+    sie.appends.push_back("patch:" + member);
+    sie.meta = inst.patch_meta;
+    index[inst.patch_path] = sie;
+  } else if(inst.type == TYPE_COPY) {
+    CHECK(inst.depends.size() == 1 && inst.depends[0].second == inst.copy_source);
+    SessionIndexEntry sie = currentEntry(inst.depends[0]);
+    sie.meta = inst.copy_dest_meta;
+    index[inst.copy_dest] = sie;
+  } else if(inst.type == TYPE_ROTATE) {
+    vector<SessionIndexEntry> srcs;
+    for(int i = 0; i < inst.rotate_paths.size(); i++) {
+      pair<bool, string> dep = make_pair(false, inst.rotate_paths[i].first);
+      for(int j = 0; j < inst.depends.size(); j++)
+        if(inst.depends[j].second == inst.rotate_paths[i].first)
+          dep = inst.depends[j];
+      srcs.push_back(currentEntry(dep));
+      srcs.back().meta = inst.rotate_paths[i].second;
+    }
+    for(int i = 0; i < inst.rotate_paths.size(); i++)
+      index[inst.rotate_paths[(i + 1) % inst.rotate_paths.size()].first] = srcs[i];
+  } else if(inst.type == TYPE_MOVE) {
+    // Runs before the state sees the move, so the old paths still have their items
+    for(int i = 0; i < inst.depends.size(); i++) {
+      SessionIndexEntry sie = currentEntry(inst.depends[i]);
+      sie.meta = newstate->findItem(inst.depends[i].second)->metadata();
+      index[inst.creates[i].second] = sie;
+    }
+    for(int i = 0; i < inst.removes.size(); i++) {
+      SessionIndexEntry sie;
+      sie.deleted = true;
+      index[inst.removes[i].second] = sie;
+    }
+  } else if(inst.type == TYPE_DELETE) {
+    SessionIndexEntry sie;
+    sie.deleted = true;
+    index[inst.delete_path] = sie;
+  } else if(inst.type == TYPE_TOUCH) {
+    SessionIndexEntry sie = currentEntry(make_pair(false, inst.touch_path));
+    sie.meta = inst.touch_meta;
+    index[inst.touch_path] = sie;
+  } else {
+    CHECK(0);
+  }
+}
+
 void ArchiveState::doInst(const Instruction &inst, int tversion) {
   
   used += usedperitem;
@@ -446,27 +522,22 @@ void ArchiveState::doInst(const Instruction &inst, int tversion) {
     used += filesize(fname);
   }
 
-  if(inst.type == TYPE_APPEND || inst.type == TYPE_STORE) {
+  if(inst.type == TYPE_APPEND || inst.type == TYPE_PATCH || inst.type == TYPE_STORE) {
     
     if(archivemode == -1) {
       
       // Open archive, write appropriate record, then rewind one item so we don't duplicate code
-      string pfname = StringPrintf("%02d%s.zip", archives++, (inst.type == TYPE_APPEND) ? "append" : "store");
+      string kind = (inst.type == TYPE_APPEND) ? "append" : (inst.type == TYPE_PATCH) ? "patch" : "store";
+      string pfname = StringPrintf("%02d%s.zip", archives++, kind.c_str());
       fname = StringPrintf("%s/%s", destpath.c_str(), pfname.c_str());
+      archivename = pfname;
       CHECK(archivefile = zipOpen(fname.c_str(), APPEND_STATUS_CREATE));
       archivemode = inst.type;
       
-      if(inst.type == TYPE_APPEND) {
-        kvData kvd;
-        kvd.category = "append";
-        kvd.kv["source"] = pfname;
-        fprintf(proc, "%s\n", putkvDataInlineString(kvd).c_str());
-      } else {
-        kvData kvd;
-        kvd.category = "store";
-        kvd.kv["source"] = pfname;
-        fprintf(proc, "%s\n", putkvDataInlineString(kvd).c_str());
-      }
+      kvData kvd;
+      kvd.category = kind;
+      kvd.kv["source"] = pfname;
+      fprintf(proc, "%s\n", putkvDataInlineString(kvd).c_str());
       
       entries++;
   
@@ -477,31 +548,99 @@ void ArchiveState::doInst(const Instruction &inst, int tversion) {
     zfi.dosDate = time(NULL);
     zfi.internal_fa = 0;
     zfi.external_fa = 0;
+    HoleMap holes;
     if(inst.type == TYPE_APPEND) {
       CHECK(!zipOpenNewFileInZip(archivefile, inst.append_path.c_str() + 1, &zfi, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_DEFAULT_COMPRESSION));
+      string member = StringPrintf("%s@%lu", archivename.c_str(), (unsigned long)zipGetLocalHeaderOffset(archivefile));
       data += inst.append_size - newstate->findItem(inst.append_path)->size();
-      Checksum rvx = writeToZip(inst.append_source, newstate->findItem(inst.append_path)->size(), inst.append_size, archivefile, inst.append_path.c_str());
+      SignatureBuilder sigb(inst.append_size);
+      Checksum rvx = writeToZip(inst.append_source, newstate->findItem(inst.append_path)->size(), inst.append_size, archivefile, inst.append_path.c_str(), &holes, &sigb);
       CHECK(rvx == inst.append_checksum);
       CHECK(!zipCloseFileInZip(archivefile));
+      indexInst(inst, holes.size() ? member + "@" + holeMapString(holes) : member);
+      if(wantsSignature(inst.append_size))
+        sigs->put(inst.append_path, sigb.finish(rvx));
+      else
+        sigs->erase(inst.append_path);
+    } else if(inst.type == TYPE_PATCH) {
+      CHECK(!zipOpenNewFileInZip(archivefile, inst.patch_path.c_str() + 1, &zfi, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_DEFAULT_COMPRESSION));
+      indexInst(inst, StringPrintf("%s@%lu", archivename.c_str(), (unsigned long)zipGetLocalHeaderOffset(archivefile)));
+      data += inst.patch_literal;
+      SignatureBuilder sigb(inst.patch_size);
+      Checksum rvx = writePatchToZip(inst, archivefile, &sigb);
+      if(rvx != inst.patch_source->checksumPart(inst.patch_size)) {
+        printf("%s changed since it was diffed\n", inst.patch_path.c_str());
+        CHECK(0);
+      }
+      CHECK(!zipCloseFileInZip(archivefile));
+      sigs->put(inst.patch_path, sigb.finish(rvx));
     } else {
       CHECK(inst.type == TYPE_STORE);
       CHECK(!zipOpenNewFileInZip(archivefile, inst.store_path.c_str() + 1, &zfi, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_DEFAULT_COMPRESSION));
+      string member = StringPrintf("%s@%lu", archivename.c_str(), (unsigned long)zipGetLocalHeaderOffset(archivefile));
       data += inst.store_size;
-      Checksum rvx = writeToZip(inst.store_source, 0, inst.store_size, archivefile, inst.store_path.c_str());
+      SignatureBuilder sigb(inst.store_size);
+      Checksum rvx = writeToZip(inst.store_source, 0, inst.store_size, archivefile, inst.store_path.c_str(), &holes, &sigb);
+      // Planning may not have needed the checksum, in which case this read is where it comes from
+      if(!inst.store_source->hasChecksum(inst.store_size))
+        inst.store_source->cacheChecksum(inst.store_size, rvx);
       if(rvx != inst.store_source->checksumPart(inst.store_size)) { // since this is where the "checksum" comes from in the file
         printf("%s checksum mismatch\n", inst.store_path.c_str());
         CHECK(0);
       }
       CHECK(!zipCloseFileInZip(archivefile));
+      indexInst(inst, holes.size() ? member + "@" + holeMapString(holes) : member);
+      if(wantsSignature(inst.store_size))
+        sigs->put(inst.store_path, sigb.finish(rvx));
+      else
+        sigs->erase(inst.store_path);
     }
     
     // this should be a touch record
-    fprintf(proc, "%s\n", inst.processString().c_str());
+    fprintf(proc, "%s\n", inst.processString(holes).c_str());
     //printf("%s\n", inst.textout().c_str());
     
+  } else if(inst.type == TYPE_CHUNK) {
+    
+    if(archivemode == -1) {
+      string pfname = StringPrintf("%02dchunks.zip", archives++);
+      fname = StringPrintf("%s/%s", destpath.c_str(), pfname.c_str());
+      archivename = pfname;
+      CHECK(archivefile = zipOpen(fname.c_str(), APPEND_STATUS_CREATE));
+      archivemode = inst.type;
+      
+      kvData kvd;
+      kvd.category = "chunks";
+      kvd.kv["source"] = pfname;
+      fprintf(proc, "%s\n", putkvDataInlineString(kvd).c_str());
+      
+      entries++;
+    }
+    
+    // Chunks that an earlier instruction or an earlier session already stored are only referenced
+    writeChunksToZip(inst.chunk_source, inst.chunk_list, archivefile, archivename, tversion, chunks, &data);
+    indexInst(inst, "");
+    sigs->erase(inst.chunk_path);
+    
+    fprintf(proc, "%s\n", inst.processString().c_str());
+    
   } else {
     // Write instruction as normal, it's not an append or a store
     fprintf(proc, "%s\n", inst.processString().c_str());
+    indexInst(inst, "");
+    
+    if(inst.type == TYPE_COPY) {
+      sigs->copy(inst.copy_source, inst.copy_dest);
+    } else if(inst.type == TYPE_ROTATE) {
+      vector<string> paths;
+      for(int i = 0; i < inst.rotate_paths.size(); i++)
+        paths.push_back(inst.rotate_paths[i].first);
+      sigs->rotate(paths);
+    } else if(inst.type == TYPE_MOVE) {
+      sigs->moveTree(inst.move_source, inst.move_dest);
+    } else if(inst.type == TYPE_DELETE) {
+      sigs->erase(inst.delete_path);
+    }
   }
   
   newstate->process(inst, tversion);
@@ -516,11 +655,13 @@ long long ArchiveState::getCSize() const {
   return tused;
 }
 
-ArchiveState::ArchiveState(const string &in_origstate, State *in_newstate, const string &in_destpath) {
+ArchiveState::ArchiveState(State *in_newstate, ChunkStore *in_chunks, SignatureStore *in_sigs, const string &in_destpath) {
   proc = fopen(StringPrintf("%s/process", in_destpath.c_str()).c_str(), "w");
   CHECK(proc);
   
   newstate = in_newstate;
+  chunks = in_chunks;
+  sigs = in_sigs;
   destpath = in_destpath;
   
   archivemode = -1;
@@ -532,7 +673,7 @@ ArchiveState::ArchiveState(const string &in_origstate, State *in_newstate, const
   
   archives = 0;
   
-  origstate = in_origstate;
+  newstate->clearChanges();
 }
 
 ArchiveState::~ArchiveState() {
@@ -545,24 +686,28 @@ ArchiveState::~ArchiveState() {
   
   fclose(proc);
   
-  printf("Writing state\n");
-  newstate->writeOut(StringPrintf("%s/newstate", destpath.c_str()));
-  printf("Writing state\n");
+  printf("Writing state diff\n");
+  newstate->writeDiff(StringPrintf("%s/statediff", destpath.c_str()));
   
-  system(StringPrintf("diff %s %s/newstate > %s/statediff", origstate.c_str(), destpath.c_str(), destpath.c_str()).c_str());
-  unlink(StringPrintf("%s/newstate", destpath.c_str()).c_str());
+  {
+    ofstream ofs(StringPrintf("%s/index", destpath.c_str()).c_str());
+    CHECK(ofs);
+    for(map<string, SessionIndexEntry>::const_iterator itr = index.begin(); itr != index.end(); itr++)
+      putkvDataInline(ofs, itr->second.toKvd(itr->first), "path");
+  }
 }
   
 // Things we generate:
 // * Process file, consisting of every step
 // * Some number of archive files
 // * Some number of other compressed datafiles, possibly
-// * State diff
-void generateArchive(const vector<Instruction> &inst, State *newstate, const string &origstate, long long size, const string &destpath, bool *spaceleft, int tversion) {
+// * State diff, in the same format as the state file, which State::applyDiff() can replay
+void generateArchive(const vector<Instruction> &inst, State *newstate, ChunkStore *chunks, SignatureStore *sigs, long long size, const string &destpath, bool *spaceleft, int tversion) {
+  PhaseTimer pt(PHASE_ARCHIVE);
   
   dprintf("Starting archive - %d instructions\n", inst.size());
   
-  ArchiveState ars(origstate, newstate, destpath);
+  ArchiveState ars(newstate, chunks, sigs, destpath);
   
   for(int i = 0; i < inst.size(); i++) {
     long long tused = ars.getCSize() + usedperitem;
@@ -615,18 +760,15 @@ long long getTotalSizeUsed(const string &path) {
   return tsize;
 }
 
-pair<int, long long> inferDiscInfo() {
+pair<int, long long> inferDiscInfo(long long usedsize) {
   // For one thing, we don't know how much data we can actually hold
   // For another thing, we don't know anything about our various overheads
   // And for a third thing, we basically, essentially, don't know anything
   // Why the hell do these tools suck so much?
   
-  const string drive = "/cygdrive/m";
-  //const string drive = "/cygdrive/c/werk/sea/purebackup/temp";
+  const string &drive = drivepath;
   //const long long drivesize = 40*1024*1024 + getTotalSizeUsed(drive);
-  const long long drivesize = 4482ll*1024*1024;
   
-  long long usedsize = getTotalSizeUsed(drive);
   printf("%lld bytes used\n", usedsize);
   
   // We ignore whether there's a disc or not - this code works even if there's an empty disc.
@@ -671,543 +813,871 @@ pair<int, long long> inferDiscInfo() {
   return make_pair(dirnames.back(), drivesize - usedsize);
 };
 
-void createDirectoryTree(const string &tree) {
-  if(mkdir(tree.c_str(), 0755)) {
-    createDirectoryTree(string(tree.c_str(), (const char *)strrchr(tree.c_str(), '/')));
-    CHECK(!mkdir(tree.c_str(), 0755));
-  }
+// Everything a backup starts from that carries over to the next one
+struct BackupState {
+  int stateid;
+  State state;
+  ChunkStore chunks;
+  SignatureStore sigs;
+  map<string, Item> items;  // what the last backup in this process found, if there was one
+  bool scanned;
+  bool loaded;  // whether state, chunks and sigs have been read yet, or just stateid
+  long long driveused;  // -1 unless someone's keeping count, in which case the drive doesn't get walked again
+};
+
+// Only checkpoints are full states. The sessions in between just leave a diff, and whatever signatures are
+// out of date by then fail describes() and get ignored.
+void writeCheckpoint(const State &state, const SignatureStore &sigs, int id) {
+  state.writeOut(StringPrintf("states/%08d", id));
+  sigs.writeOut(StringPrintf("states/%08d.sigs", id));
 }
 
-FILE *openAndCreatePath(const string &path) {
-  printf("open %s\n", path.c_str());
-  FILE *fil = fopen(path.c_str(), "wb");
-  if(!fil) {
-    createDirectoryTree(string(path.c_str(), (const char *)strrchr(path.c_str(), '/')));
-    fil = fopen(path.c_str(), "wb");
-  }
-  CHECK(fil);
-  return fil;
+// The newest full state at or before id, with the diffs since replayed on top
+void loadState(int id, State *state, SignatureStore *sigs) {
+  int full = id;
+  struct stat stt;
+  while(full > 0 && stat(StringPrintf("states/%08d", full).c_str(), &stt))
+    full--;
+  state->readFile(StringPrintf("states/%08d", full));
+  sigs->readFile(StringPrintf("states/%08d.sigs", full));
+  for(int i = full + 1; i <= id; i++)
+    state->applyDiff(StringPrintf("states/%08d.diff", i));
 }
 
-void applyMetadata(const string &path, const Metadata &meta) {
-  timeval tv[2];
-  memset(tv, 0, sizeof(tv));
-  tv[0].tv_sec = meta.timestamp;
-  tv[1].tv_sec = meta.timestamp;
+// Just which state is the current one. The state itself is left for loadBackupState, which the first backup
+// does alongside its scan if it can.
+void findBackupState(BackupState *bs) {
+  FILE *vidi = fopen("states/current", "r");
+  bs->stateid = 0;
+  if(vidi) {
+    fscanf(vidi, "%d", &bs->stateid);
+    fclose(vidi);
+  } else {
+    system("touch states/00000000");
+  }
   
-  CHECK(!utimes(path.c_str(), tv));
+  bs->scanned = false;
+  bs->loaded = false;
+  bs->driveused = -1;
 }
 
-void copyFile(const string &src, const string &dst, const Metadata &meta) {
-  FILE *fsrc = fopen(src.c_str(), "rb");
-  FILE *fdst = openAndCreatePath(dst);
+void loadBackupState(BackupState *bs) {
+  PhaseTimer pt(PHASE_STATELOAD);
   
-  CHECK(fsrc);
-  CHECK(fdst);
-  
-  while(1) {
-    char buf[65536];
-    int rv = fread(buf, 1, sizeof(buf), fsrc);
-    
-    if(!rv)
-      break;
-    
-    fwrite(buf, 1, rv, fdst);
-  };
+  loadState(bs->stateid, &bs->state, &bs->sigs);
+  bs->chunks.readFile("states/chunks");
+  bs->loaded = true;
+}
+
+// Whether an item needs its full checksum before planning, and how much of it. Chunked and patched files get hashed
+// by the pass that cuts or diffs them, so they're left out. Files that grew get their old length hashed on the same
+// pass, for the append check, unless the old checksum used some other hash.
+static bool prehashJob(const string &path, const Item &ite, const State &origstate, const SignatureStore &sigs, HashJob *job) {
+  if(!ite.localPath() || ite.size() >= chunkthreshold)
+    return false;
+  job->item = &ite;
+  job->prefix = -1;
+  const Item *orig = origstate.findItem(path);
+  if(orig) {
+    if(ite.size() == orig->size() && ite.metadata() == orig->metadata())
+      return false;
+    const BlockSignature *sig = sigs.find(path);
+    if(wantsSignature(ite.size()) && sig && sig->describes(*orig))
+      return false;
+    if(ite.size() > orig->size() && orig->size() > 0 && orig->checksum().algo == checksumconfig.algorithm)
+      job->prefix = orig->size();
+  }
+  return true;
+}
+
+// Hashing doesn't wait for the whole scan. Each directory the scan is done with goes to a thread of its own, which
+// files it into realitems and hashes whatever in it is new or changed, with as many reads in flight as the disks can
+// take, while the scan carries on with the rest. That thread loads the last state first if it hasn't been, so the
+// load goes on alongside the scan too. New files that might have been moved there wait until the planner knows about
+// moves, hardlinks wait until it's clear which link comes first, and new files of a size the last state doesn't have
+// wait to see if anything else in the scan has it.
+class ScanPipeline {
+public:
+  BackupState *bs;
+  map<string, Item> *realitems;
   
-  fclose(fsrc);
-  fclose(fdst);
+  Mutex mutex;
+  Condition ready;
+  vector<vector<pair<string, Item> > > batches;  // finished directories, not filed yet
+  bool scanning;
   
-  applyMetadata(dst, meta);
+  set<string> deferred;
+  set<long long> origsizes;
+  map<long long, int> realsizes;
+  int files;
+  long long bytes;
+};
+
+static void pipelineFinished(const string &path, const MountTree &dir, void *ctx) {
+  ScanPipeline *pipe = (ScanPipeline *)ctx;
+  vector<pair<string, Item> > batch;
+  for(map<string, MountTree>::const_iterator itr = dir.links.begin(); itr != dir.links.end(); itr++)
+    if(itr->second.type == MTT_ITEM)
+      batch.push_back(make_pair(path + "/" + itr->first, itr->second.item));
+  if(!batch.size())
+    return;
+  MutexLock lock(&pipe->mutex);
+  pipe->batches.push_back(vector<pair<string, Item> >());
+  pipe->batches.back().swap(batch);
+  pipe->ready.signal();
 }
 
-void restore(const string &src, const string &dst) {
-  ifstream fil(StringPrintf("%s/process", src.c_str()).c_str());
-  
-  kvData kvd;
-  while(getkvDataInline(fil, kvd)) {
-    if(kvd.category == "store") {
-      string start = kvd.consume("source");
-      
-      unzFile unzf = unzOpen((src + "/" + start).c_str());
-      CHECK(unzf);
-      
-      CHECK(unzGoToFirstFile(unzf) == UNZ_OK);
-      
-      do {
-        char filename[1024];
-        
-        CHECK(unzGetCurrentFileInfo(unzf, NULL, filename, sizeof(filename), NULL, 0, NULL, 0) == UNZ_OK);
-        
-        string realfile = dst + "/" + filename;
-        printf("Creatinating file %s\n", realfile.c_str());
-        
-        CHECK(unzOpenCurrentFile(unzf) == UNZ_OK);
-        
-        FILE *fil = openAndCreatePath(realfile.c_str());
-        do {
-          char buf[65536];
-          
-          int byter = unzReadCurrentFile(unzf, buf, sizeof(buf));
-          if(!byter)
-            break;
-          
-          fwrite(buf, 1, byter, fil);
-        } while(1);
-        
-        fclose(fil);
-        
-        unzCloseCurrentFile(unzf);
-          
-      } while(unzGoToNextFile(unzf) == UNZ_OK);
-      
-      unzClose(unzf);
-      
-    } else if(kvd.category == "touch") {
-      
-      string path = kvd.consume("path");
-      Metadata meta = metaParseFromKvd(getkvDataInlineString(kvd.consume("meta")));
-      
-      applyMetadata(dst + path, meta);
-      
-    } else if(kvd.category == "copy") {
-      
-      copyFile(dst + kvd.consume("source"), dst + kvd.consume("dest"), metaParseFromKvd(getkvDataInlineString(kvd.consume("dest_meta"))));
+static void pipelineDone(ScanPipeline *pipe) {
+  MutexLock lock(&pipe->mutex);
+  pipe->scanning = false;
+  pipe->ready.signal();
+}
 
-    } else if(kvd.category == "delete") {
-      
-      unlink((dst + kvd.consume("path")).c_str());
-    
-    } else if(kvd.category == "rotate") {
-      
-      int ct = 0;
-      for(ct = 0; kvd.kv.count(StringPrintf("meta%02d", ct)); ct++);
-      
-      CHECK(ct >= 2);
-      
-      vector<pair<string, Metadata> > path;
-      for(int i = 0; i < ct; i++)
-        path.push_back(make_pair(kvd.consume(StringPrintf("src%02ddst%02d", (i + 1) % ct, i)), metaParseFromKvd(getkvDataInlineString(kvd.consume(StringPrintf("meta%02d", i))))));
-      
-      reverse(path.begin(), path.end());
-      
-      path.insert(path.begin(), make_pair("/tmp1230478cvhoiuw", Metadata())); // wheeeeeeee
-      path.push_back(make_pair("/tmp1230478cvhoiuw", Metadata()));
-      
-      for(int i = 0; i < path.size() - 1; i++)
-        copyFile(dst + path[i + 1].first, dst + path[i].first, path[i].second);
-      
-      unlink((dst + "/tmp1230478cvhoiuw").c_str());
-      
-    } else if(kvd.category == "append") {
-      string start = kvd.consume("source");
-      
-      unzFile unzf = unzOpen((src + "/" + start).c_str());
-      CHECK(unzf);
-      
-      CHECK(unzGoToFirstFile(unzf) == UNZ_OK);
-      
-      do {
-        char filename[1024];
-        
-        CHECK(unzGetCurrentFileInfo(unzf, NULL, filename, sizeof(filename), NULL, 0, NULL, 0) == UNZ_OK);
-        
-        string realfile = dst + "/" + filename;
-        printf("Creatinating file %s\n", realfile.c_str());
-        
-        CHECK(unzOpenCurrentFile(unzf) == UNZ_OK);
-        
-        FILE *fil = fopen(realfile.c_str(), "a");
-        do {
-          char buf[65536];
-          
-          int byter = unzReadCurrentFile(unzf, buf, sizeof(buf));
-          if(!byter)
-            break;
-          
-          fwrite(buf, 1, byter, fil);
-        } while(1);
-        fclose(fil);
-        
-        unzCloseCurrentFile(unzf);
-          
-      } while(unzGoToNextFile(unzf) == UNZ_OK);
-      
-      unzClose(unzf);
-      
-    } else {
-      CHECK(0);
+static void runPipeline(void *data) {
+  ScanPipeline *pipe = (ScanPipeline *)data;
+  if(!pipe->bs->loaded)
+    loadBackupState(pipe->bs);
+  const State &origstate = pipe->bs->state;
+  
+  // A moved file keeps its size and timestamp, so a new one that matches something in the state might be one
+  set<pair<long long, long long> > origkeys;
+  for(map<string, Item>::const_iterator itr = origstate.getItemDb().begin(); itr != origstate.getItemDb().end(); itr++) {
+    origkeys.insert(make_pair(itr->second.size(), itr->second.metadata().timestamp));
+    pipe->origsizes.insert(itr->second.size());
+  }
+  
+  bool last = false;
+  while(!last) {
+    vector<vector<pair<string, Item> > > batches;
+    {
+      MutexLock lock(&pipe->mutex);
+      while(pipe->scanning && !pipe->batches.size())
+        pipe->ready.wait(&pipe->mutex);
+      batches.swap(pipe->batches);
+      last = !pipe->scanning;
     }
     
-    CHECK(kvd.isDone());
-    
+    vector<HashJob> jobs;
+    for(int i = 0; i < batches.size(); i++) {
+      for(int j = 0; j < batches[i].size(); j++) {
+        pair<map<string, Item>::iterator, bool> ins = pipe->realitems->insert(batches[i][j]);
+        CHECK(ins.second);
+        const string &path = ins.first->first;
+        const Item &ite = ins.first->second;
+        pipe->realsizes[ite.size()]++;
+        bool fresh = !origstate.findItem(path);
+        if(ite.inode() || (fresh && (origkeys.count(make_pair(ite.size(), ite.metadata().timestamp)) || !pipe->origsizes.count(ite.size())))) {
+          pipe->deferred.insert(path);
+          continue;
+        }
+        HashJob job;
+        if(!prehashJob(path, ite, origstate, pipe->bs->sigs, &job))
+          continue;
+        jobs.push_back(job);
+        pipe->files++;
+        pipe->bytes += ite.size();
+      }
+    }
+    if(jobs.size()) {
+      PhaseTimer pt(PHASE_PREHASH);
+      batchChecksum(jobs);
+    }
   }
 }
 
-long long cssi = 0;
+// The directories of everything where the state and the scan disagree - files that didn't make it in, and files the
+// state has that the scan didn't see, which can happen when the watcher heard about a change too late to tell where
+// it was - plus whatever the exclusions want looked at again.
+void findLeftover(const map<string, Item> &realitems, const State &state, set<string> *leftover) {
+  leftover->clear();
+  const map<string, Item> &saved = state.getItemDb();
+  for(map<string, Item>::const_iterator itr = realitems.begin(); itr != realitems.end(); itr++) {
+    map<string, Item>::const_iterator sitr = saved.find(itr->first);
+    if(sitr == saved.end() || sitr->second.size() != itr->second.size() || sitr->second.metadata() != itr->second.metadata())
+      leftover->insert(itr->first.substr(0, itr->first.rfind('/')));
+  }
+  for(map<string, Item>::const_iterator itr = saved.begin(); itr != saved.end(); itr++)
+    if(!realitems.count(itr->first))
+      leftover->insert(itr->first.substr(0, itr->first.rfind('/')));
+  leftover->insert(excludeRecheck().begin(), excludeRecheck().end());
+}
+
 extern int if_presig;
 extern int if_mid;
+extern int if_sample;
+extern int if_falsepos;
 extern int if_full;
 
-int main(int argc, char **argv) {
+// One backup: scan, plan against the state, write a session to temp/, and bring the state up to date. Only the
+// directories the journal names get looked at, if it's complete. Returns false if there's no room left on the disc.
+// Directories with anything that didn't make it into the state end up in leftover.
+bool backupOnce(BackupState *bs, const Journal &journal, bool checkpoint, const string &command, set<string> *leftover) {
+  pair<int, long long> inf = inferDiscInfo(bs->driveused == -1 ? getTotalSizeUsed(drivepath) : bs->driveused);
+  if(inf.second < 1048576) {
+    printf("New disc, fucker!\n");
+    return false;
+  }
   
-  if(argc != 2) {
-    printf("purebackup backup or purebackup restore - and seriously, you really want to email zorba-purebackup@pavlovian.net if you want to do anything serious with this program.");
-    return 0;
+  string nextstate = StringPrintf("states/%08d", bs->stateid + 1);
+  
+  CHECK(inf.first == -1 || inf.first == bs->stateid);
+  
+  const State &origstate = bs->state;
+  ChunkStore &chunks = bs->chunks;
+  SignatureStore &sigs = bs->sigs;
+  
+  // The scan only needs the last state if it's going to take directories from it. Otherwise the state gets loaded
+  // alongside the scan.
+  if(!bs->loaded && journal.complete)
+    loadBackupState(bs);
+  
+  // If we've scanned before, that scan's items stand in for the last state, and keep whatever got hashed
+  const map<string, Item> *previous = bs->scanned ? &bs->items : bs->loaded ? &origstate.getItemDb() : NULL;
+  
+  map<string, Item> realitems;
+  ScanPipeline pipe;
+  pipe.bs = bs;
+  pipe.realitems = &realitems;
+  pipe.scanning = true;
+  pipe.files = 0;
+  pipe.bytes = 0;
+  pthread_t pipethread = startThread(runPipeline, &pipe);
+  {
+    PhaseTimer pt(PHASE_SCAN);
+    if(journal.complete) {
+      printf("Scanning items, %d changed directories and %d changed trees according to the watcher\n", (int)journal.dirty.size(), (int)journal.recursive.size());
+      scanPaths(&journal, previous, pipelineFinished, &pipe);
+    } else {
+      printf("Scanning all items - %s\n", journal.reason.c_str());
+      scanPaths(NULL, previous, pipelineFinished, &pipe);
+    }
+    dprintf("%d directories listed, %d taken from the last state, %d paths masked by pattern\n", scan_listed, scan_reused, scan_masked);
+    printExcludeStats();
+    pipelineDone(&pipe);
   }
+  joinThread(pipethread);
+  printf("Hashed %d new or changed files, %lld bytes, as their directories were scanned\n", pipe.files, pipe.bytes);
+  dprintf("%d items found\n", realitems.size());
+  printItemStats(realitems.size());
+  set<string> plannedchunks;  // chunks some earlier instruction in this run will store
   
-  string command = argv[1];
-  if(command == "backup") {
+  map<pair<bool, string>, Item> citem;
+  map<long long, vector<pair<bool, string> > > citemsizemap;
+  set<string> ftc;
+  map<pair<long long, long long>, string> linked;  // for each hardlinked file, the first path whose new version is settled
+  int hardlinks = 0;
   
-    pair<int, long long> inf = inferDiscInfo();
-    if(inf.second < 1048576) {
-      printf("New disc, fucker!\n");
-      return 0;
+  Instruction fi;
+  fi.type = TYPE_CREATE;
+  
+  vector<Instruction> inst;
+  
+  //map<long long, int> sizefreq;
+  
+  // Only the directories the journal names need looking at, since everything else is just as the state has it
+  for(map<string, Item>::iterator itr = realitems.begin(); itr != realitems.end(); itr++) {
+    CHECK(itr->second.size() >= 0);
+    CHECK(itr->second.metadata().timestamp >= 0);
+    if(!journal.complete || journal.changed(itr->first.substr(0, itr->first.rfind('/'))))
+      ftc.insert(itr->first);
+    //sizefreq[itr->second.size()]++;
+  }
+  
+  /*
+  {
+    FILE *sfq = fopen("sizefreq.txt", "w");
+    for(map<long long, int>::iterator itr = sizefreq.begin(); itr != sizefreq.end(); itr++)
+      if(itr->second > 1)
+        fprintf(sfq, "%lld: %d\n", itr->first, itr->second);
+    fclose(sfq);
+  }
+  
+  return 0;*/
+  
+  for(map<string, Item>::const_iterator itr = origstate.getItemDb().begin(); itr != origstate.getItemDb().end(); itr++) {
+    CHECK(itr->second.size() >= 0);
+    CHECK(itr->second.metadata().timestamp >= 0);
+    CHECK(citem.count(make_pair(false, itr->first)) == 0);
+    citem[make_pair(false, itr->first)] = itr->second;
+    citemsizemap[itr->second.size()].push_back(make_pair(false, itr->first));
+    fi.creates.push_back(make_pair(false, itr->first));
+    if(!journal.complete || journal.changed(itr->first.substr(0, itr->first.rfind('/')))) {
+      ftc.insert(itr->first);
+    } else {
+      fi.creates.push_back(make_pair(true, itr->first));
+      map<string, Item>::const_iterator real = realitems.find(itr->first);
+      if(real != realitems.end() && real->second.inode())
+        linked.insert(make_pair(make_pair(real->second.device(), real->second.inode()), itr->first));
+    }
+  }
+  
+  // A link that's just as it was before is settled already, wherever it sorts, so the other links to it can become
+  // copies of it without anything being read
+  for(map<string, Item>::const_iterator itr = realitems.begin(); itr != realitems.end(); itr++) {
+    if(!itr->second.inode())
+      continue;
+    map<pair<bool, string>, Item>::const_iterator pitr = citem.find(make_pair(false, itr->first));
+    if(pitr != citem.end() && itr->second.size() == pitr->second.size() && itr->second.metadata() == pitr->second.metadata())
+      linked.insert(make_pair(make_pair(itr->second.device(), itr->second.inode()), itr->first));
+  }
+  
+  // A renamed directory comes out as one move, and before the hashing, so that nothing that went along with it gets read.
+  // The new paths stand in for the old items from here on, since they're the same files.
+  set<string> moved;
+  {
+    set<string> gone;
+    set<string> fresh;
+    for(set<string>::const_iterator itr = ftc.begin(); itr != ftc.end(); itr++) {
+      bool real = realitems.count(*itr);
+      bool orig = citem.count(make_pair(false, *itr));
+      if(orig && !real && !isNulled(*itr))
+        gone.insert(*itr);
+      else if(real && !orig)
+        fresh.insert(*itr);
     }
     
-    printf("Reading config\n");
-    readConfig("purebackup.conf");
-    
-    int curstateid;
-    string curstate;
-    string nextstate;
-    
-    {
-      FILE *vidi = fopen("states/current", "r");
-      curstateid = 0;
-      if(vidi) {
-        fscanf(vidi, "%d", &curstateid);
-        fclose(vidi);
-      } else {
-        system("touch states/00000000");
+    int movedfiles = 0;
+    vector<Instruction> moves = findMoves(origstate.getItemDb(), realitems, gone, fresh);
+    for(int i = 0; i < moves.size(); i++) {
+      const Instruction &ti = moves[i];
+      for(int j = 0; j < ti.creates.size(); j++) {
+        const Item &ite = realitems.find(ti.creates[j].second)->second;
+        moved.insert(ti.depends[j].second);
+        moved.insert(ti.creates[j].second);
+        citem[ti.creates[j]] = citem[ti.depends[j]];
+        citemsizemap[ite.size()].push_back(ti.creates[j]);
+        if(ite.inode())
+          linked.insert(make_pair(make_pair(ite.device(), ite.inode()), ti.creates[j].second));
       }
-      
-      curstate = StringPrintf("states/%08d", curstateid);
-      nextstate = StringPrintf("states/%08d", curstateid + 1);
+      movedfiles += ti.creates.size();
+      inst.push_back(ti);
     }
-    
-    CHECK(inf.first == -1 || inf.first == curstateid);
-    
-    printf("Scanning items\n");
-    scanPaths();
-    
-    printf("Dumping items\n");
-    map<string, Item> realitems;
-    getRoot()->dumpItems(&realitems, "");
-    dprintf("%d items found\n", realitems.size());
-    
-    State origstate;
-    origstate.readFile(curstate);
-    
-    map<pair<bool, string>, Item> citem;
-    map<long long, vector<pair<bool, string> > > citemsizemap;
-    set<string> ftc;
-    
-    Instruction fi;
-    fi.type = TYPE_CREATE;
-    
-    vector<Instruction> inst;
-    
-    //map<long long, int> sizefreq;
-    
-    for(map<string, Item>::iterator itr = realitems.begin(); itr != realitems.end(); itr++) {
-      CHECK(itr->second.size() >= 0);
-      CHECK(itr->second.metadata().timestamp >= 0);
-      ftc.insert(itr->first);
-      //sizefreq[itr->second.size()]++;
+    if(moves.size())
+      printf("%d directories moved, %d files in them\n", (int)moves.size(), movedfiles);
+  }
+  
+  // Whatever the scan left for later gets hashed now, all at once, apart from the files that moved
+  {
+    PhaseTimer pt(PHASE_PREHASH);
+    vector<HashJob> prehash;
+    long long prebytes = 0;
+    set<pair<long long, long long> > prelinked;
+    for(set<string>::const_iterator itr = pipe.deferred.begin(); itr != pipe.deferred.end(); itr++) {
+      const Item &ite = realitems.find(*itr)->second;
+      if(!ite.localPath() || ite.size() >= chunkthreshold || moved.count(*itr))
+        continue;
+      if(ite.inode() && (linked.count(make_pair(ite.device(), ite.inode())) || !prelinked.insert(make_pair(ite.device(), ite.inode())).second))
+        continue;  // the rest of its links become copies of the first one, or of one that didn't change, without being read
+      HashJob job;
+      if(!prehashJob(*itr, ite, origstate, sigs, &job))
+        continue;
+      // A new file that's the only one of its size can't be a copy of anything, so it gets stored, and storing it
+      // hashes it on the way past
+      if(!origstate.findItem(*itr) && !pipe.origsizes.count(ite.size()) && pipe.realsizes[ite.size()] == 1)
+        continue;
+      prehash.push_back(job);
+      prebytes += ite.size();
     }
-    
-    /*
-    {
-      FILE *sfq = fopen("sizefreq.txt", "w");
-      for(map<long long, int>::iterator itr = sizefreq.begin(); itr != sizefreq.end(); itr++)
-        if(itr->second > 1)
-          fprintf(sfq, "%lld: %d\n", itr->first, itr->second);
-      fclose(sfq);
+    printf("Hashing %d more new or changed files, %lld bytes\n", (int)prehash.size(), prebytes);
+    batchChecksum(prehash);
+  }
+  
+  printf("Starting examining\n");
+  startPhase(PHASE_PLAN);
+  
+  long long totcomsize = 0;
+  bool earlyterm = false;
+  
+  int ltime = 0;
+  
+  int itpos = 0;
+  // FTC is the union of the files in realitems and origstate
+  // citem is the items that we can look at
+  // citemsizemap is the same, only organized by size
+  for(set<string>::iterator itr = ftc.begin(); itr != ftc.end(); itr++) {
+    if(ltime != time(NULL)) {
+      printf("%d/%d files, %d/%d/%d/%d (%d false), %lld read, %lld filled, now %s\r", itpos, ftc.size(), if_presig, if_mid, if_sample, if_full, if_falsepos, stat_counters[STAT_BYTESHASHED], totcomsize, itr->c_str());
+      ltime = time(NULL);
     }
+    itpos++;
+    fflush(stdout);
     
-    return 0;*/
-    
-    for(map<string, Item>::const_iterator itr = origstate.getItemDb().begin(); itr != origstate.getItemDb().end(); itr++) {
-      CHECK(itr->second.size() >= 0);
-      CHECK(itr->second.metadata().timestamp >= 0);
-      CHECK(citem.count(make_pair(false, itr->first)) == 0);
-      citem[make_pair(false, itr->first)] = itr->second;
-      citemsizemap[itr->second.size()].push_back(make_pair(false, itr->first));
-      fi.creates.push_back(make_pair(false, itr->first));
-      ftc.insert(itr->first);
+    /*
+    if(totcomsize > inf.second * 2) {
+      printf("Archive is getting too big, splitting\n");
+      earlyterm = true;
+      break;
     }
+    */
+
+    // If it's null, it doesn't exist in the real items because we couldn't scan it. However, if we're iterating over it, it *must* exist.
+    // Therefore, it must exist in the original items.
+    CHECK(!(isNulled(*itr) && !citem.count(make_pair(false, *itr))));
     
-    printf("Starting examining\n");
-    
-    long long totcomsize = 0;
-    bool earlyterm = false;
+    // Both ends of a move are taken care of already
+    if(moved.count(*itr))
+      continue;
     
-    int ltime = 0;
+    //dprintf("Processing %s", itr->c_str());
     
-    int itpos = 0;
-    // FTC is the union of the files in realitems and origstate
-    // citem is the items that we can look at
-    // citemsizemap is the same, only organized by size
-    for(set<string>::iterator itr = ftc.begin(); itr != ftc.end(); itr++) {
-      if(ltime != time(NULL)) {
-        printf("%d/%d files, %d/%d/%d, %lld read, %lld filled, now %s\r", itpos, ftc.size(), if_presig, if_mid, if_full, cssi, totcomsize, itr->c_str());
-        ltime = time(NULL);
-      }
-      itpos++;
-      fflush(stdout);
+    // If it's null, we pretend it exists and is identical to what we currently have, which involves going through this section.
+    if(realitems.count(*itr) || isNulled(*itr)) {
+      const Item &ite = realitems.find(*itr)->second;
+      bool got = false;
       
-      /*
-      if(totcomsize > inf.second * 2) {
-        printf("Archive is getting too big, splitting\n");
-        earlyterm = true;
-        break;
+      // Another link to a file we've already dealt with is a copy of it, and we don't need to read anything to know -
+      // unless it's just as it was before, which is cheaper still
+      if(!got && !isNulled(*itr) && ite.inode() && linked.count(make_pair(ite.device(), ite.inode()))) {
+        map<pair<bool, string>, Item>::const_iterator pitr = citem.find(make_pair(false, *itr));
+        if(pitr == citem.end() || ite.size() != pitr->second.size() || ite.metadata() != pitr->second.metadata()) {
+          const string &source = linked[make_pair(ite.device(), ite.inode())];
+          Instruction ti;
+          ti.type = TYPE_COPY;
+          ti.creates.push_back(make_pair(true, *itr));
+          ti.depends.push_back(make_pair(true, source));
+          if(pitr != citem.end())
+            ti.removes.push_back(make_pair(false, *itr));
+          ti.copy_source = source;
+          ti.copy_dest = *itr;
+          ti.copy_dest_meta = ite.metadata();
+          ti.copy_link = true;
+          totcomsize += ti.size();
+          inst.push_back(ti);
+          hardlinks++;
+          got = true;
+        }
       }
-      */
-  
-      // If it's null, it doesn't exist in the real items because we couldn't scan it. However, if we're iterating over it, it *must* exist.
-      // Therefore, it must exist in the original items.
-      CHECK(!(isNulled(*itr) && !citem.count(make_pair(false, *itr))));
       
-      //dprintf("Processing %s", itr->c_str());
+      // First, we check to see if it's the same file as existed before
+      if(!got && citem.count(make_pair(false, *itr))) {
+        const Item &pite = citem.find(make_pair(false, *itr))->second;
+        if(isNulled(*itr) || ite.size() == pite.size() && ite.metadata() == pite.metadata()) {
+          // It's identical!
+          //printf("Preserve file %s\n", itr->c_str());
+          fi.creates.push_back(make_pair(true, *itr));
+          got = true;
+        } else if(ite.size() == pite.size() && ite.isChecksummable() && identicalFile(ite, pite)) {
+          // It's touched!
+          CHECK(ite.metadata() != pite.metadata());
+          //printf("Touching file %s\n", itr->c_str());
+          Instruction ti;
+          ti.type = TYPE_TOUCH;
+          ti.creates.push_back(make_pair(true, *itr));
+          ti.depends.push_back(make_pair(false, *itr)); // if this matters, something is hideously wrong
+          ti.touch_path = *itr;
+          ti.touch_meta = ite.metadata();
+          totcomsize += ti.size();
+          inst.push_back(ti);
+          got = true;
+        } else if(ite.size() > pite.size() && pite.size() > 0 && ite.isChecksummable() && identicalFile(ite, pite, pite.size())) {
+          // It's appended!
+          // The pite.size() check is so we don't claim a file going from 0 bytes to more is "appended"
+          // Technically that's valid, but it's a bit ugly and so I decided to make it not happen. :)
+          //printf("Appendination on %s, dude!\n", itr->c_str());
+          Instruction ti;
+          ti.type = TYPE_APPEND;
+          ti.creates.push_back(make_pair(true, *itr));
+          ti.depends.push_back(make_pair(false, *itr));
+          ti.removes.push_back(make_pair(false, *itr));
+          ti.append_path = *itr;
+          ti.append_size = ite.size();
+          ti.append_begin = pite.size();
+          ti.append_meta = ite.metadata();
+          ti.append_checksum = ite.checksum();
+          ti.append_source = &ite;
+          totcomsize += ti.size();
+          inst.push_back(ti);
+          got = true;
+        }
+      }
       
-      // If it's null, we pretend it exists and is identical to what we currently have, which involves going through this section.
-      if(realitems.count(*itr) || isNulled(*itr)) {
-        const Item &ite = realitems.find(*itr)->second;
-        bool got = false;
-        
-        // First, we check to see if it's the same file as existed before
-        if(!got && citem.count(make_pair(false, *itr))) {
-          const Item &pite = citem.find(make_pair(false, *itr))->second;
-          if(isNulled(*itr) || ite.size() == pite.size() && ite.metadata() == pite.metadata()) {
-            // It's identical!
-            //printf("Preserve file %s\n", itr->c_str());
+      // If either of these are true, we don't have adequate data - if it's null we're saving it from deletion,
+      // if it's merely unreadable we're simply ignoring it
+      if(!got) {
+        if(isNulled(*itr) || !ite.isReadable()) {
+          if(citem.count(make_pair(false, *itr))) {
             fi.creates.push_back(make_pair(true, *itr));
             got = true;
-          } else if(ite.size() == pite.size() && ite.isChecksummable() && identicalFile(ite, pite)) {
-            // It's touched!
-            CHECK(ite.metadata() != pite.metadata());
-            //printf("Touching file %s\n", itr->c_str());
+          } else {
+            continue;
+          }
+        }
+      }
+      
+      // Okay, now we see if it's been copied from somewhere
+      if(!got) {
+        CHECK(ite.isChecksummable());
+        const vector<pair<bool, string> > &sli = citemsizemap[ite.size()];
+        for(int k = 0; k < sli.size(); k++) {
+          CHECK(ite.size() == citem[sli[k]].size());
+          
+          // It's possible for a nulled or unreadable item to get pushed into the citem map. If so, we can't necessarily compare it.
+          // There may be a better way to do this.
+          if(citem[sli[k]].isChecksummable() && identicalFile(ite, citem[sli[k]])) {
+            //printf("Holy crapcock! Copying %s from %s:%d! MADNESS\n", itr->c_str(), sli[k].second.c_str(), sli[k].first);
             Instruction ti;
-            ti.type = TYPE_TOUCH;
+            ti.type = TYPE_COPY;
             ti.creates.push_back(make_pair(true, *itr));
-            ti.depends.push_back(make_pair(false, *itr)); // if this matters, something is hideously wrong
-            ti.touch_path = *itr;
-            ti.touch_meta = ite.metadata();
+            ti.depends.push_back(sli[k]);
+            if(citem.count(make_pair(false, *itr)))
+              ti.removes.push_back(make_pair(false, *itr));
+            ti.copy_source = sli[k].second;
+            ti.copy_dest = *itr;
+            ti.copy_dest_meta = ite.metadata();
             totcomsize += ti.size();
             inst.push_back(ti);
             got = true;
-          } else if(ite.size() > pite.size() && pite.size() > 0 && ite.isChecksummable() && identicalFile(ite, pite, pite.size())) {
-            // It's appended!
-            // The pite.size() check is so we don't claim a file going from 0 bytes to more is "appended"
-            // Technically that's valid, but it's a bit ugly and so I decided to make it not happen. :)
-            //printf("Appendination on %s, dude!\n", itr->c_str());
-            Instruction ti;
-            ti.type = TYPE_APPEND;
+            break;
+          }
+        }
+      }
+      
+      // Medium files that changed in place get diffed against the signature of the version we have
+      if(!got && citem.count(make_pair(false, *itr)) && wantsSignature(ite.size())) {
+        const Item &pite = citem.find(make_pair(false, *itr))->second;
+        const BlockSignature *sig = sigs.find(*itr);
+        if(sig && sig->describes(pite)) {
+          Instruction ti;
+          ti.type = TYPE_PATCH;
+          ti.patch_ops = diffItem(&ite, ite.size(), *sig, &ti.patch_literal);
+          // If most of it is new anyway, a store compresses better and restores without needing the old version
+          if(ti.patch_literal < ite.size() / 2) {
             ti.creates.push_back(make_pair(true, *itr));
             ti.depends.push_back(make_pair(false, *itr));
             ti.removes.push_back(make_pair(false, *itr));
-            ti.append_path = *itr;
-            ti.append_size = ite.size();
-            ti.append_begin = pite.size();
-            ti.append_meta = ite.metadata();
-            ti.append_checksum = ite.checksum();
-            ti.append_source = &ite;
+            ti.patch_path = *itr;
+            ti.patch_size = ite.size();
+            ti.patch_meta = ite.metadata();
+            ti.patch_source = &ite;
             totcomsize += ti.size();
             inst.push_back(ti);
             got = true;
           }
         }
-        
-        // If either of these are true, we don't have adequate data - if it's null we're saving it from deletion,
-        // if it's merely unreadable we're simply ignoring it
-        if(!got) {
-          if(isNulled(*itr) || !ite.isReadable()) {
-            if(citem.count(make_pair(false, *itr))) {
-              fi.creates.push_back(make_pair(true, *itr));
-              got = true;
-            } else {
-              continue;
-            }
-          }
-        }
-        
-        // Okay, now we see if it's been copied from somewhere
-        if(!got) {
-          CHECK(ite.isChecksummable());
-          const vector<pair<bool, string> > &sli = citemsizemap[ite.size()];
-          for(int k = 0; k < sli.size(); k++) {
-            CHECK(ite.size() == citem[sli[k]].size());
-            
-            // It's possible for a nulled or unreadable item to get pushed into the citem map. If so, we can't necessarily compare it.
-            // There may be a better way to do this.
-            if(citem[sli[k]].isChecksummable() && identicalFile(ite, citem[sli[k]])) {
-              //printf("Holy crapcock! Copying %s from %s:%d! MADNESS\n", itr->c_str(), sli[k].second.c_str(), sli[k].first);
-              Instruction ti;
-              ti.type = TYPE_COPY;
-              ti.creates.push_back(make_pair(true, *itr));
-              ti.depends.push_back(sli[k]);
-              if(citem.count(make_pair(false, *itr)))
-                ti.removes.push_back(make_pair(false, *itr));
-              ti.copy_source = sli[k].second;
-              ti.copy_dest = *itr;
-              ti.copy_dest_meta = ite.metadata();
-              totcomsize += ti.size();
-              inst.push_back(ti);
-              got = true;
-              break;
-            }
+      }
+      
+      // Big files get cut into chunks, and we only store the chunks we haven't seen
+      if(!got && ite.size() >= chunkthreshold) {
+        Instruction ti;
+        ti.type = TYPE_CHUNK;
+        ti.creates.push_back(make_pair(true, *itr));
+        if(citem.count(make_pair(false, *itr)))
+          ti.removes.push_back(make_pair(false, *itr));
+        ti.chunk_path = *itr;
+        ti.chunk_size = ite.size();
+        ti.chunk_meta = ite.metadata();
+        ti.chunk_source = &ite;
+        ti.chunk_list = chunkItem(&ite, ite.size());
+        ti.chunk_newbytes = 0;
+        for(int k = 0; k < ti.chunk_list.size(); k++) {
+          string hex = ti.chunk_list[k].hex();
+          if(!chunks.has(hex) && !plannedchunks.count(hex)) {
+            plannedchunks.insert(hex);
+            ti.chunk_newbytes += ti.chunk_list[k].len;
           }
         }
-        
-        // And now we give up and just store it
-        if(!got) {
-          CHECK(ite.isReadable());
-          //printf("Storing %s from GALACTIC ETHER\n", itr->c_str());
-          Instruction ti;
-          ti.type = TYPE_STORE;
-          ti.creates.push_back(make_pair(true, *itr));
-          if(citem.count(make_pair(false, *itr)))
-            ti.removes.push_back(make_pair(false, *itr));
-          ti.store_path = *itr;
-          ti.store_size = ite.size();
-          ti.store_meta = ite.metadata();
-          ti.store_source = &ite;
-          totcomsize += ti.size();
-          inst.push_back(ti);
-          got = true;
-        }
-         
-        CHECK(got);
-        
-        citem[make_pair(true, *itr)] = ite;
-        citemsizemap[ite.size()].push_back(make_pair(true, *itr));
-        
-      } else {
-        CHECK(citem.count(make_pair(false, *itr)));
-        //printf("Delete file %s\n", itr->c_str());
+        totcomsize += ti.size();
+        inst.push_back(ti);
+        got = true;
+      }
+      
+      // And now we give up and just store it
+      if(!got) {
+        CHECK(ite.isReadable());
+        //printf("Storing %s from GALACTIC ETHER\n", itr->c_str());
         Instruction ti;
-        ti.type = TYPE_DELETE;
-        ti.delete_path = *itr;
-        ti.removes.push_back(make_pair(false, *itr));
+        ti.type = TYPE_STORE;
+        ti.creates.push_back(make_pair(true, *itr));
+        if(citem.count(make_pair(false, *itr)))
+          ti.removes.push_back(make_pair(false, *itr));
+        ti.store_path = *itr;
+        ti.store_size = ite.size();
+        ti.store_meta = ite.metadata();
+        ti.store_source = &ite;
         totcomsize += ti.size();
         inst.push_back(ti);
+        got = true;
       }
+       
+      CHECK(got);
+      
+      citem[make_pair(true, *itr)] = ite;
+      citemsizemap[ite.size()].push_back(make_pair(true, *itr));
+      if(!isNulled(*itr) && ite.inode())
+        linked.insert(make_pair(make_pair(ite.device(), ite.inode()), *itr));
+      
+    } else {
+      CHECK(citem.count(make_pair(false, *itr)));
+      //printf("Delete file %s\n", itr->c_str());
+      Instruction ti;
+      ti.type = TYPE_DELETE;
+      ti.delete_path = *itr;
+      ti.removes.push_back(make_pair(false, *itr));
+      totcomsize += ti.size();
+      inst.push_back(ti);
     }
+  }
+  
+  inst.push_back(fi);
+  
+  endPhase(PHASE_PLAN);
+  printFilterStats();
+  if(hardlinks)
+    printf("%d hardlinks copied from another link to the same file\n", hardlinks);
+  
+  sortInst(inst);
+  
+  // The state gets brought up to date in place from here on
+  State &newstate = bs->state;
+  
+  printf("Genarch\n");
+  
+  if(inst.size() == 0) {
+    printf("No changes!\n");
+    findLeftover(realitems, newstate, leftover);
+    bs->items.swap(realitems);
+    bs->scanned = true;
+    printRunReport();
+    appendRunReport("states/reports", command, bs->stateid);
+    return true;
+  }
+  
+  {
+    long long archsize = 0;
+    for(int i = 0; i < inst.size(); i++) {
+      archsize += usedperitem;
+      if(inst[i].type == TYPE_APPEND) {
+        archsize += inst[i].append_size - newstate.findItem(inst[i].append_path)->size();
+      } else if(inst[i].type == TYPE_STORE) {
+        archsize += inst[i].store_size;
+      } else if(inst[i].type == TYPE_PATCH) {
+        archsize += inst[i].patch_literal;
+      } else if(inst[i].type == TYPE_CHUNK) {
+        archsize += inst[i].chunk_newbytes;
+      }
+    }
+    printf("Total of %lld bytes left! (%lldmb)\n", archsize, archsize >> 20);
+  }
+  
+  system("rm -rf temp");  // this is obviously dangerous, dur
+  system("mkdir temp");
+  
+  printf("Generating archive of at most %lld bytes\n", inf.second);
+  
+  bool spaceleft;
+  
+  if(inf.first == -1) {
+    // We need to copy our original state to the root, then create our first patch
+    origstate.writeOut("temp/manifest");
+    system("gzip temp/manifest");
+    string destpath = StringPrintf("temp/%08d", bs->stateid + 1);
+    system(StringPrintf("mkdir %s", destpath.c_str()).c_str());
     
-    inst.push_back(fi);
-    
-    sortInst(inst);
+    generateArchive(inst, &newstate, &chunks, &sigs, inf.second - filesize("temp/manifest.gz"), destpath, &spaceleft, bs->stateid + 1);
+  } else {
+    // We don't. (Duh.)
+    CHECK(inf.first == bs->stateid);
+    string destpath = StringPrintf("temp/%08d", bs->stateid + 1);
+    system(StringPrintf("mkdir %s", destpath.c_str()).c_str());
     
-    State newstate = origstate;
+    generateArchive(inst, &newstate, &chunks, &sigs, inf.second, destpath, &spaceleft, bs->stateid + 1);
+  }
+  
+  if(earlyterm)
+    CHECK(!spaceleft);
+  
+  printf("Done genarch\n");
+
+/*
+  {
+    const map<string, Item> &lhs = newstate.getItemDb();
+    const map<string, Item> &rhs = realitems;
+    CHECK(lhs.size() == rhs.size());
+    for(map<string, Item>::const_iterator lhsi = lhs.begin(), rhsi = rhs.begin(); lhsi != lhs.end(); lhsi++, rhsi++) {
+      printf("Comparing %s and %s\n", lhsi->first.c_str(), rhsi->first.c_str());
+      printf("%s\n", lhsi->second.toString().c_str());
+      printf("%s\n", rhsi->second.toString().c_str());
+      CHECK(lhsi->first == rhsi->first);
+      CHECK(lhsi->second == rhsi->second);
+    }
+  }
+*/
+  
+  /*
+  if(inf.first == -1) {
+    // We're not continuing a multisession CD
+    system("mkisofs -J -r -o image.iso temp");
+  } else {
+    // We are continuing a multisession CD
+    system("mkisofs -J -r -C `dvdrecord dev=1,0,0 -msinfo`-o image.iso temp");
+  }
+  
+  spaceleft = true;
+  if(spaceleft) {
+    // We're leaving multisession space open
+    system("dvdrecord dev=1,0,0 -v -eject speed=40 fs=16m -multi image.iso");
+  } else {
+    // We're closing the CD
+    system("dvdrecord dev=1,0,0 -v -eject speed=40 fs=16m image.iso");
+  }*/
+  
+  if(spaceleft) {
+    printf("Burn it now, and leave multisession open!\n");
+  } else {
+    printf("Burn it now, and close the CD!\n");
+  }
+  
+  
+  {
+    PhaseTimer pt(PHASE_STATEWRITE);
+    if(checkpoint)
+      writeCheckpoint(newstate, sigs, bs->stateid + 1);
+    else
+      newstate.writeDiff(nextstate + ".diff");
+    chunks.appendNew("states/chunks");
     
-    printf("Genarch\n");
+    FILE *curv = fopen("states/current", "w");
+    CHECK(curv);
+    fprintf(curv, "%d\n", bs->stateid + 1);
+    fclose(curv);
+  }
+  
+  // Whatever didn't fit on this disc has to be found again next time, so its directory can't be skipped
+  findLeftover(realitems, newstate, leftover);
+  
+  printRunReport();
+  appendRunReport("states/reports", command, bs->stateid + 1);
+  
+  bs->items.swap(realitems);
+  bs->stateid++;
+  bs->scanned = true;
+  return true;
+}
+
+// Backs up whatever changes, a few seconds after it changes, until it's told to stop. Each batch of changes becomes
+// a session of its own, copied to the drive as soon as it's written.
+int runContinuous(const string &command) {
+  printf("Reading config\n");
+  readConfig("purebackup.conf");
+  MountTree pristine = *getRoot();  // every scan starts from the tree as configured
+  
+  if(!startWatching())
+    return 1;
+  
+  BackupState bs;
+  findBackupState(&bs);
+  bs.driveused = getTotalSizeUsed(drivepath);  // from here on, nothing lands there but the sessions we copy
+  
+  Journal journal;
+  journal.complete = false;
+  journal.reason = "continuous mode just started";
+  
+  time_t lastcheckpoint = time(NULL);
+  bool uncheckpointed = false;
+  int rv = 0;
+  while(true) {
+    *getRoot() = pristine;
+    resetStats();
     
-    if(inst.size() == 0) {
-      printf("No changes!\n");
-      return 0;
+    int stateid = bs.stateid;
+    bool checkpoint = time(NULL) - lastcheckpoint >= continuouscheckpoint;
+    set<string> leftover;
+    if(!backupOnce(&bs, journal, checkpoint, command, &leftover)) {
+      rv = 1;
+      break;
     }
-    
-    {
-      long long archsize = 0;
-      for(int i = 0; i < inst.size(); i++) {
-        archsize += usedperitem;
-        if(inst[i].type == TYPE_APPEND) {
-          archsize += inst[i].append_size - newstate.findItem(inst[i].append_path)->size();
-        } else if(inst[i].type == TYPE_STORE) {
-          archsize += inst[i].store_size;
-        }
-      }
-      printf("Total of %lld bytes left! (%lldmb)\n", archsize, archsize >> 20);
+    time_t lastcycle = time(NULL);
+    if(bs.stateid != stateid) {
+      system(StringPrintf("cp -r temp/* %s/", drivepath.c_str()).c_str());
+      bs.driveused += getTotalSizeUsed("temp");
+      uncheckpointed = !checkpoint;
+      if(checkpoint)
+        lastcheckpoint = time(NULL);
     }
     
-    system("rm -rf temp");  // this is obviously dangerous, dur
-    system("mkdir temp");
-    
-    printf("Generating archive of at most %lld bytes\n", inf.second);
+    // Whatever didn't make it gets another look along with the next changes, but doesn't count as one
+    journal = Journal();
+    journal.dirty = leftover;
     
-    bool spaceleft;
-    
-    if(inf.first == -1) {
-      // We need to copy our original state to the root, then create our first patch
-      system(StringPrintf("cp %s %s", curstate.c_str(), "temp/manifest").c_str()); // note: this is buggy and probably a security hole
-      system("gzip temp/manifest");
-      string destpath = StringPrintf("temp/%08d", curstateid + 1);
-      system(StringPrintf("mkdir %s", destpath.c_str()).c_str());
-      
-      generateArchive(inst, &newstate, curstate, inf.second - filesize("temp/manifest.gz"), destpath, &spaceleft, curstateid + 1);
-    } else {
-      // We don't. (Duh.)
-      CHECK(inf.first == curstateid);
-      string destpath = StringPrintf("temp/%08d", curstateid + 1);
-      system(StringPrintf("mkdir %s", destpath.c_str()).c_str());
-      
-      generateArchive(inst, &newstate, curstate, inf.second, destpath, &spaceleft, curstateid + 1);
+    while(!waitForChanges(1000) && !stopRequested()) {
+      // Anything that was too new to back up last time might not be any more
+      if(excludeRecheck().size() && time(NULL) - lastcycle >= continuouscheckpoint)
+        break;
+      if(uncheckpointed && time(NULL) - lastcheckpoint >= continuouscheckpoint) {
+        writeCheckpoint(bs.state, bs.sigs, bs.stateid);
+        lastcheckpoint = time(NULL);
+        uncheckpointed = false;
+      }
     }
+    if(stopRequested())
+      break;
     
-    if(earlyterm)
-      CHECK(!spaceleft);
-    
-    printf("Done genarch\n");
+    if(waitForChanges(0)) {
+      printf("Changes! Backing up in %d seconds\n", continuouswindow);
+      time_t first = time(NULL);
+      while(time(NULL) - first < continuouswindow && !stopRequested())
+        waitForChanges(1000);
+      takeChanges(&journal);
+    }
+  }
   
-  /*
+  if(uncheckpointed)
+    writeCheckpoint(bs.state, bs.sigs, bs.stateid);
+  printf("Stopped - anything that changed since the last session is left for the next backup\n");
+  return rv;
+}
+
+int main(int argc, char **argv) {
+  
+  if(argc < 2) {
+    printf("purebackup backup, purebackup continuous, purebackup watch, or purebackup restore [path [session]] - and seriously, you really want to email zorba-purebackup@pavlovian.net if you want to do anything serious with this program.");
+    return 0;
+  }
+  
+  string command = argv[1];
+  if(command == "backup") {
+  
+    printf("Reading config\n");
     {
-      const map<string, Item> &lhs = newstate.getItemDb();
-      const map<string, Item> &rhs = realitems;
-      CHECK(lhs.size() == rhs.size());
-      for(map<string, Item>::const_iterator lhsi = lhs.begin(), rhsi = rhs.begin(); lhsi != lhs.end(); lhsi++, rhsi++) {
-        printf("Comparing %s and %s\n", lhsi->first.c_str(), rhsi->first.c_str());
-        printf("%s\n", lhsi->second.toString().c_str());
-        printf("%s\n", rhsi->second.toString().c_str());
-        CHECK(lhsi->first == rhsi->first);
-        CHECK(lhsi->second == rhsi->second);
-      }
+      PhaseTimer pt(PHASE_CONFIG);
+      readConfig("purebackup.conf");
     }
-  */
     
-    /*
-    if(inf.first == -1) {
-      // We're not continuing a multisession CD
-      system("mkisofs -J -r -o image.iso temp");
-    } else {
-      // We are continuing a multisession CD
-      system("mkisofs -J -r -C `dvdrecord dev=1,0,0 -msinfo`-o image.iso temp");
-    }
+    BackupState bs;
+    findBackupState(&bs);
     
-    spaceleft = true;
-    if(spaceleft) {
-      // We're leaving multisession space open
-      system("dvdrecord dev=1,0,0 -v -eject speed=40 fs=16m -multi image.iso");
-    } else {
-      // We're closing the CD
-      system("dvdrecord dev=1,0,0 -v -eject speed=40 fs=16m image.iso");
-    }*/
+    // If the watcher's been keeping track, only the directories it saw change need listing; everything else is
+    // just as the last state left it
+    Journal journal = takeJournal("purebackup.conf");
     
-    if(spaceleft) {
-      printf("Burn it now, and leave multisession open!\n");
-    } else {
-      printf("Burn it now, and close the CD!\n");
-    }
+    set<string> leftover;
+    if(!backupOnce(&bs, journal, true, command, &leftover))
+      return 0;
+    finishJournal(leftover);
     
+  } else if(command == "continuous") {
     
-    newstate.writeOut(nextstate);
+    return runContinuous(command);
     
-    FILE *curv = fopen("states/current", "w");
-    CHECK(curv);
-    fprintf(curv, "%d\n", curstateid + 1);
-    fclose(curv);
+  } else if(command == "watch") {
+    
+    readConfig("purebackup.conf");
+    return runWatcher("purebackup.conf");
     
   } else if(command == "restore") {
     
     string source = "/cygdrive/c/werk/sea/purebackup/temp";
     string dest = "/cygdrive/c/werk/sea/purebackup/restore";
     
+    if(argc >= 3) {
+      // Just the one file, straight out of the session indexes
+      restoreFile(source, argv[2], dest, argc >= 4 ? atoi(argv[3]) : -1);
+      return 0;
+    }
+    
     system(StringPrintf("rm -rf %s", dest.c_str()).c_str());
     
-    for(int i = 1; i <= 5; i++) {
-      printf("Restoring %d\n", i);
-      restore(StringPrintf("%s/%08d", source.c_str(), i), dest);
-    }
+    restore(source, dest);
     
   } else {
     printf("just \"purebackup\" for help\n");
@@ -0,0 +1,284 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "mask.h"
+#include "parse.h"
+#include "debug.h"
+
+#include <algorithm>
+
+MaskSet masks;
+
+MaskSet::MaskSet() {
+}
+
+int MaskSet::node(int type) {
+  Node n;
+  n.type = type;
+  n.out[0] = -1;
+  n.out[1] = -1;
+  nodes.push_back(n);
+  return nodes.size() - 1;
+}
+
+void MaskSet::patch(const Fragment &frag, int target) {
+  for(int i = 0; i < frag.dangling.size(); i++)
+    nodes[frag.dangling[i].first].out[frag.dangling[i].second] = target;
+}
+
+MaskSet::Fragment MaskSet::literal(const bitset<256> &chars) {
+  Fragment rv;
+  rv.start = node(MN_CHAR);
+  nodes[rv.start].chars = chars;
+  rv.dangling.push_back(make_pair(rv.start, 0));
+  return rv;
+}
+
+// Plain Thompson construction - an alternation is a split, concatenation patches one fragment's loose ends into the
+// next, and the repeats are splits that loop back
+MaskSet::Fragment MaskSet::parseAlt(const string &re, int *pos) {
+  Fragment rv = parseCat(re, pos);
+  while(*pos < re.size() && re[*pos] == '|') {
+    (*pos)++;
+    Fragment alt = parseCat(re, pos);
+    int split = node(MN_SPLIT);
+    nodes[split].out[0] = rv.start;
+    nodes[split].out[1] = alt.start;
+    rv.start = split;
+    rv.dangling.insert(rv.dangling.end(), alt.dangling.begin(), alt.dangling.end());
+  }
+  return rv;
+}
+
+MaskSet::Fragment MaskSet::parseCat(const string &re, int *pos) {
+  // An empty split stands in for matching nothing at all
+  Fragment rv;
+  rv.start = node(MN_SPLIT);
+  rv.dangling.push_back(make_pair(rv.start, 0));
+  while(*pos < re.size() && re[*pos] != '|' && re[*pos] != ')') {
+    Fragment next = parseRepeat(re, pos);
+    patch(rv, next.start);
+    rv.dangling = next.dangling;
+  }
+  return rv;
+}
+
+MaskSet::Fragment MaskSet::parseRepeat(const string &re, int *pos) {
+  Fragment rv = parseAtom(re, pos);
+  while(*pos < re.size() && (re[*pos] == '*' || re[*pos] == '+' || re[*pos] == '?')) {
+    char op = re[(*pos)++];
+    int split = node(MN_SPLIT);
+    nodes[split].out[0] = rv.start;
+    if(op == '*') {
+      patch(rv, split);
+      rv.start = split;
+      rv.dangling.clear();
+    } else if(op == '+') {
+      patch(rv, split);
+      rv.dangling.clear();
+    } else {
+      rv.start = split;
+    }
+    rv.dangling.push_back(make_pair(split, 1));
+  }
+  return rv;
+}
+
+MaskSet::Fragment MaskSet::parseAtom(const string &re, int *pos) {
+  CHECK(*pos < re.size());
+  char c = re[(*pos)++];
+  if(c == '(') {
+    Fragment rv = parseAlt(re, pos);
+    CHECK(*pos < re.size() && re[*pos] == ')');
+    (*pos)++;
+    return rv;
+  }
+  bitset<256> chars;
+  if(c == '.') {
+    chars.set();
+  } else if(c == '[') {
+    chars = parseClass(re, pos);
+  } else if(c == '\\') {
+    CHECK(*pos < re.size());
+    chars.set((unsigned char)re[(*pos)++]);
+  } else {
+    CHECK(c != '*' && c != '+' && c != '?');
+    chars.set((unsigned char)c);
+  }
+  return literal(chars);
+}
+
+// Just after the [, through the ]
+bitset<256> MaskSet::parseClass(const string &re, int *pos) {
+  bitset<256> chars;
+  bool invert = false;
+  if(*pos < re.size() && re[*pos] == '^') {
+    invert = true;
+    (*pos)++;
+  }
+  bool first = true;
+  while(true) {
+    CHECK(*pos < re.size());
+    unsigned char c = re[(*pos)++];
+    if(c == ']' && !first)
+      break;
+    first = false;
+    if(c == '\\') {
+      CHECK(*pos < re.size());
+      c = re[(*pos)++];
+    }
+    unsigned char last = c;
+    if(*pos + 1 < re.size() && re[*pos] == '-' && re[*pos + 1] != ']') {
+      last = re[*pos + 1];
+      *pos += 2;
+      CHECK(last >= c);
+    }
+    for(int i = c; i <= last; i++)
+      chars.set(i);
+  }
+  if(invert)
+    chars.flip();
+  return chars;
+}
+
+void MaskSet::addRegex(const string &pattern) {
+  // It's always the whole path, so the anchors don't add anything
+  string re = pattern;
+  if(re.size() && re[0] == '^')
+    re.erase(0, 1);
+  if(re.size() && re[re.size() - 1] == '$' && (re.size() < 2 || re[re.size() - 2] != '\\'))
+    re.erase(re.size() - 1);
+  
+  int pos = 0;
+  Fragment frag = parseAlt(re, &pos);
+  if(pos != re.size()) {
+    printf("Couldn't make sense of mask regex %s\n", pattern.c_str());
+    CHECK(0);
+  }
+  patch(frag, node(MN_MATCH));
+  starts.push_back(frag.start);
+  
+  dfa.clear();
+  dfa_ids.clear();
+}
+
+void MaskSet::addGlob(const string &pattern) {
+  string re;
+  if(!pattern.size() || pattern[0] != '/')
+    re = "(.*/)?";  // anywhere
+  for(int i = 0; i < pattern.size(); i++) {
+    char c = pattern[i];
+    if(c == '*' && i + 1 < pattern.size() && pattern[i + 1] == '*') {
+      i++;
+      if(i + 1 < pattern.size() && pattern[i + 1] == '/') {
+        i++;
+        re += "(.*/)?";
+      } else {
+        re += ".*";
+      }
+    } else if(c == '*') {
+      re += "[^/]*";
+    } else if(c == '?') {
+      re += "[^/]";
+    } else if(c == '[') {
+      string::size_type end = pattern.find(']', i + 2);
+      CHECK(end != string::npos);
+      string cls = pattern.substr(i + 1, end - i - 1);
+      if(cls[0] == '!')
+        cls[0] = '^';
+      re += "[" + cls + "]";
+      i = end;
+    } else {
+      re += '\\';
+      re += c;
+    }
+  }
+  addRegex(re);
+}
+
+int MaskSet::dfaState(vector<int> nfaset) {
+  // Follow the splits, so a state is only the nodes that consume a character or match
+  vector<int> stack = nfaset;
+  vector<bool> seen(nodes.size());
+  nfaset.clear();
+  while(stack.size()) {
+    int n = stack.back();
+    stack.pop_back();
+    if(n == -1 || seen[n])
+      continue;
+    seen[n] = true;
+    if(nodes[n].type == MN_SPLIT) {
+      stack.push_back(nodes[n].out[0]);
+      stack.push_back(nodes[n].out[1]);
+    } else {
+      nfaset.push_back(n);
+    }
+  }
+  sort(nfaset.begin(), nfaset.end());
+  
+  map<vector<int>, int>::const_iterator itr = dfa_ids.find(nfaset);
+  if(itr != dfa_ids.end())
+    return itr->second;
+  
+  DfaState ds;
+  ds.nfa = nfaset;
+  ds.match = false;
+  for(int i = 0; i < nfaset.size(); i++)
+    if(nodes[nfaset[i]].type == MN_MATCH)
+      ds.match = true;
+  for(int i = 0; i < 256; i++)
+    ds.next[i] = -1;
+  dfa.push_back(ds);
+  dfa_ids[nfaset] = dfa.size() - 1;
+  return dfa.size() - 1;
+}
+
+int MaskSet::start() {
+  if(!dfa.size())
+    dfaState(starts);  // always ends up as state 0
+  return 0;
+}
+
+int MaskSet::step(int state, const string &text) {
+  for(int i = 0; i < text.size() && !dead(state); i++) {
+    unsigned char c = text[i];
+    if(dfa[state].next[c] == -1) {
+      vector<int> moved;
+      for(int j = 0; j < dfa[state].nfa.size(); j++) {
+        const Node &n = nodes[dfa[state].nfa[j]];
+        if(n.type == MN_CHAR && n.chars[c])
+          moved.push_back(n.out[0]);
+      }
+      int next = dfaState(moved);  // may move dfa about
+      dfa[state].next[c] = next;
+    }
+    state = dfa[state].next[c];
+  }
+  return state;
+}
+
+bool MaskSet::covers(const string &path) {
+  int state = start();
+  vector<string> parts = tokenize(path, "/");
+  for(int i = 0; i < parts.size() && !dead(state); i++) {
+    state = step(state, "/" + parts[i]);
+    if(matches(state))
+      return true;
+  }
+  return false;
+}
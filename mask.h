@@ -0,0 +1,93 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_MASK
+#define PUREBACKUP_MASK
+
+#include <string>
+#include <vector>
+#include <map>
+#include <bitset>
+
+using namespace std;
+
+// Every wildcard and regex mask in the config, compiled into one automaton so that checking a path costs the same
+// however many patterns there are. The scan feeds it a path one "/name" at a time, carrying the state down the tree,
+// and drops anything at which it matches, along with everything beneath.
+//
+// Patterns are matched against the whole path in the tree, like "/glados/WINDOWS/SoftwareDistribution". A wildcard
+// pattern that doesn't start with "/" can match at any depth. "*" and "?" don't cross a "/", "**" does, and
+// [...] is a character class, with [!...] for the opposite. Regexes have . [] * + ? | and (), with \ for a literal.
+// Neither can contain = or #, since the config file would eat them.
+//
+// The DFA gets built as paths need it, so the scan has to stay on one thread.
+class MaskSet {
+public:
+  void addGlob(const string &pattern);
+  void addRegex(const string &pattern);
+
+  int start();
+  int step(int state, const string &text);
+  bool matches(int state) const { return dfa[state].match; }
+  bool dead(int state) const { return dfa[state].nfa.empty(); }  // nothing from here on can match
+
+  // Whether the path, or anything it's in, is masked
+  bool covers(const string &path);
+
+  int patterns() const { return starts.size(); }
+
+  MaskSet();
+
+private:
+  enum { MN_CHAR, MN_SPLIT, MN_MATCH };
+  struct Node {
+    int type;
+    bitset<256> chars;
+    int out[2];
+  };
+  struct Fragment {
+    int start;
+    vector<pair<int, int> > dangling;  // node, which out
+  };
+  struct DfaState {
+    vector<int> nfa;
+    bool match;
+    int next[256];
+  };
+
+  int node(int type);
+  void patch(const Fragment &frag, int target);
+  Fragment literal(const bitset<256> &chars);
+  Fragment parseAlt(const string &re, int *pos);
+  Fragment parseCat(const string &re, int *pos);
+  Fragment parseRepeat(const string &re, int *pos);
+  Fragment parseAtom(const string &re, int *pos);
+  bitset<256> parseClass(const string &re, int *pos);
+
+  int dfaState(vector<int> nfaset);
+
+  vector<Node> nodes;
+  vector<int> starts;
+
+  vector<DfaState> dfa;
+  map<vector<int>, int> dfa_ids;
+};
+
+extern MaskSet masks;
+
+#endif
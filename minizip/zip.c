@@ -963,6 +963,18 @@ local int zipFlushWriteBuffer(zi)
     return err;
 }
 
+extern uLong ZEXPORT zipGetLocalHeaderOffset (file)
+    zipFile file;
+{
+    zip_internal* zi;
+    if (file == NULL)
+        return 0;
+    zi = (zip_internal*)file;
+    if (zi->in_opened_file_inzip == 0)
+        return 0;
+    return zi->ci.pos_local_header;
+}
+
 extern int ZEXPORT zipWriteInFileInZip (file, buf, len)
     zipFile file;
     const void* buf;
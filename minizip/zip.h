@@ -213,6 +213,12 @@ extern int ZEXPORT zipCloseFileInZip OF((zipFile file));
   Close the current file in the zipfile
 */
 
+extern uLong ZEXPORT zipGetLocalHeaderOffset OF((zipFile file));
+/*
+  Return the offset of the local header of the file currently open in the zipfile,
+  so the caller can seek straight to it later without reading the central directory
+*/
+
 extern int ZEXPORT zipCloseFileInZipRaw OF((zipFile file,
                                             uLong uncompressed_size,
                                             uLong crc32));
@@ -0,0 +1,393 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "patch.h"
+
+#include "parse.h"
+#include "stats.h"
+#include "debug.h"
+
+#include <fstream>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+using namespace std;
+
+
+int signatureBlockSize(long long size) {
+  // rsync's rule of thumb - about sqrt(size) blocks of about sqrt(size) bytes - clamped so tiny blocks don't bloat
+  // the signature and huge ones don't turn a one-byte edit into a big literal
+  int bs = ((int)sqrt((double)size) + 63) & ~63;
+  return max(1024, min(16384, bs));
+}
+
+static unsigned int weakSum(const unsigned char *data, int len) {
+  unsigned int a = 0;
+  unsigned int b = 0;
+  for(int i = 0; i < len; i++) {
+    a += data[i];
+    b += (len - i) * data[i];
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+static unsigned long long strongSum(const unsigned char *data, int len) {
+  unsigned char hash[20];
+  SHA1(data, len, hash);
+  unsigned long long rv;
+  memcpy(&rv, hash, sizeof(rv));
+  return rv;
+}
+
+bool BlockSignature::describes(const Item &item) const {
+  return size == item.size() && !memcmp(checksum, item.checksum().bytes, sizeof(checksum));
+}
+
+kvData BlockSignature::toKvd(const string &name) const {
+  kvData kvd;
+  kvd.category = "signature";
+  kvd.kv["name"] = name;
+  kvd.kv["size"] = StringPrintf("%lld", size);
+  kvd.kv["checksum"] = outputHex(checksum, sizeof(checksum));
+  kvd.kv["blocksize"] = StringPrintf("%d", blocksize);
+  string blocks;
+  for(int i = 0; i < weak.size(); i++) {
+    if(i)
+      blocks += " ";
+    blocks += StringPrintf("%08x%016llx", weak[i], strong[i]);
+  }
+  kvd.kv["blocks"] = blocks;
+  return kvd;
+}
+
+BlockSignature BlockSignature::FromKvd(kvData kvd, string *name) {
+  CHECK(kvd.category == "signature");
+  BlockSignature sig;
+  *name = kvd.consume("name");
+  sig.size = atoll(kvd.consume("size").c_str());
+  readHex(sig.checksum, sizeof(sig.checksum), kvd.consume("checksum"));
+  sig.blocksize = atoi(kvd.consume("blocksize").c_str());
+  vector<string> blocks = tokenize(kvd.consume("blocks"), " ");
+  for(int i = 0; i < blocks.size(); i++) {
+    CHECK(blocks[i].size() == 24);
+    unsigned int w;
+    unsigned long long s;
+    CHECK(sscanf(blocks[i].c_str(), "%8x%16llx", &w, &s) == 2);
+    sig.weak.push_back(w);
+    sig.strong.push_back(s);
+  }
+  CHECK(sig.weak.size() == (sig.size + sig.blocksize - 1) / sig.blocksize);
+  kvd.shouldBeDone();
+  return sig;
+}
+
+SignatureBuilder::SignatureBuilder(long long size) {
+  sig.size = size;
+  sig.blocksize = signatureBlockSize(size);
+  fed = 0;
+}
+
+void SignatureBuilder::feed(const char *data, int len) {
+  fed += len;
+  while(len) {
+    int take = min(len, sig.blocksize - (int)block.size());
+    block.insert(block.end(), data, data + take);
+    data += take;
+    len -= take;
+    if(block.size() == sig.blocksize) {
+      sig.weak.push_back(weakSum((const unsigned char *)&block[0], block.size()));
+      sig.strong.push_back(strongSum((const unsigned char *)&block[0], block.size()));
+      block.clear();
+    }
+  }
+}
+
+BlockSignature SignatureBuilder::finish(const Checksum &cs) {
+  CHECK(fed == sig.size);
+  if(block.size()) {
+    sig.weak.push_back(weakSum((const unsigned char *)&block[0], block.size()));
+    sig.strong.push_back(strongSum((const unsigned char *)&block[0], block.size()));
+    block.clear();
+  }
+  memcpy(sig.checksum, cs.bytes, sizeof(sig.checksum));
+  return sig;
+}
+
+void SignatureStore::readFile(const string &fil) {
+  ifstream ifs(fil.c_str());
+  kvData kvd;
+  while(getkvDataInline(ifs, kvd)) {
+    string name;
+    BlockSignature sig = BlockSignature::FromKvd(kvd, &name);
+    sigs[name] = sig;
+  }
+}
+
+void SignatureStore::writeOut(const string &fil) const {
+  ofstream ofs(fil.c_str());
+  CHECK(ofs);
+  for(map<string, BlockSignature>::const_iterator itr = sigs.begin(); itr != sigs.end(); itr++)
+    putkvDataInline(ofs, itr->second.toKvd(itr->first), "name");
+}
+
+const BlockSignature *SignatureStore::find(const string &name) const {
+  map<string, BlockSignature>::const_iterator itr = sigs.find(name);
+  if(itr == sigs.end())
+    return NULL;
+  return &itr->second;
+}
+
+void SignatureStore::put(const string &name, const BlockSignature &sig) {
+  sigs[name] = sig;
+}
+
+void SignatureStore::copy(const string &source, const string &dest) {
+  if(sigs.count(source))
+    sigs[dest] = sigs[source];
+  else
+    erase(dest);
+}
+
+void SignatureStore::rotate(const vector<string> &paths) {
+  vector<pair<bool, BlockSignature> > srcs;
+  for(int i = 0; i < paths.size(); i++) {
+    srcs.push_back(make_pair(sigs.count(paths[i]) != 0, BlockSignature()));
+    if(srcs.back().first)
+      srcs.back().second = sigs[paths[i]];
+  }
+  for(int i = 0; i < paths.size(); i++) {
+    const string &dest = paths[(i + 1) % paths.size()];
+    if(srcs[i].first)
+      sigs[dest] = srcs[i].second;
+    else
+      erase(dest);
+  }
+}
+
+void SignatureStore::moveTree(const string &source, const string &dest) {
+  string from = source + "/";
+  vector<pair<string, BlockSignature> > moving;
+  for(map<string, BlockSignature>::iterator itr = sigs.lower_bound(from); itr != sigs.end() && !itr->first.compare(0, from.size(), from); ) {
+    moving.push_back(make_pair(dest + itr->first.substr(source.size()), itr->second));
+    sigs.erase(itr++);
+  }
+  for(int i = 0; i < moving.size(); i++)
+    sigs[moving[i].first] = moving[i].second;
+}
+
+void SignatureStore::erase(const string &name) {
+  sigs.erase(name);
+}
+
+static void addLiteral(vector<DeltaOp> *ops, long long offset, long long len, long long *literal) {
+  if(!len)
+    return;
+  *literal += len;
+  if(ops->size() && !ops->back().copy && ops->back().offset + ops->back().len == offset) {
+    ops->back().len += len;
+    return;
+  }
+  DeltaOp op;
+  op.copy = false;
+  op.offset = offset;
+  op.len = len;
+  ops->push_back(op);
+}
+
+static void addCopy(vector<DeltaOp> *ops, long long offset, long long len) {
+  if(ops->size() && ops->back().copy && ops->back().offset + ops->back().len == offset) {
+    ops->back().len += len;
+    return;
+  }
+  DeltaOp op;
+  op.copy = true;
+  op.offset = offset;
+  op.len = len;
+  ops->push_back(op);
+}
+
+vector<DeltaOp> diffBuffer(const unsigned char *data, long long len, const BlockSignature &sig, long long *literal) {
+  vector<DeltaOp> ops;
+  *literal = 0;
+  
+  const int bs = sig.blocksize;
+  const int blocks = sig.weak.size();
+  const long long lastlen = blocks ? sig.size - (long long)(blocks - 1) * bs : 0;
+  
+  // Open hash of the full-size blocks by weak sum, chained through next
+  int tsize = 1;
+  while(tsize < blocks * 2)
+    tsize <<= 1;
+  vector<int> table(tsize, -1);
+  vector<int> next(blocks, -1);
+  for(int i = blocks - 1; i >= 0; i--) {
+    if(i == blocks - 1 && lastlen != bs)
+      continue;
+    int slot = sig.weak[i] & (tsize - 1);
+    next[i] = table[slot];
+    table[slot] = i;
+  }
+  
+  long long pos = 0;
+  long long litstart = 0;
+  unsigned int a = 0;
+  unsigned int b = 0;
+  bool valid = false;
+  while(blocks && pos + bs <= len) {
+    if(!valid) {
+      a = 0;
+      b = 0;
+      for(int i = 0; i < bs; i++) {
+        a += data[pos + i];
+        b += (bs - i) * data[pos + i];
+      }
+      valid = true;
+    }
+    
+    unsigned int weak = (a & 0xffff) | (b << 16);
+    int match = -1;
+    bool gotstrong = false;
+    unsigned long long strong = 0;
+    for(int k = table[weak & (tsize - 1)]; k != -1; k = next[k]) {
+      if(sig.weak[k] != weak)
+        continue;
+      if(!gotstrong) {
+        strong = strongSum(data + pos, bs);
+        gotstrong = true;
+      }
+      if(sig.strong[k] == strong) {
+        match = k;
+        break;
+      }
+    }
+    
+    if(match != -1) {
+      addLiteral(&ops, litstart, pos - litstart, literal);
+      addCopy(&ops, (long long)match * bs, bs);
+      pos += bs;
+      litstart = pos;
+      valid = false;
+      continue;
+    }
+    
+    if(pos + bs < len) {
+      a += data[pos + bs] - data[pos];
+      b += a - bs * data[pos];
+    }
+    pos++;
+  }
+  
+  // The old file's short last block can only ever match the new file's tail
+  if(blocks && lastlen != bs && len - litstart >= lastlen) {
+    const unsigned char *tail = data + len - lastlen;
+    if(weakSum(tail, lastlen) == sig.weak[blocks - 1] && strongSum(tail, lastlen) == sig.strong[blocks - 1]) {
+      addLiteral(&ops, litstart, len - lastlen - litstart, literal);
+      addCopy(&ops, (long long)(blocks - 1) * bs, lastlen);
+      litstart = len;
+    }
+  }
+  addLiteral(&ops, litstart, len - litstart, literal);
+  
+  return ops;
+}
+
+vector<DeltaOp> diffItem(const Item *item, long long len, const BlockSignature &sig, long long *literal) {
+  vector<unsigned char> buf(len);
+  ItemShunt *fil = item->open();
+  CHECK(fil);
+  long long done = 0;
+  while(done < len) {
+    int rv = fil->read((char*)&buf[done], (int)min(len - done, 1LL << 20));
+    if(rv <= 0) {
+      printf("Trying to diff %lld bytes, only picked up %lld!\n", len, done);
+      CHECK(0);
+    }
+    done += rv;
+  }
+  delete fil;
+  
+  Checksum tcs = item->signaturePart(len);
+  Digest whole(checksumconfig.algorithm);
+  whole.update(&buf[0], len);
+  whole.final(&tcs);
+  item->cacheChecksum(len, tcs);
+  countStat(STAT_BYTESHASHED, len);
+  
+  return diffBuffer(&buf[0], len, sig, literal);
+}
+
+static void putLE(string *out, unsigned long long val, int bytes) {
+  for(int i = 0; i < bytes; i++)
+    *out += (char)((val >> (i * 8)) & 0xff);
+}
+
+string deltaOpHeader(const DeltaOp &op) {
+  string rv;
+  CHECK(op.len > 0 && op.len < (1LL << 32));
+  if(op.copy) {
+    rv += 'C';
+    putLE(&rv, op.offset, 8);
+  } else {
+    rv += 'L';
+  }
+  putLE(&rv, op.len, 4);
+  return rv;
+}
+
+string deltaEnd() {
+  return "E";
+}
+
+static unsigned long long getLE(FILE *fil, int bytes) {
+  unsigned char buf[8];
+  CHECK(fread(buf, 1, bytes, fil) == bytes);
+  unsigned long long rv = 0;
+  for(int i = 0; i < bytes; i++)
+    rv |= (unsigned long long)buf[i] << (i * 8);
+  return rv;
+}
+
+static void copyBytes(FILE *src, FILE *dst, long long len) {
+  while(len) {
+    char buf[65536];
+    int rv = fread(buf, 1, (int)min((long long)sizeof(buf), len), src);
+    CHECK(rv > 0);
+    CHECK(fwrite(buf, 1, rv, dst) == rv);
+    len -= rv;
+  }
+}
+
+void applyDelta(FILE *delta, FILE *old, FILE *out) {
+  while(1) {
+    int op = fgetc(delta);
+    CHECK(op != EOF);
+    if(op == 'E') {
+      return;
+    } else if(op == 'C') {
+      long long offset = getLE(delta, 8);
+      long long len = getLE(delta, 4);
+      CHECK(!fseeko(old, offset, SEEK_SET));
+      copyBytes(old, out, len);
+    } else {
+      CHECK(op == 'L');
+      copyBytes(delta, out, getLE(delta, 4));
+    }
+  }
+}
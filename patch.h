@@ -0,0 +1,106 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_PATCH
+#define PUREBACKUP_PATCH
+
+#include "item.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+// Files in this range that changed in place get a delta against their previous version instead of a full store.
+// Smaller ones aren't worth the signature, and bigger ones get chunked.
+const long long patchminsize = 64 << 10;
+
+// rsync-style block signature of one version of a file: a rolling checksum and a truncated SHA-1 per block.
+// Kept from the run that stored the file, so the old version never has to be readable.
+class BlockSignature {
+public:
+  long long size;
+  unsigned char checksum[20]; // the SHA-1 of the version this describes
+  int blocksize;
+  vector<unsigned int> weak;
+  vector<unsigned long long> strong;  // the last block may be short
+
+  bool describes(const Item &item) const;
+
+  kvData toKvd(const string &name) const;
+  static BlockSignature FromKvd(kvData kvd, string *name);
+};
+
+int signatureBlockSize(long long size);
+
+// Builds a signature from data as it streams past
+class SignatureBuilder {
+public:
+  void feed(const char *data, int len);
+  BlockSignature finish(const Checksum &cs);
+
+  SignatureBuilder(long long size);
+
+private:
+  BlockSignature sig;
+  vector<char> block;
+  long long fed;
+};
+
+// Signatures for every file that has one, as of the end of a session
+class SignatureStore {
+public:
+  void readFile(const string &fil);
+  void writeOut(const string &fil) const;
+
+  const BlockSignature *find(const string &name) const;
+  void put(const string &name, const BlockSignature &sig);
+  void copy(const string &source, const string &dest);
+  void rotate(const vector<string> &paths);  // contents of [i] end up at [i + 1]
+  void moveTree(const string &source, const string &dest);  // everything under the source directory goes under dest
+  void erase(const string &name);
+
+private:
+  map<string, BlockSignature> sigs;
+};
+
+// Either a run of the old file, or a run of the new file that has to be stored literally. Ops are in new-file order.
+class DeltaOp {
+public:
+  bool copy;
+  long long offset; // in the old file if copy, in the new file otherwise
+  long long len;
+};
+
+// Works out how to build data out of the old file sig describes. *literal gets the number of bytes we couldn't find.
+vector<DeltaOp> diffBuffer(const unsigned char *data, long long len, const BlockSignature &sig, long long *literal);
+
+// Reads the first len bytes of the item once, diffing them against sig and filling in the item's checksum
+vector<DeltaOp> diffItem(const Item *item, long long len, const BlockSignature &sig, long long *literal);
+
+// The stored delta is a sequence of records: 'C', 8-byte offset, 4-byte length for a copy, 'L', 4-byte length and
+// the bytes themselves for a literal, and 'E' at the end. All numbers are little-endian.
+string deltaOpHeader(const DeltaOp &op);
+string deltaEnd();
+
+// Builds the new file into out from old and the delta
+void applyDelta(FILE *delta, FILE *old, FILE *out);
+
+#endif
@@ -0,0 +1,323 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "plan.h"
+
+#include "stats.h"
+#include "debug.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+static const int movesamples = 16;
+
+static int pathDepth(const string &path) {
+  return count(path.begin(), path.end(), '/');
+}
+
+// Parents before children, so a move is found at the top of whatever got renamed
+struct ShallowFirst {
+  bool operator()(const string &lhs, const string &rhs) const {
+    int ld = pathDepth(lhs);
+    int rd = pathDepth(rhs);
+    if(ld != rd)
+      return ld < rd;
+    return lhs < rhs;
+  }
+};
+
+vector<Instruction> findMoves(const map<string, Item> &origitems, const map<string, Item> &realitems, const set<string> &gone, const set<string> &fresh) {
+  // A moved file keeps its size and timestamp, so that's what we look for it by
+  map<pair<long long, long long>, vector<string> > freshkeys;
+  for(set<string>::const_iterator itr = fresh.begin(); itr != fresh.end(); itr++) {
+    const Item &ite = realitems.find(*itr)->second;
+    freshkeys[make_pair(ite.size(), ite.metadata().timestamp)].push_back(*itr);
+  }
+  
+  set<string, ShallowFirst> dirs;
+  for(set<string>::const_iterator itr = gone.begin(); itr != gone.end(); itr++)
+    for(string dir = itr->substr(0, itr->rfind('/')); dir.size(); dir.erase(dir.rfind('/')))
+      if(!dirs.insert(dir).second)
+        break;
+  
+  vector<Instruction> rv;
+  set<string> moveddirs;
+  set<string> taken;  // new paths an earlier move already accounts for
+  for(set<string, ShallowFirst>::const_iterator itr = dirs.begin(); itr != dirs.end(); itr++) {
+    const string &dir = *itr;
+    bool inside = false;
+    for(string parent = dir; parent.size() && !inside; parent.erase(parent.rfind('/')))
+      inside = moveddirs.count(parent);
+    if(inside)
+      continue;
+    
+    // Nothing can be left in it, and everything that used to be in it has to have gone
+    string from = dir + "/";
+    map<string, Item>::const_iterator ritr = realitems.lower_bound(from);
+    if(ritr != realitems.end() && !ritr->first.compare(0, from.size(), from))
+      continue;
+    vector<map<string, Item>::const_iterator> children;
+    bool whole = true;
+    for(map<string, Item>::const_iterator oitr = origitems.lower_bound(from); whole && oitr != origitems.end() && !oitr->first.compare(0, from.size(), from); oitr++) {
+      whole = gone.count(oitr->first);
+      children.push_back(oitr);
+    }
+    if(!whole || !children.size())
+      continue;
+    
+    // The first file says where it might have gone, and then every other one has to agree
+    string first = children[0]->first.substr(dir.size());
+    map<pair<long long, long long>, vector<string> >::const_iterator cands = freshkeys.find(make_pair(children[0]->second.size(), children[0]->second.metadata().timestamp));
+    if(cands == freshkeys.end())
+      continue;
+    string dest;
+    for(int i = 0; i < cands->second.size() && !dest.size(); i++) {
+      const string &cand = cands->second[i];
+      if(cand.size() <= first.size() || cand.compare(cand.size() - first.size(), first.size(), first))
+        continue;
+      string to = cand.substr(0, cand.size() - first.size());
+      bool match = to.size() > 0;
+      for(int j = 0; match && j < children.size(); j++) {
+        string path = to + children[j]->first.substr(dir.size());
+        map<string, Item>::const_iterator nitr = realitems.find(path);
+        match = fresh.count(path) && !taken.count(path) && nitr->second.size() == children[j]->second.size() && nitr->second.metadata() == children[j]->second.metadata();
+      }
+      // Sizes and timestamps can line up by accident, so some of them get looked at, spread out over the lot
+      for(int j = 0; match && j < movesamples && j < children.size(); j++) {
+        int k = (children.size() <= movesamples) ? j : (int)((long long)(children.size() - 1) * j / (movesamples - 1));
+        const Item &nite = realitems.find(to + children[k]->first.substr(dir.size()))->second;
+        match = nite.isReadable() && children[k]->second.isChecksummable() && similarFile(nite, children[k]->second);
+      }
+      if(match)
+        dest = to;
+    }
+    if(!dest.size())
+      continue;
+    
+    Instruction ti;
+    ti.type = TYPE_MOVE;
+    ti.move_source = dir;
+    ti.move_dest = dest;
+    for(int j = 0; j < children.size(); j++) {
+      string path = dest + children[j]->first.substr(dir.size());
+      ti.depends.push_back(make_pair(false, children[j]->first));
+      ti.removes.push_back(make_pair(false, children[j]->first));
+      ti.creates.push_back(make_pair(true, path));
+      taken.insert(path);
+    }
+    rv.push_back(ti);
+    moveddirs.insert(dir);
+  }
+  return rv;
+}
+
+void loopprocess(int pos, vector<int> *loop, const vector<Instruction> &inst,
+    const map<pair<bool, string>, vector<int> > &depon, 
+    const map<pair<bool, string>, int> &creates,
+    const set<pair<bool, string> > &removed,
+    vector<bool> *noprob) {
+      
+  //printf("Entering loopprocess %d\n", pos);
+  //printf("%s\n", inst[pos].textout().c_str());
+      
+  if((*noprob)[pos])
+    return;
+  
+  if(loop->size() && loop->back() == pos)
+    return;
+  
+  //printf("Pushback %d\n", pos);
+  
+  loop->push_back(pos);
+  
+  if(set<int>(loop->begin(), loop->end()).size() != loop->size()) {
+    //printf("LOOP!\n");
+    //for(int i = 0; i < loop->size(); i++)
+      //printf("%d\n", (*loop)[i]);
+    return;
+  }
+  
+  //printf("Starting depends %d\n", pos);
+  vector<int> bku = *loop;
+  // Anything this depends on must exist
+  for(int i = 0; i < inst[pos].depends.size(); i++) {
+    CHECK(creates.count(inst[pos].depends[i]));
+    loopprocess(creates.find(inst[pos].depends[i])->second, loop, inst, depon, creates, removed, noprob);
+    if(*loop != bku)
+      return;
+  }
+  
+  //printf("Starting removes %d\n", pos);
+  // Anything this removes must have its dependencies complete
+  for(int i = 0; i < inst[pos].removes.size(); i++) {
+    if(!depon.count(inst[pos].removes[i]))
+      continue;
+    const vector<int> &dpa = depon.find(inst[pos].removes[i])->second;
+    for(int j = 0; j < dpa.size(); j++) {
+      loopprocess(dpa[j], loop, inst, depon, creates, removed, noprob);
+      if(*loop != bku)
+        return;
+    }
+  }
+  //printf("Done %d\n", pos);
+  
+  loop->pop_back();
+
+  (*noprob)[pos] = true;
+}
+
+vector<Instruction> deloop(const vector<Instruction> &inst) {
+  map<pair<bool, string>, vector<int> > depon;
+  map<pair<bool, string>, int> creates;
+  set<pair<bool, string> > removed;
+  vector<bool> noprob(inst.size());
+  for(int i = 0; i < inst.size(); i++) {
+    for(int j = 0; j < inst[i].depends.size(); j++)
+      depon[inst[i].depends[j]].push_back(i);
+    for(int j = 0; j < inst[i].creates.size(); j++) {
+      CHECK(!creates.count(inst[i].creates[j]));
+      creates[inst[i].creates[j]] = i;
+    }
+    for(int j = 0; j < inst[i].removes.size(); j++) {
+      CHECK(!removed.count(inst[i].removes[j]));
+      removed.insert(inst[i].removes[j]);
+    }
+  }
+  for(int i = 0; i < inst.size(); i++) {
+    vector<int> loop;
+    loopprocess(i, &loop, inst, depon, creates, removed, &noprob);
+    if(loop.size()) {
+      printf("Loop! %d\n", loop.size());
+      CHECK(loop.size() >= 3);
+      CHECK(loop.front() == loop.back());
+      CHECK(set<int>(loop.begin(), loop.end()).size() == loop.size() - 1);
+      
+      loop.pop_back();
+      
+      Instruction rotinstr;
+      rotinstr.type = TYPE_ROTATE;
+      for(int i = 0; i < loop.size(); i++) {
+        const Instruction &insta = inst[loop[i]];
+        const Instruction &instb = inst[loop[(i+1) % loop.size()]];
+        
+        CHECK(insta.type == TYPE_COPY);
+        CHECK(instb.type == TYPE_COPY);
+        
+        CHECK(instb.copy_source == insta.copy_dest);
+        
+        rotinstr.depends.insert(rotinstr.depends.end(), insta.depends.begin(), insta.depends.end());
+        rotinstr.removes.insert(rotinstr.removes.end(), insta.removes.begin(), insta.removes.end());
+        rotinstr.creates.insert(rotinstr.creates.end(), insta.creates.begin(), insta.creates.end());
+        
+        rotinstr.rotate_paths.push_back(make_pair(insta.copy_source, insta.copy_dest_meta));
+      }
+      CHECK((set<pair<bool, string> >(rotinstr.depends.begin(), rotinstr.depends.end()).size() == rotinstr.depends.size()));
+      CHECK((set<pair<bool, string> >(rotinstr.removes.begin(), rotinstr.removes.end()).size() == rotinstr.removes.size()));
+      CHECK((set<pair<bool, string> >(rotinstr.creates.begin(), rotinstr.creates.end()).size() == rotinstr.creates.size()));
+      
+      vector<Instruction> nistr;
+      for(int i = 0; i < inst.size(); i++)
+        if(!count(loop.begin(), loop.end(), i))
+          nistr.push_back(inst[i]);
+      nistr.push_back(rotinstr);
+      return deloop(nistr);
+    }
+  }
+  return inst;
+}
+
+void sortInst(vector<Instruction> &oinst) {
+  {
+    PhaseTimer pt(PHASE_DELOOP);  // it recurses, so the timing goes out here
+    oinst = deloop(oinst);
+  }
+  
+  PhaseTimer pt(PHASE_SORT);
+  
+  vector<Instruction> buckets[TYPE_END];
+  map<pair<bool, string>, int> leftToUse;
+  for(int i = 0; i < oinst.size(); i++) {
+    CHECK(oinst[i].type >= 0 && oinst[i].type < TYPE_END);
+    buckets[oinst[i].type].push_back(oinst[i]);
+    for(int j = 0; j < oinst[i].depends.size(); j++)
+      leftToUse[oinst[i].depends[j]]++;
+  }
+  CHECK(buckets[0].size() == 1);
+  
+  vector<Instruction>().swap(oinst);  // deallocate
+  
+  set<pair<bool, string> > live;
+  
+  while(1) {
+    int tcl = 0;
+    for(int i = 0; i < TYPE_END; i++)
+      tcl += buckets[i].size();
+    if(!tcl)
+      break;
+    printf("Starting pass, %d instructions left. Instruction size is %d, oinst is %d\n", tcl, sizeof(Instruction), oinst.size());
+    {
+      int tsize = 0;
+      for(int i = 0; i < oinst.size(); i++)
+        tsize += oinst[i].bytesused();
+      printf("ts is %d\n", tsize);
+    }
+    bool didinexpensive = false;
+    for(int i = 0; i < TYPE_END; i++) {
+      if(didinexpensive && type_expensive[i]) {
+        printf("Skipping mode due to expensive commands, will return\n");
+        continue;
+      }
+      vector<Instruction> buckupd;
+      for(int j = 0; j < buckets[i].size(); j++) {
+        bool good = true;
+        for(int k = 0; good && k < buckets[i][j].depends.size(); k++)
+          if(!live.count(buckets[i][j].depends[k]))
+            good = false;
+        for(int k = 0; good && k < buckets[i][j].removes.size(); k++)
+          if(!(leftToUse[buckets[i][j].removes[k]] == 0 || leftToUse[buckets[i][j].removes[k]] == 1 && count(buckets[i][j].depends.begin(), buckets[i][j].depends.end(), buckets[i][j].removes[k])))
+            good = false;
+        if(!good) {
+          buckupd.push_back(buckets[i][j]);
+          continue;
+        }
+        //dprintf("%s\n", buckets[i][j].textout().c_str());
+        for(int k = 0; k < buckets[i][j].depends.size(); k++)
+          leftToUse[buckets[i][j].depends[k]]--;
+        for(int k = 0; k < buckets[i][j].removes.size(); k++) {
+          CHECK(live.count(buckets[i][j].removes[k]));
+          live.erase(buckets[i][j].removes[k]);
+        }
+        for(int k = 0; k < buckets[i][j].creates.size(); k++) {
+          pair<bool, string> ite = buckets[i][j].creates[k];
+          CHECK(!live.count(ite));
+          live.insert(buckets[i][j].creates[k]);
+        }
+        if(i != TYPE_CREATE) {  // these don't get output
+          oinst.push_back(buckets[i][j]);
+          if(!type_expensive[i])
+            didinexpensive = true;
+        }
+      }
+      buckets[i].swap(buckupd);
+    }
+    for(int i = 0; i < TYPE_END; i++)
+      tcl -= buckets[i].size();
+    CHECK(tcl != 0);
+  }
+}
@@ -0,0 +1,39 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_PLAN
+#define PUREBACKUP_PLAN
+
+#include "state.h"
+
+#include <vector>
+
+using namespace std;
+
+// Directories that went away, where every file they had turned up again under one other directory with the same
+// relative path, size and timestamp, and a sample of those still look the same. Only the paths in gone and fresh -
+// which went away, and which are new - get considered. Each comes back as a single move.
+vector<Instruction> findMoves(const map<string, Item> &origitems, const map<string, Item> &realitems, const set<string> &gone, const set<string> &fresh);
+
+// Replaces every ring of copies that depend on each other with a single rotate
+vector<Instruction> deloop(const vector<Instruction> &inst);
+
+// Puts instructions in an order where everything they depend on exists when they run, cheap ones first
+void sortInst(vector<Instruction> &oinst);
+
+#endif
@@ -0,0 +1,1055 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "restore.h"
+
+#include "parse.h"
+#include "debug.h"
+#include "thread.h"
+#include "patch.h"
+
+#include "minizip/unzip.h"
+
+#include <zlib.h>
+
+#include <fstream>
+#include <algorithm>
+#include <set>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+using namespace std;
+
+bool operator<(const RestoreSource &lhs, const RestoreSource &rhs) {
+  if(lhs.seq != rhs.seq)
+    return lhs.seq < rhs.seq;
+  return lhs.member < rhs.member;
+}
+bool operator==(const RestoreSource &lhs, const RestoreSource &rhs) {
+  return lhs.seq == rhs.seq && lhs.member == rhs.member;
+}
+
+void createDirectoryTree(const string &tree) {
+  if(mkdir(tree.c_str(), 0755) && errno != EEXIST) {
+    createDirectoryTree(string(tree.c_str(), (const char *)strrchr(tree.c_str(), '/')));
+    CHECK(!mkdir(tree.c_str(), 0755) || errno == EEXIST);
+  }
+}
+
+FILE *openAndCreatePath(const string &path) {
+  FILE *fil = fopen(path.c_str(), "wb");
+  if(!fil) {
+    createDirectoryTree(string(path.c_str(), (const char *)strrchr(path.c_str(), '/')));
+    fil = fopen(path.c_str(), "wb");
+  }
+  if(!fil)
+    printf("Couldn't create %s\n", path.c_str());
+  CHECK(fil);
+  return fil;
+}
+
+void applyMetadata(const string &path, const Metadata &meta) {
+  timeval tv[2];
+  memset(tv, 0, sizeof(tv));
+  tv[0].tv_sec = meta.timestamp;
+  tv[1].tv_sec = meta.timestamp;
+  
+  CHECK(!utimes(path.c_str(), tv));
+}
+
+// Tries, in order, a reflink (free on btrfs/xfs), an in-kernel copy, and finally copying through userspace.
+void copyFile(const string &src, const string &dst) {
+  int fsrc = open(src.c_str(), O_RDONLY);
+  if(fsrc == -1) {
+    printf("Couldn't open %s to copy it\n", src.c_str());
+    CHECK(0);
+  }
+  FILE *fdstf = openAndCreatePath(dst);
+  int fdst = fileno(fdstf);
+  
+#ifdef FICLONE
+  if(!ioctl(fdst, FICLONE, fsrc)) {
+    fclose(fdstf);
+    close(fsrc);
+    return;
+  }
+#endif
+
+  bool done = false;
+  
+#ifdef __linux__
+  {
+    // Only what's between the holes goes across, and then the length gets set by hand, so sparse files stay sparse
+    struct stat stt;
+    CHECK(!fstat(fsrc, &stt));
+    HoleMap holes;
+    findHoles(fsrc, 0, stt.st_size, &holes);
+    long long copied = 0;
+    bool failed = false;
+    for(int i = 0; i <= holes.size() && !failed; i++) {
+      loff_t in = i ? holes[i - 1].first + holes[i - 1].second : 0;
+      loff_t out = in;
+      long long end = (i < holes.size()) ? holes[i].first : stt.st_size;
+      while(in < end) {
+        ssize_t rv = copy_file_range(fsrc, &in, fdst, &out, end - in, 0);
+        if(rv <= 0) {
+          failed = true;
+          break;
+        }
+        copied += rv;
+      }
+    }
+    if(!failed) {
+      CHECK(!ftruncate(fdst, stt.st_size));
+      done = true;
+    } else if(copied) {
+      // It got partway and then gave up - that's not an "unsupported" failure, that's a real one
+      printf("Copying %s to %s failed partway\n", src.c_str(), dst.c_str());
+      CHECK(0);
+    }
+  }
+#endif
+  
+  // Blocks of zeros get seeked over instead of written, for the same reason
+  long long len = 0;
+  while(!done) {
+    char buf[65536];
+    int rv = read(fsrc, buf, sizeof(buf));
+    CHECK(rv >= 0);
+    
+    if(!rv) {
+      CHECK(!ftruncate(fdst, len));
+      break;
+    }
+    
+    if(allZero(buf, rv)) {
+      CHECK(lseek(fdst, rv, SEEK_CUR) != -1);
+    } else {
+      CHECK(write(fdst, buf, rv) == rv);
+    }
+    len += rv;
+  };
+  
+  fclose(fdstf);
+  close(fsrc);
+}
+
+vector<string> listMembers(const string &archive) {
+  vector<string> rv;
+  unzFile unzf = unzOpen(archive.c_str());
+  CHECK(unzf);
+  if(unzGoToFirstFile(unzf) == UNZ_OK) {
+    do {
+      char filename[1024];
+      CHECK(unzGetCurrentFileInfo(unzf, NULL, filename, sizeof(filename), NULL, 0, NULL, 0) == UNZ_OK);
+      rv.push_back(filename);
+    } while(unzGoToNextFile(unzf) == UNZ_OK);
+  }
+  unzClose(unzf);
+  return rv;
+}
+
+RestoreTarget &RestorePlan::changed(const string &path) {
+  RestoreTarget &targ = targets[path];
+  targ.stamp = ++stamps;
+  targ.hardlink.clear();
+  return targ;
+}
+
+bool RestorePlan::linkValid(const string &path) const {
+  const RestoreTarget &targ = targets.find(path)->second;
+  if(!targ.hardlink.size())
+    return false;
+  map<string, RestoreTarget>::const_iterator other = targets.find(targ.hardlink);
+  return other != targets.end() && other->second.stamp == targ.linkstamp;
+}
+
+void RestorePlan::addSession(const string &src) {
+  ifstream fil(StringPrintf("%s/process", src.c_str()).c_str());
+  CHECK(fil);
+  
+  kvData kvd;
+  while(getkvDataInline(fil, kvd)) {
+    if(kvd.category == "store" || kvd.category == "append" || kvd.category == "patch") {
+      
+      // Every member of the archive belongs to the instructions that immediately follow, so we can take them all now
+      RestoreSource rs;
+      rs.seq = archives++;
+      rs.archive = src + "/" + kvd.consume("source");
+      rs.patch = (kvd.category == "patch");
+      
+      vector<string> members = listMembers(rs.archive);
+      for(int i = 0; i < members.size(); i++) {
+        rs.member = members[i];
+        string path = "/" + members[i];
+        if(kvd.category == "store") {
+          RestoreTarget &targ = targets[path];
+          targ = RestoreTarget();
+          targ.store = rs;
+          changed(path);
+        } else {
+          if(!targets.count(path)) {
+            printf("%s to %s, which doesn't exist\n", kvd.category.c_str(), path.c_str());
+            CHECK(0);
+          }
+          changed(path).appends.push_back(rs);
+        }
+      }
+      
+    } else if(kvd.category == "chunks") {
+      
+      // A chunk archive can be referenced by any later session, so its members go in a pool instead of to a path
+      RestoreSource rs;
+      rs.seq = archives++;
+      rs.archive = src + "/" + kvd.consume("source");
+      
+      vector<string> members = listMembers(rs.archive);
+      for(int i = 0; i < members.size(); i++) {
+        rs.member = members[i];
+        chunks[members[i]] = rs;
+      }
+      
+    } else if(kvd.category == "chunked") {
+      
+      string path = kvd.consume("path");
+      RestoreTarget &targ = targets[path];
+      targ = RestoreTarget();
+      changed(path);
+      vector<string> hashes = tokenize(kvd.consume("chunks"), " ");
+      for(int i = 0; i < hashes.size(); i++) {
+        if(!chunks.count(hashes[i])) {
+          printf("%s needs chunk %s, which was never stored\n", path.c_str(), hashes[i].c_str());
+          CHECK(0);
+        }
+        targ.chunks.push_back(chunks[hashes[i]]);
+      }
+      targ.size = atoll(kvd.consume("size").c_str());
+      targ.meta = metaParseFromKvd(getkvDataInlineString(kvd.consume("meta")));
+      
+    } else if(kvd.category == "stored") {
+      
+      string path = kvd.consume("path");
+      CHECK(targets.count(path));
+      RestoreTarget &targ = changed(path);
+      targ.size = atoll(kvd.consume("size").c_str());
+      targ.meta = metaParseFromKvd(getkvDataInlineString(kvd.consume("meta")));
+      if(kvd.kv.count("holes"))
+        targ.store.holes = holeMapParse(kvd.consume("holes"));
+      
+    } else if(kvd.category == "appended") {
+      
+      string path = kvd.consume("path");
+      CHECK(targets.count(path));
+      RestoreTarget &targ = changed(path);
+      long long begin = atoll(kvd.consume("begin").c_str());
+      CHECK(targ.size == -1 || targ.size == begin);
+      targ.size = atoll(kvd.consume("size").c_str());
+      targ.meta = metaParseFromKvd(getkvDataInlineString(kvd.consume("meta")));
+      if(kvd.kv.count("holes")) {
+        CHECK(targ.appends.size());
+        targ.appends.back().holes = holeMapParse(kvd.consume("holes"));
+      }
+      
+    } else if(kvd.category == "patched") {
+      
+      string path = kvd.consume("path");
+      CHECK(targets.count(path));
+      RestoreTarget &targ = changed(path);
+      targ.size = atoll(kvd.consume("size").c_str());
+      targ.meta = metaParseFromKvd(getkvDataInlineString(kvd.consume("meta")));
+      
+    } else if(kvd.category == "touch") {
+      
+      // Archives written before "stored" and "appended" existed use plain touch records for those too
+      string path = kvd.consume("path");
+      CHECK(targets.count(path));
+      changed(path).meta = metaParseFromKvd(getkvDataInlineString(kvd.consume("meta")));
+      
+    } else if(kvd.category == "copy") {
+      
+      string source = kvd.consume("source");
+      string dest = kvd.consume("dest");
+      CHECK(targets.count(source));
+      RestoreTarget targ = targets[source];
+      targ.meta = metaParseFromKvd(getkvDataInlineString(kvd.consume("dest_meta")));
+      targets[dest] = targ;
+      changed(dest);
+      if(kvd.kv.count("link") && atoi(kvd.consume("link").c_str())) {
+        targets[dest].hardlink = source;
+        targets[dest].linkstamp = targets[source].stamp;
+      }
+
+    } else if(kvd.category == "delete") {
+      
+      string path = kvd.consume("path");
+      CHECK(targets.count(path));
+      targets.erase(targets.find(path));
+    
+    } else if(kvd.category == "move") {
+      
+      // One rename of the whole prefix - nothing in it changed, so the stamps and links go along untouched
+      string source = kvd.consume("source");
+      string dest = kvd.consume("dest");
+      int count = atoi(kvd.consume("count").c_str());
+      string from = source + "/";
+      vector<pair<string, RestoreTarget> > moving;
+      for(map<string, RestoreTarget>::iterator itr = targets.lower_bound(from); itr != targets.end() && !itr->first.compare(0, from.size(), from); ) {
+        moving.push_back(*itr);
+        targets.erase(itr++);
+      }
+      CHECK(moving.size() == count);
+      for(int i = 0; i < moving.size(); i++) {
+        string path = dest + moving[i].first.substr(source.size());
+        CHECK(!targets.count(path));
+        targets[path] = moving[i].second;
+      }
+      for(map<string, RestoreTarget>::iterator itr = targets.begin(); itr != targets.end(); itr++)
+        if(!itr->second.hardlink.compare(0, from.size(), from))
+          itr->second.hardlink = dest + itr->second.hardlink.substr(source.size());
+    
+    } else if(kvd.category == "rotate") {
+      
+      int ct = 0;
+      for(ct = 0; kvd.kv.count(StringPrintf("meta%02d", ct)); ct++);
+      
+      CHECK(ct >= 2);
+      
+      // The contents of path i end up at path i + 1, with metadata i
+      vector<string> paths;
+      vector<RestoreTarget> srcs;
+      for(int i = 0; i < ct; i++) {
+        paths.push_back(kvd.consume(StringPrintf("src%02ddst%02d", i, (i + ct - 1) % ct)));
+        CHECK(targets.count(paths.back()));
+        srcs.push_back(targets[paths.back()]);
+        srcs.back().meta = metaParseFromKvd(getkvDataInlineString(kvd.consume(StringPrintf("meta%02d", i))));
+      }
+      for(int i = 0; i < ct; i++) {
+        targets[paths[(i + 1) % ct]] = srcs[i];
+        changed(paths[(i + 1) % ct]);
+      }
+      
+    } else {
+      CHECK(0);
+    }
+    
+    CHECK(kvd.isDone());
+    
+  }
+}
+
+string chainKey(const RestoreTarget &targ) {
+  string key = StringPrintf("%d/%s", targ.store.seq, targ.store.member.c_str());
+  for(int i = 0; i < targ.chunks.size(); i++)
+    key += StringPrintf("\n%d/%s", targ.chunks[i].seq, targ.chunks[i].member.c_str());
+  for(int i = 0; i < targ.appends.size(); i++)
+    key += StringPrintf("\n%d/%s", targ.appends[i].seq, targ.appends[i].member.c_str());
+  return key;
+}
+
+// Writes a member out around the holes it was archived without, and any long runs of zeros it still has, seeking over
+// them so they come back as holes. Every dest has to be sitting at the offset the member starts at. Nothing's there yet,
+// so there's never anything that needs punching out.
+class HoleWriter {
+public:
+  void write(const char *data, int len);
+  void finish();  // a member can end in a hole, and the file still has to reach past it
+
+  HoleWriter(const vector<FILE *> &dests, const HoleMap *holes);
+
+private:
+  static void literal(const char *data, int len, void *ctx);
+  static void run(long long start, long long len, void *ctx);
+  void skip();
+
+  const vector<FILE *> &dests;
+  const HoleMap *holes;
+  int next;
+  ZeroRuns runs;
+  bool seeked;
+};
+
+HoleWriter::HoleWriter(const vector<FILE *> &in_dests, const HoleMap *in_holes) : dests(in_dests), runs(ftello(in_dests[0]), literal, run, this) {
+  holes = in_holes;
+  next = 0;
+  seeked = false;
+}
+
+void HoleWriter::literal(const char *data, int len, void *ctx) {
+  HoleWriter *hw = (HoleWriter *)ctx;
+  for(int i = 0; i < hw->dests.size(); i++)
+    CHECK(fwrite(data, 1, len, hw->dests[i]) == len);
+}
+
+void HoleWriter::run(long long start, long long len, void *ctx) {
+  HoleWriter *hw = (HoleWriter *)ctx;
+  for(int i = 0; i < hw->dests.size(); i++)
+    CHECK(!fseeko(hw->dests[i], start + len, SEEK_SET));
+  hw->seeked = true;
+}
+
+void HoleWriter::skip() {
+  while(holes && next < holes->size() && (*holes)[next].first == runs.position()) {
+    runs.hole((*holes)[next].second);
+    next++;
+  }
+}
+
+void HoleWriter::write(const char *data, int len) {
+  while(len) {
+    skip();
+    int piece = len;
+    if(holes && next < holes->size())
+      piece = (int)min((long long)len, (*holes)[next].first - runs.position());
+    CHECK(piece > 0);
+    runs.feed(data, piece);
+    data += piece;
+    len -= piece;
+  }
+}
+
+void HoleWriter::finish() {
+  skip();
+  CHECK(!holes || next == holes->size());
+  runs.finish();
+  if(!seeked)
+    return;
+  for(int i = 0; i < dests.size(); i++) {
+    CHECK(!fflush(dests[i]));
+    CHECK(!ftruncate(fileno(dests[i]), runs.position()));
+  }
+}
+
+// Opens a file we're about to put more on the end of. Not "ab", since that would write over the top of any holes.
+static FILE *openForAppend(const string &path) {
+  FILE *fil = fopen(path.c_str(), "r+b");
+  CHECK(fil);
+  CHECK(!fseeko(fil, 0, SEEK_END));
+  return fil;
+}
+
+// Inflates the current member of unzf into out
+static void inflateCurrent(unzFile unzf, HoleWriter *out) {
+  CHECK(unzOpenCurrentFile(unzf) == UNZ_OK);
+  while(1) {
+    char buf[65536];
+    
+    int byter = unzReadCurrentFile(unzf, buf, sizeof(buf));
+    CHECK(byter >= 0);
+    if(!byter)
+      break;
+    
+    out->write(buf, byter);
+  }
+  CHECK(unzCloseCurrentFile(unzf) == UNZ_OK);
+}
+
+// Inflates the current member of unzf into every file in dests
+void extractCurrent(unzFile unzf, const vector<FILE *> &dests, const HoleMap *holes = NULL) {
+  HoleWriter out(dests, holes);
+  inflateCurrent(unzf, &out);
+  out.finish();
+}
+
+// Rewrites path as delta says, via a temporary so the old version is intact until the new one is complete
+static void applyDeltaToFile(FILE *delta, const string &path) {
+  rewind(delta);
+  string tmp = path + ".pbpatch";
+  FILE *old = fopen(path.c_str(), "rb");
+  CHECK(old);
+  FILE *out = fopen(tmp.c_str(), "wb");
+  CHECK(out);
+  applyDelta(delta, old, out);
+  fclose(old);
+  CHECK(!fclose(out));
+  CHECK(!rename(tmp.c_str(), path.c_str()));
+}
+
+// One archive, and where each member we need out of it is
+class ArchiveListing {
+public:
+  string archive;
+  bool patch;
+  set<string> needed;
+  map<string, const HoleMap *> holes;
+  map<string, pair<unz_file_pos, long long> > members; // filled in by listArchive: position and uncompressed size
+};
+
+static void listArchive(int task, void *data) {
+  ArchiveListing &al = (*(vector<ArchiveListing> *)data)[task];
+  unzFile unzf = unzOpen(al.archive.c_str());
+  CHECK(unzf);
+  if(unzGoToFirstFile(unzf) == UNZ_OK) {
+    do {
+      char filename[1024];
+      unz_file_info info;
+      CHECK(unzGetCurrentFileInfo(unzf, &info, filename, sizeof(filename), NULL, 0, NULL, 0) == UNZ_OK);
+      if(!al.needed.count(filename))
+        continue; // dead data
+      unz_file_pos pos;
+      CHECK(unzGetFilePos(unzf, &pos) == UNZ_OK);
+      al.members[filename] = make_pair(pos, (long long)info.uncompressed_size);
+    } while(unzGoToNextFile(unzf) == UNZ_OK);
+  }
+  unzClose(unzf);
+  if(al.members.size() != al.needed.size()) {
+    printf("%s is missing members\n", al.archive.c_str());
+    CHECK(0);
+  }
+}
+
+// A run of members out of one archive, small enough that a big archive gets spread over several threads
+class ExtractTask {
+public:
+  string archive;
+  bool append;
+  bool patch;
+  vector<unz_file_pos> members;
+  vector<const HoleMap *> holes;
+  vector<vector<string> > dests;
+};
+
+static void runExtract(int task, void *data) {
+  const ExtractTask &et = (*(vector<ExtractTask> *)data)[task];
+  unzFile unzf = unzOpen(et.archive.c_str());
+  CHECK(unzf);
+  for(int i = 0; i < et.members.size(); i++) {
+    unz_file_pos pos = et.members[i];
+    CHECK(unzGoToFilePos(unzf, &pos) == UNZ_OK);
+    
+    if(et.patch) {
+      FILE *delta = tmpfile();
+      CHECK(delta);
+      extractCurrent(unzf, vector<FILE *>(1, delta));
+      for(int j = 0; j < et.dests[i].size(); j++)
+        applyDeltaToFile(delta, et.dests[i][j]);
+      fclose(delta);
+      continue;
+    }
+    
+    vector<FILE *> dests;
+    for(int j = 0; j < et.dests[i].size(); j++) {
+      if(!et.append)
+        dests.push_back(openAndCreatePath(et.dests[i][j]));
+      else
+        dests.push_back(openForAppend(et.dests[i][j]));
+    }
+    
+    extractCurrent(unzf, dests, et.holes[i]);
+    
+    for(int j = 0; j < dests.size(); j++)
+      fclose(dests[j]);
+  }
+  unzClose(unzf);
+}
+
+// A chunked file, put together from members that may be spread over any number of archives
+class ChunkTask {
+public:
+  string dest;
+  vector<pair<string, unz_file_pos> > chunks;
+};
+
+static void runChunks(int task, void *data) {
+  const ChunkTask &ct = (*(vector<ChunkTask> *)data)[task];
+  map<string, unzFile> open;
+  vector<FILE *> dests;
+  dests.push_back(openAndCreatePath(ct.dest));
+  HoleWriter out(dests, NULL);  // one for the lot, so a run of zeros can carry on from one chunk into the next
+  for(int i = 0; i < ct.chunks.size(); i++) {
+    unzFile &unzf = open[ct.chunks[i].first];
+    if(!unzf) {
+      unzf = unzOpen(ct.chunks[i].first.c_str());
+      CHECK(unzf);
+    }
+    unz_file_pos pos = ct.chunks[i].second;
+    CHECK(unzGoToFilePos(unzf, &pos) == UNZ_OK);
+    inflateCurrent(unzf, &out);
+  }
+  out.finish();
+  fclose(dests[0]);
+  for(map<string, unzFile>::iterator itr = open.begin(); itr != open.end(); itr++)
+    unzClose(itr->second);
+}
+
+class FanoutTask {
+public:
+  string dest;
+  const vector<pair<string, vector<string> > > *groups;
+  const vector<pair<string, const RestoreTarget *> > *targets;
+  const map<string, string> *linkto;
+};
+
+static void runFanout(int task, void *data) {
+  const FanoutTask &ft = *(FanoutTask *)data;
+  const vector<string> &group = (*ft.groups)[task].second;
+  for(int i = 1; i < group.size(); i++)
+    if(!ft.linkto->count(group[i]))
+      copyFile(ft.dest + group[0], ft.dest + group[i]);
+  // Whatever these link to is one of the copies, or the leader, so it's there by now
+  for(int i = 1; i < group.size(); i++) {
+    map<string, string>::const_iterator litr = ft.linkto->find(group[i]);
+    if(litr == ft.linkto->end())
+      continue;
+    if(link((ft.dest + litr->second).c_str(), (ft.dest + group[i]).c_str())) {
+      printf("Couldn't link %s to %s, copying it instead\n", group[i].c_str(), litr->second.c_str());
+      copyFile(ft.dest + litr->second, ft.dest + group[i]);
+    }
+  }
+}
+
+static string linkRoot(const map<string, string> &root, string path) {
+  while(root.find(path)->second != path)
+    path = root.find(path)->second;
+  return path;
+}
+
+static void runMetadata(int task, void *data) {
+  const FanoutTask &ft = *(FanoutTask *)data;
+  applyMetadata(ft.dest + (*ft.targets)[task].first, (*ft.targets)[task].second->meta);
+}
+
+const long long extracttaskbytes = 64 << 20;
+const int extracttaskmembers = 256;
+
+void RestorePlan::execute(const string &dest) const {
+  
+  // Anything with an identical store-and-append chain ends up with identical contents, so we only build one of them
+  vector<pair<string, vector<string> > > groups;
+  {
+    map<string, vector<string> > groupmap;
+    for(map<string, RestoreTarget>::const_iterator itr = targets.begin(); itr != targets.end(); itr++) {
+      if(itr->second.store.seq == -1 && !itr->second.chunks.size()) {
+        printf("No stored data for %s\n", itr->first.c_str());
+        CHECK(0);
+      }
+      groupmap[chainKey(itr->second)].push_back(itr->first);
+    }
+    groups.assign(groupmap.begin(), groupmap.end());
+  }
+  
+  // Round 0 extracts every group's store member, or puts its chunks together, and round n applies every group's nth
+  // append. Inside a round nothing depends on anything else, so the whole round can go in parallel - that's the only
+  // ordering we need.
+  vector<map<int, map<string, vector<string> > > > rounds(1);  // round -> archive seq -> member -> group leaders
+  vector<string> chunked; // group leaders built from chunks in round 0
+  map<int, int> listings; // archive seq -> index into lists
+  vector<ArchiveListing> lists;
+  for(int i = 0; i < groups.size(); i++) {
+    const RestoreTarget &targ = targets.find(groups[i].second[0])->second;
+    vector<const RestoreSource *> needed;
+    if(targ.chunks.size()) {
+      chunked.push_back(groups[i].second[0]);
+      for(int j = 0; j < targ.chunks.size(); j++)
+        needed.push_back(&targ.chunks[j]);
+    }
+    for(int j = 0; j <= targ.appends.size(); j++) {
+      if(!j && targ.chunks.size())
+        continue;
+      const RestoreSource &rs = j ? targ.appends[j - 1] : targ.store;
+      if(rounds.size() <= j)
+        rounds.resize(j + 1);
+      rounds[j][rs.seq][rs.member].push_back(groups[i].second[0]);
+      needed.push_back(&rs);
+    }
+    for(int j = 0; j < needed.size(); j++) {
+      const RestoreSource &rs = *needed[j];
+      if(!listings.count(rs.seq)) {
+        listings[rs.seq] = lists.size();
+        lists.push_back(ArchiveListing());
+        lists.back().archive = rs.archive;
+        lists.back().patch = rs.patch;
+      }
+      lists[listings[rs.seq]].needed.insert(rs.member);
+      if(rs.holes.size())
+        lists[listings[rs.seq]].holes[rs.member] = &rs.holes;
+    }
+  }
+  
+  // Files that were hardlinks of each other when they were backed up, and haven't changed since, get linked again.
+  // Each set of them gets one real file, which is the group leader if it's one of them.
+  map<string, string> linkto;
+  for(int i = 0; i < groups.size(); i++) {
+    const vector<string> &group = groups[i].second;
+    map<string, string> root;
+    for(int j = 0; j < group.size(); j++)
+      root[group[j]] = group[j];
+    for(int j = 0; j < group.size(); j++) {
+      if(!linkValid(group[j]) || !root.count(targets.find(group[j])->second.hardlink))
+        continue;
+      string a = linkRoot(root, group[j]);
+      string b = linkRoot(root, targets.find(group[j])->second.hardlink);
+      if(a == group[0])
+        root[b] = a;
+      else if(a != b)
+        root[a] = b;
+    }
+    for(int j = 0; j < group.size(); j++) {
+      string r = linkRoot(root, group[j]);
+      if(r != group[j])
+        linkto[group[j]] = r;
+    }
+  }
+  
+  printf("Restoring %d files, %d distinct, %d hardlinked, from %d archives in %d rounds\n", (int)targets.size(), (int)groups.size(), (int)linkto.size(), (int)lists.size(), (int)rounds.size());
+  
+  parallelFor(lists.size(), listArchive, &lists);
+  
+  // Make every directory up front, so the workers never race each other doing it
+  {
+    set<string> dirs;
+    for(map<string, RestoreTarget>::const_iterator itr = targets.begin(); itr != targets.end(); itr++) {
+      string path = dest + itr->first;
+      dirs.insert(string(path.c_str(), (const char *)strrchr(path.c_str(), '/')));
+    }
+    for(set<string>::const_iterator itr = dirs.begin(); itr != dirs.end(); itr++)
+      createDirectoryTree(*itr);
+  }
+  
+  for(int i = 0; i < rounds.size(); i++) {
+    vector<ExtractTask> tasks;
+    for(map<int, map<string, vector<string> > >::const_iterator aitr = rounds[i].begin(); aitr != rounds[i].end(); aitr++) {
+      const ArchiveListing &al = lists[listings[aitr->first]];
+      long long bytes = 0;
+      for(map<string, vector<string> >::const_iterator mitr = aitr->second.begin(); mitr != aitr->second.end(); mitr++) {
+        if(mitr == aitr->second.begin() || bytes > extracttaskbytes || tasks.back().members.size() >= extracttaskmembers) {
+          tasks.push_back(ExtractTask());
+          tasks.back().archive = al.archive;
+          tasks.back().append = (i != 0);
+          tasks.back().patch = al.patch;
+          bytes = 0;
+        }
+        const pair<unz_file_pos, long long> &mem = al.members.find(mitr->first)->second;
+        tasks.back().members.push_back(mem.first);
+        map<string, const HoleMap *>::const_iterator hitr = al.holes.find(mitr->first);
+        tasks.back().holes.push_back(hitr == al.holes.end() ? NULL : hitr->second);
+        tasks.back().dests.push_back(vector<string>());
+        for(int j = 0; j < mitr->second.size(); j++)
+          tasks.back().dests.back().push_back(dest + mitr->second[j]);
+        bytes += mem.second;
+      }
+    }
+    parallelFor(tasks.size(), runExtract, &tasks);
+    
+    if(i == 0) {
+      vector<ChunkTask> ctasks(chunked.size());
+      for(int j = 0; j < chunked.size(); j++) {
+        const RestoreTarget &targ = targets.find(chunked[j])->second;
+        ctasks[j].dest = dest + chunked[j];
+        for(int k = 0; k < targ.chunks.size(); k++) {
+          const ArchiveListing &al = lists[listings[targ.chunks[k].seq]];
+          ctasks[j].chunks.push_back(make_pair(al.archive, al.members.find(targ.chunks[k].member)->second.first));
+        }
+      }
+      parallelFor(ctasks.size(), runChunks, &ctasks);
+    }
+  }
+  
+  // Now fan out the duplicates and get the metadata right
+  vector<pair<string, const RestoreTarget *> > targlist;
+  for(map<string, RestoreTarget>::const_iterator itr = targets.begin(); itr != targets.end(); itr++)
+    targlist.push_back(make_pair(itr->first, &itr->second));
+  
+  FanoutTask ft;
+  ft.dest = dest;
+  ft.groups = &groups;
+  ft.targets = &targlist;
+  ft.linkto = &linkto;
+  parallelFor(groups.size(), runFanout, &ft);
+  parallelFor(targlist.size(), runMetadata, &ft);
+}
+
+vector<int> getSessions(const string &src) {
+  pair<bool, vector<DirListOut> > dlo = getDirList(src);
+  CHECK(!dlo.first);
+  
+  vector<int> sessions;
+  for(int i = 0; i < dlo.second.size(); i++)
+    if(dlo.second[i].directory && atoi(dlo.second[i].itemname.c_str()) != 0)
+      sessions.push_back(atoi(dlo.second[i].itemname.c_str()));
+  sort(sessions.begin(), sessions.end());
+  
+  for(int i = 1; i < sessions.size(); i++)
+    CHECK(sessions[i - 1] + 1 == sessions[i]);
+  
+  return sessions;
+}
+
+void restore(const string &src, const string &dst) {
+  vector<int> sessions = getSessions(src);
+  
+  RestorePlan plan;
+  for(int i = 0; i < sessions.size(); i++) {
+    printf("Replaying %d\n", sessions[i]);
+    plan.addSession(StringPrintf("%s/%08d", src.c_str(), sessions[i]));
+  }
+  
+  plan.execute(dst);
+}
+
+kvData SessionIndexEntry::toKvd(const string &path) const {
+  kvData kvd;
+  kvd.category = "entry";
+  kvd.kv["path"] = path;
+  if(deleted) {
+    kvd.kv["deleted"] = "1";
+    return kvd;
+  }
+  if(origin.size())
+    kvd.kv["origin"] = origin;
+  if(store.size())
+    kvd.kv["store"] = store;
+  if(chunks.size()) {
+    string cks;
+    for(int i = 0; i < chunks.size(); i++) {
+      if(i)
+        cks += " ";
+      cks += chunks[i];
+    }
+    kvd.kv["chunks"] = cks;
+  }
+  if(appends.size()) {
+    string aps;
+    for(int i = 0; i < appends.size(); i++) {
+      if(i)
+        aps += " ";
+      aps += appends[i];
+    }
+    kvd.kv["appends"] = aps;
+  }
+  kvd.kv["meta"] = meta.toKvd();
+  return kvd;
+}
+
+SessionIndexEntry SessionIndexEntry::FromKvd(kvData kvd) {
+  CHECK(kvd.category == "entry");
+  SessionIndexEntry sie;
+  kvd.consume("path");
+  if(kvd.kv.count("deleted")) {
+    kvd.consume("deleted");
+    sie.deleted = true;
+    kvd.shouldBeDone();
+    return sie;
+  }
+  if(kvd.kv.count("origin"))
+    sie.origin = kvd.consume("origin");
+  if(kvd.kv.count("store"))
+    sie.store = kvd.consume("store");
+  if(kvd.kv.count("chunks"))
+    sie.chunks = tokenize(kvd.consume("chunks"), " ");
+  if(kvd.kv.count("appends"))
+    sie.appends = tokenize(kvd.consume("appends"), " ");
+  sie.meta = metaParseFromKvd(getkvDataInlineString(kvd.consume("meta")));
+  CHECK(!!sie.origin.size() + !!sie.store.size() + !!sie.chunks.size() == 1);
+  kvd.shouldBeDone();
+  return sie;
+}
+
+static bool readIndexLine(FILE *fil, string *line, string *path) {
+  line->clear();
+  int ch;
+  while((ch = fgetc(fil)) != EOF && ch != '\n')
+    *line += ch;
+  if(ch == EOF && !line->size())
+    return false;
+  kvData kvd = getkvDataInlineString(*line);
+  *path = kvd.consume("path");
+  return true;
+}
+
+// Bisects the sorted index down to a small window, then reads forward until we pass where the path would be
+bool lookupIndex(const string &indexfile, const string &path, SessionIndexEntry *out) {
+  FILE *fil = fopen(indexfile.c_str(), "rb");
+  if(!fil)
+    return false;
+  
+  CHECK(!fseeko(fil, 0, SEEK_END));
+  long long lo = 0; // always the start of a line before or at the one we want
+  long long hi = ftello(fil);
+  string line;
+  string lpath;
+  while(hi - lo > 4096) {
+    long long mid = (lo + hi) / 2;
+    CHECK(!fseeko(fil, mid, SEEK_SET));
+    int ch;
+    while((ch = fgetc(fil)) != EOF && ch != '\n');
+    long long linestart = ftello(fil);
+    if(linestart >= hi || !readIndexLine(fil, &line, &lpath)) {
+      hi = mid;
+      continue;
+    }
+    if(lpath < path)
+      lo = linestart;
+    else
+      hi = mid; // the scan from lo only stops once it reaches or passes the path, so we don't need to keep this line in the window
+  }
+  
+  CHECK(!fseeko(fil, lo, SEEK_SET));
+  bool found = false;
+  while(readIndexLine(fil, &line, &lpath)) {
+    if(lpath == path) {
+      *out = SessionIndexEntry::FromKvd(getkvDataInlineString(line));
+      found = true;
+      break;
+    }
+    if(path < lpath)
+      break;
+  }
+  fclose(fil);
+  return found;
+}
+
+// Inflates the member whose local header is at "archive@offset" straight into dest, without touching the central directory
+static void extractLocal(const string &session, const string &ref, FILE *dest) {
+  vector<string> tok = tokenize(ref, "@");
+  CHECK(tok.size() == 2 || tok.size() == 3);
+  HoleMap holes;
+  if(tok.size() == 3)
+    holes = holeMapParse(tok[2]);
+  vector<FILE *> dests(1, dest);
+  HoleWriter out(dests, &holes);
+  string archive = session + "/" + tok[0];
+  FILE *fil = fopen(archive.c_str(), "rb");
+  if(!fil) {
+    printf("Couldn't open %s\n", archive.c_str());
+    CHECK(0);
+  }
+  CHECK(!fseeko(fil, atoll(tok[1].c_str()), SEEK_SET));
+  
+  unsigned char hdr[30];
+  CHECK(fread(hdr, 1, sizeof(hdr), fil) == sizeof(hdr));
+  CHECK(hdr[0] == 'P' && hdr[1] == 'K' && hdr[2] == 3 && hdr[3] == 4);
+  int method = hdr[8] | (hdr[9] << 8);
+  long long csize = hdr[18] | (hdr[19] << 8) | (hdr[20] << 16) | ((long long)hdr[21] << 24);
+  int namelen = hdr[26] | (hdr[27] << 8);
+  int extralen = hdr[28] | (hdr[29] << 8);
+  CHECK(!fseeko(fil, namelen + extralen, SEEK_CUR));
+  
+  if(method == 0) {
+    while(csize) {
+      char buf[65536];
+      int rv = fread(buf, 1, (int)min((long long)sizeof(buf), csize), fil);
+      CHECK(rv > 0);
+      out.write(buf, rv);
+      csize -= rv;
+    }
+  } else {
+    CHECK(method == Z_DEFLATED);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    CHECK(inflateInit2(&zs, -MAX_WBITS) == Z_OK);
+    char ibuf[65536];
+    char obuf[65536];
+    int rv = Z_OK;
+    while(rv != Z_STREAM_END) {
+      if(!zs.avail_in) {
+        zs.avail_in = fread(ibuf, 1, sizeof(ibuf), fil);
+        zs.next_in = (Bytef *)ibuf;
+        CHECK(zs.avail_in);
+      }
+      zs.next_out = (Bytef *)obuf;
+      zs.avail_out = sizeof(obuf);
+      rv = inflate(&zs, Z_NO_FLUSH);
+      CHECK(rv == Z_OK || rv == Z_STREAM_END);
+      out.write(obuf, sizeof(obuf) - zs.avail_out);
+    }
+    inflateEnd(&zs);
+  }
+  out.finish();
+  fclose(fil);
+}
+
+void restoreFile(const string &src, const string &path, const string &dst, int session) {
+  vector<int> sessions = getSessions(src);
+  CHECK(sessions.size());
+  if(session == -1)
+    session = sessions.back();
+  
+  // Walk backwards until we hit the store this file was built from, collecting appends as we go
+  string cpath = path;
+  vector<pair<string, string> > chain; // session directory, archive@offset
+  bool gotmeta = false;
+  Metadata meta;
+  bool gotstore = false;
+  for(int i = sessions.size() - 1; i >= 0 && !gotstore; i--) {
+    if(sessions[i] > session)
+      continue;
+    string sdir = StringPrintf("%s/%08d", src.c_str(), sessions[i]);
+    SessionIndexEntry sie;
+    if(!lookupIndex(sdir + "/index", cpath, &sie))
+      continue;
+    if(sie.deleted) {
+      CHECK(!gotmeta);  // an origin can't be a file that was deleted
+      printf("%s didn't exist as of session %d\n", path.c_str(), session);
+      return;
+    }
+    if(!gotmeta) {
+      meta = sie.meta;
+      gotmeta = true;
+    }
+    for(int j = sie.appends.size() - 1; j >= 0; j--)
+      chain.push_back(make_pair(sdir, sie.appends[j]));
+    if(sie.store.size()) {
+      chain.push_back(make_pair(sdir, sie.store));
+      gotstore = true;
+    } else if(sie.chunks.size()) {
+      // chunk locations are relative to the backup root, since they can live in any earlier session
+      for(int j = sie.chunks.size() - 1; j >= 0; j--)
+        chain.push_back(make_pair(src, sie.chunks[j]));
+      gotstore = true;
+    } else {
+      cpath = sie.origin;
+    }
+  }
+  
+  if(!gotstore) {
+    printf("Couldn't find %s as of session %d\n", path.c_str(), session);
+    return;
+  }
+  
+  reverse(chain.begin(), chain.end());
+  
+  string target = dst + path;
+  createDirectoryTree(string(target.c_str(), (const char *)strrchr(target.c_str(), '/')));
+  FILE *fil = openAndCreatePath(target);
+  for(int i = 0; i < chain.size(); i++) {
+    if(chain[i].second.substr(0, 6) == "patch:") {
+      fclose(fil);
+      FILE *delta = tmpfile();
+      CHECK(delta);
+      extractLocal(chain[i].first, chain[i].second.substr(6), delta);
+      applyDeltaToFile(delta, target);
+      fclose(delta);
+      fil = openForAppend(target);
+    } else {
+      extractLocal(chain[i].first, chain[i].second, fil);
+    }
+  }
+  fclose(fil);
+  applyMetadata(target, meta);
+  
+  printf("Restored %s from %d archive members\n", path.c_str(), (int)chain.size());
+}
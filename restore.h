@@ -0,0 +1,111 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_RESTORE
+#define PUREBACKUP_RESTORE
+
+#include "item.h"
+#include "parse.h"
+
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+// One member of one archive
+class RestoreSource {
+public:
+  int seq;  // archives are numbered in the order they were replayed, which is also the order they were written
+  string archive;
+  string member;
+  bool patch; // a delta against everything before it, rather than more data on the end
+  HoleMap holes;  // what was left out of the member, by offset in the whole file
+
+  RestoreSource() : seq(-1), patch(false) { };
+};
+
+bool operator<(const RestoreSource &lhs, const RestoreSource &rhs);
+bool operator==(const RestoreSource &lhs, const RestoreSource &rhs);
+
+// Where the final version of a single file comes from
+class RestoreTarget {
+public:
+  RestoreSource store;
+  vector<RestoreSource> chunks;   // concatenated in order, instead of store
+  vector<RestoreSource> appends;  // applied in order, on top of store - these can be patches too
+  long long size;  // -1 if the process file didn't tell us
+  Metadata meta;
+
+  int stamp;         // bumped whenever this changes
+  string hardlink;   // the path this was a hardlink of, as of when it was copied from it, if it hasn't changed since
+  int linkstamp;     // hardlink's stamp at the time - if it's changed since, they're not the same file any more
+
+  RestoreTarget() : size(-1), meta(0), stamp(0), linkstamp(-1) { };
+};
+
+// Replays every session's process file into the final state of the tree, without touching the destination.
+// Only once we know what survives do we extract anything, so data that was later deleted or overwritten is never read.
+class RestorePlan {
+public:
+  void addSession(const string &src);
+
+  void execute(const string &dest) const;
+
+  const map<string, RestoreTarget> &getTargets() const { return targets; }
+
+  RestorePlan() : archives(0), stamps(0) { };
+
+private:
+  RestoreTarget &changed(const string &path);
+  bool linkValid(const string &path) const;
+
+  map<string, RestoreTarget> targets;
+  map<string, RestoreSource> chunks;  // every chunk stored so far, by hash
+  int archives;
+  int stamps;
+};
+
+// One line of a session's index: how to get a file's contents as of the end of that session, without the process file.
+// The index is sorted by path, so a single file can be found with a handful of seeks.
+class SessionIndexEntry {
+public:
+  bool deleted;
+  string origin;          // the path, as of the previous session, whose contents we build on - empty if store is set
+  string store;           // "archive@offset" of the member's local header, then "@holes" if it was stored without some
+  vector<string> chunks;  // "session/archive@offset", relative to the backup root, concatenated instead of store
+  vector<string> appends; // "archive@offset", applied in order - "patch:archive@offset" is a delta, not an append
+  Metadata meta;
+
+  kvData toKvd(const string &path) const;
+  static SessionIndexEntry FromKvd(kvData kvd);
+
+  SessionIndexEntry() : deleted(false), meta(0) { };
+};
+
+bool lookupIndex(const string &indexfile, const string &path, SessionIndexEntry *out);
+
+void applyMetadata(const string &path, const Metadata &meta);
+
+// Restores every session found in src, in order, into dst
+void restore(const string &src, const string &dst);
+
+// Restores a single file as of the given session (-1 for the latest) into dst, using only the session indexes
+void restoreFile(const string &src, const string &path, const string &dst, int session);
+
+#endif
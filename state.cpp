@@ -22,25 +22,51 @@
 #include "debug.h"
 
 #include <fstream>
+#include <algorithm>
 
 using namespace std;
 
+void State::readLine(kvData kvd) {
+  if(kvd.category == "file") {
+    string itemname = kvd.consume("name");
+    vector<int> depend = sti(tokenize(kvd.consume("dependencies"), " "));
+    sort(depend.begin(), depend.end());
+    depend.erase(unique(depend.begin(), depend.end()), depend.end());
+    if(items.count(itemname))
+      items.erase(items.find(itemname));
+    items[itemname] = Item::MakeOriginal(atoll(kvd.consume("size").c_str()), atoll(kvd.consume("timestamp").c_str()), atochecksum(kvd.consume("checksum").c_str()), depend);
+  } else if(kvd.category == "remove") {
+    string itemname = kvd.consume("name");
+    CHECK(items.count(itemname));
+    items.erase(items.find(itemname));
+  } else {
+    CHECK(0);
+  }
+  CHECK(kvd.isDone());
+}
+
 void State::readFile(const string &fil) {
   ifstream ifs(fil.c_str());
   kvData kvd;
   while(getkvDataInline(ifs, kvd)) {
-    if(kvd.category == "file") {
-      string itemname = kvd.consume("name");
-      vector<int> depend = sti(tokenize(kvd.consume("dependencies"), " "));
-      CHECK(!items.count(itemname));
-      items[itemname] = Item::MakeOriginal(atoll(kvd.consume("size").c_str()), atoll(kvd.consume("timestamp").c_str()), atochecksum(kvd.consume("checksum").c_str()), set<int>(depend.begin(), depend.end()));
-    } else {
-      CHECK(0);
-    }
+    CHECK(kvd.category == "file");
+    CHECK(kvd.kv.count("name") && !items.count(kvd.kv["name"]));
+    readLine(kvd);
   }
   CHECK(kvd.isDone());
 }
 
+// A diff is a list of "file" entries, identical in format to the ones in a full state, and "remove" entries.
+// Applying it to the state it was generated against gives the new state.
+void State::applyDiff(const string &fil) {
+  ifstream ifs(fil.c_str());
+  CHECK(ifs);
+  kvData kvd;
+  while(getkvDataInline(ifs, kvd))
+    readLine(kvd);
+  CHECK(kvd.isDone());
+}
+
 const map<string, Item> &State::getItemDb() const {
   return items;
 }
@@ -67,57 +93,115 @@ void State::process(const Instruction &in, int tversion) {
       items[in.rotate_paths[(i + 1) % in.rotate_paths.size()].first] = srcs[i];
     for(int i = 0; i < in.rotate_paths.size(); i++)
       items[in.rotate_paths[i].first].addVersion(tversion);
+    for(int i = 0; i < in.rotate_paths.size(); i++)
+      changed.insert(in.rotate_paths[i].first);
   } else if(in.type == TYPE_DELETE) {
     CHECK(items.count(in.delete_path));
     items.erase(items.find(in.delete_path));
+    changed.insert(in.delete_path);
   } else if(in.type == TYPE_COPY) {
     //dprintf("Copying from %s\n", in.copy_source.c_str());
     //dprintf("%d\n", items.count(in.copy_source));
     CHECK(items.count(in.copy_source));
     items[in.copy_dest] = Item::MakeOriginal(items[in.copy_source].size(), in.copy_dest_meta, items[in.copy_source].checksum(), items[in.copy_source].getVersions());
     items[in.copy_dest].addVersion(tversion);
+    changed.insert(in.copy_dest);
   } else if(in.type == TYPE_APPEND) {
     CHECK(items.count(in.append_path));
     items[in.append_path] = Item::MakeOriginal(in.append_size, in.append_meta, in.append_checksum, items[in.append_path].getVersions());
     items[in.append_path].addVersion(tversion);
+    changed.insert(in.append_path);
+  } else if(in.type == TYPE_PATCH) {
+    CHECK(items.count(in.patch_path));
+    items[in.patch_path] = Item::MakeOriginal(in.patch_size, in.patch_meta, in.patch_source->checksumPart(in.patch_size), items[in.patch_path].getVersions());
+    items[in.patch_path].addVersion(tversion);
+    changed.insert(in.patch_path);
   } else if(in.type == TYPE_STORE) {
     if(items.count(in.store_path))
       items.erase(items.find(in.store_path));
-    items[in.store_path] = Item::MakeOriginal(in.store_size, in.store_meta, in.store_source->checksumPart(in.store_size), set<int>());
+    items[in.store_path] = Item::MakeOriginal(in.store_size, in.store_meta, in.store_source->checksumPart(in.store_size), vector<int>());
     items[in.store_path].addVersion(tversion);
+    changed.insert(in.store_path);
+  } else if(in.type == TYPE_CHUNK) {
+    if(items.count(in.chunk_path))
+      items.erase(items.find(in.chunk_path));
+    items[in.chunk_path] = Item::MakeOriginal(in.chunk_size, in.chunk_meta, in.chunk_source->checksumPart(in.chunk_size), vector<int>());
+    items[in.chunk_path].addVersion(tversion);
+    changed.insert(in.chunk_path);
+  } else if(in.type == TYPE_MOVE) {
+    string from = in.move_source + "/";
+    vector<pair<string, Item> > moving;
+    for(map<string, Item>::iterator itr = items.lower_bound(from); itr != items.end() && !itr->first.compare(0, from.size(), from); ) {
+      moving.push_back(*itr);
+      changed.insert(itr->first);
+      items.erase(itr++);
+    }
+    CHECK(moving.size() == in.creates.size());
+    for(int i = 0; i < moving.size(); i++) {
+      string dest = in.move_dest + moving[i].first.substr(in.move_source.size());
+      CHECK(!items.count(dest));
+      items[dest] = moving[i].second;
+      items[dest].addVersion(tversion);
+      changed.insert(dest);
+    }
   } else if(in.type == TYPE_TOUCH) {
     CHECK(items.count(in.touch_path));
     items[in.touch_path] = Item::MakeOriginal(items[in.touch_path].size(), in.touch_meta, items[in.touch_path].checksum(), items[in.touch_path].getVersions());
     // We're not going to add a version entry because the client can pull that data straight out of the information file
+    changed.insert(in.touch_path);
   } else {
     CHECK(0);
   }
 }
 
+kvData fileKvd(const string &name, const Item &item) {
+  kvData kvd;
+  kvd.category = "file";
+  kvd.kv["name"] = name;
+  kvd.kv["size"] = StringPrintf("%lld", item.size());
+  kvd.kv["timestamp"] = StringPrintf("%lld", item.metadata().timestamp);
+  kvd.kv["checksum"] = item.checksum().toString();
+  {
+    const vector<int> &vers = item.getVersions();
+    string vs;
+    for(vector<int>::const_iterator itr = vers.begin(); itr != vers.end(); itr++) {
+      if(itr != vers.begin())
+        vs += " ";
+      vs += StringPrintf("%d", *itr);
+    }
+    kvd.kv["dependencies"] = vs;
+  }
+  return kvd;
+}
+
 void State::writeOut(const string &fn) const {
   ofstream ofs(fn.c_str());
   for(map<string, Item>::const_iterator itr = items.begin(); itr != items.end(); itr++) {
     //dprintf("Processing %s\n", itr->first.c_str());
-    kvData kvd;
-    kvd.category = "file";
-    kvd.kv["name"] = itr->first;
-    kvd.kv["size"] = StringPrintf("%lld", itr->second.size());
-    kvd.kv["timestamp"] = StringPrintf("%lld", itr->second.metadata().timestamp);
-    kvd.kv["checksum"] = itr->second.checksum().toString();
-    {
-      const set<int> &vers = itr->second.getVersions();
-      string vs;
-      for(set<int>::const_iterator itr = vers.begin(); itr != vers.end(); itr++) {
-        if(itr != vers.begin())
-          vs += " ";
-        vs += StringPrintf("%d", *itr);
-      }
-      kvd.kv["dependencies"] = vs;
+    putkvDataInline(ofs, fileKvd(itr->first, itr->second), "name");
+  }
+}
+
+void State::writeDiff(const string &fn) const {
+  ofstream ofs(fn.c_str());
+  CHECK(ofs);
+  for(set<string>::const_iterator itr = changed.begin(); itr != changed.end(); itr++) {
+    map<string, Item>::const_iterator ite = items.find(*itr);
+    if(ite != items.end()) {
+      putkvDataInline(ofs, fileKvd(ite->first, ite->second), "name");
+    } else {
+      kvData kvd;
+      kvd.category = "remove";
+      kvd.kv["name"] = *itr;
+      putkvDataInline(ofs, kvd, "name");
     }
-    putkvDataInline(ofs, kvd, "name");
   }
 }
 
+void State::clearChanges() {
+  changed.clear();
+}
+
 
 void dumpa(string *str, const string &txt, const vector<pair<bool, string> > &vek) {
   *str += "  " + txt + "\n";
@@ -135,7 +219,7 @@ string Instruction::textout() const {
   return rvx;
 }
 
-string Instruction::processString() const {
+string Instruction::processString(const HoleMap &holes) const {
   kvData kvd;
   if(type == TYPE_CREATE) {
     CHECK(0);
@@ -153,20 +237,45 @@ string Instruction::processString() const {
     kvd.kv["source"] = copy_source;
     kvd.kv["dest"] = copy_dest;
     kvd.kv["dest_meta"] = copy_dest_meta.toKvd();
+    if(copy_link)
+      kvd.kv["link"] = "1";
   } else if(type == TYPE_APPEND) {
-    kvd.category = "touch";
+    kvd.category = "appended";
     kvd.kv["path"] = append_path;
+    kvd.kv["begin"] = StringPrintf("%lld", append_begin);
+    kvd.kv["size"] = StringPrintf("%lld", append_size);
     kvd.kv["meta"] = append_meta.toKvd();
+    if(holes.size())
+      kvd.kv["holes"] = holeMapString(holes);
     // TODO: Checksum?
+  } else if(type == TYPE_PATCH) {
+    kvd.category = "patched";
+    kvd.kv["path"] = patch_path;
+    kvd.kv["size"] = StringPrintf("%lld", patch_size);
+    kvd.kv["meta"] = patch_meta.toKvd();
   } else if(type == TYPE_STORE) {
-    kvd.category = "touch";
+    kvd.category = "stored";
     kvd.kv["path"] = store_path;
+    kvd.kv["size"] = StringPrintf("%lld", store_size);
     kvd.kv["meta"] = store_meta.toKvd();
+    if(holes.size())
+      kvd.kv["holes"] = holeMapString(holes);
     // TODO: Checksum?
+  } else if(type == TYPE_CHUNK) {
+    kvd.category = "chunked";
+    kvd.kv["path"] = chunk_path;
+    kvd.kv["size"] = StringPrintf("%lld", chunk_size);
+    kvd.kv["meta"] = chunk_meta.toKvd();
+    kvd.kv["chunks"] = chunkListString(chunk_list);
   } else if(type == TYPE_TOUCH) {
     kvd.category = "touch";
     kvd.kv["path"] = touch_path;
     kvd.kv["meta"] = touch_meta.toKvd();
+  } else if(type == TYPE_MOVE) {
+    kvd.category = "move";
+    kvd.kv["source"] = move_source;
+    kvd.kv["dest"] = move_dest;
+    kvd.kv["count"] = StringPrintf("%d", (int)creates.size());
   } else {
     CHECK(0);
   }
@@ -178,6 +287,10 @@ long long Instruction::size() const {
     return usedperitem + store_size;
   } else if(type == TYPE_APPEND) {
     return usedperitem + append_size - append_begin;
+  } else if(type == TYPE_PATCH) {
+    return usedperitem + patch_literal + patch_ops.size() * 13;
+  } else if(type == TYPE_CHUNK) {
+    return usedperitem + chunk_newbytes + chunk_list.size() * 41;
   } else {
     return usedperitem;
   }
@@ -198,5 +311,5 @@ int getsize(const vector<pair<string, Metadata> > &dt) {
 }
 
 int Instruction::bytesused() const {
-  return getsize(depends) + getsize(removes) + getsize(creates) + getsize(rotate_paths) + create_path.size() + delete_path.size() + copy_source.size() + copy_dest.size() + append_path.size() + store_path.size() + touch_path.size() + sizeof(*this);
+  return getsize(depends) + getsize(removes) + getsize(creates) + getsize(rotate_paths) + create_path.size() + delete_path.size() + copy_source.size() + copy_dest.size() + append_path.size() + patch_path.size() + patch_ops.size() * sizeof(DeltaOp) + store_path.size() + touch_path.size() + move_source.size() + move_dest.size() + chunk_path.size() + chunk_list.size() * sizeof(ChunkRef) + sizeof(*this);
 }
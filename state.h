@@ -20,14 +20,17 @@
 #define PUREBACKUP_STATE
 
 #include "item.h"
+#include "chunk.h"
+#include "patch.h"
 
 #include <map>
+#include <set>
 
 using namespace std;
 
-enum { TYPE_CREATE, TYPE_ROTATE, TYPE_DELETE, TYPE_COPY, TYPE_TOUCH, TYPE_APPEND, TYPE_STORE, TYPE_END };
-const string type_strs[] = { "CREATE", "ROTATE", "DELETE", "COPY", "TOUCH", "APPEND", "STORE" };
-const bool type_expensive[] = {0, 0, 0, 0, 0, 1, 1};
+enum { TYPE_CREATE, TYPE_ROTATE, TYPE_DELETE, TYPE_COPY, TYPE_TOUCH, TYPE_APPEND, TYPE_PATCH, TYPE_STORE, TYPE_CHUNK, TYPE_MOVE, TYPE_END };
+const string type_strs[] = { "CREATE", "ROTATE", "DELETE", "COPY", "TOUCH", "APPEND", "PATCH", "STORE", "CHUNK", "MOVE" };
+const bool type_expensive[] = {0, 0, 0, 0, 0, 1, 1, 1, 1, 0};
 
 const int usedperitem = 520;
 
@@ -49,6 +52,7 @@ public:
   string copy_source;
   string copy_dest;
   Metadata copy_dest_meta;
+  bool copy_link;  // they're hardlinks of the same file, and restore can make them that way again
 
   string append_path;
   long long append_size;
@@ -57,20 +61,41 @@ public:
   Checksum append_checksum;
   const Item *append_source;
 
+  string patch_path;
+  long long patch_size;
+  Metadata patch_meta;
+  const Item *patch_source;
+  vector<DeltaOp> patch_ops;
+  long long patch_literal;  // bytes the ops can't copy from the old version
+
   string store_path;
   long long store_size;
   Metadata store_meta;
   const Item *store_source;
   
+  string chunk_path;
+  long long chunk_size;
+  Metadata chunk_meta;
+  const Item *chunk_source;
+  vector<ChunkRef> chunk_list;
+  long long chunk_newbytes; // what the chunks we didn't have yet add up to, as of planning
+
   string touch_path;
   Metadata touch_meta;
 
+  // Everything under move_source ends up under move_dest, untouched. depends and removes list the old paths, and
+  // creates the new ones, in the same order.
+  string move_source;
+  string move_dest;
+
   string textout() const;
-  string processString() const;
+  string processString(const HoleMap &holes = HoleMap()) const;  // holes: what a store or append left out of its archive member
   
   long long size() const;
   
   int bytesused() const;
+
+  Instruction() : copy_link(false) { };
 };
 
 class State {
@@ -78,9 +103,14 @@ private:
   
   map<string, Item> items;
 
+  set<string> changed;  // every path process() has touched since the last clearChanges()
+
+  void readLine(kvData kvd);
+
 public:
   
   void readFile(const string &fil);
+  void applyDiff(const string &fil);
 
   void process(const Instruction &inst, int tversion);
 
@@ -88,6 +118,8 @@ public:
   const Item *findItem(const string &name) const;
 
   void writeOut(const string &fil) const;
+  void writeDiff(const string &fil) const;  // only the entries that changed, cost is proportional to the changes
+  void clearChanges();
 
 };
 
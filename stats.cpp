@@ -0,0 +1,143 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "stats.h"
+
+#include "thread.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+long long stat_counters[STAT_END];
+
+static const char *const phase_names[PHASE_END] = { "config", "scan", "stateload", "prehash", "plan", "deloop", "sort", "archive", "statewrite" };
+static const char *const stat_names[STAT_END] = { "bytes_read", "bytes_hashed", "bytes_compressed", "bytes_sparse", "files_stated", "cache_hits", "cache_misses" };
+
+static double phase_wall[PHASE_END];
+static double phase_cpu[PHASE_END];
+static int phase_calls[PHASE_END];
+static double phase_startwall[PHASE_END];
+static double phase_startcpu[PHASE_END];
+static bool phase_running[PHASE_END];
+
+static Mutex overlap_mutex;
+static int overlap_active = 0;  // phases running right now
+static double overlap_since;    // when that last changed
+static double overlap_wall = 0; // time with more than one of them
+
+const char *phaseName(int phase) {
+  CHECK(phase >= 0 && phase < PHASE_END);
+  return phase_names[phase];
+}
+
+const char *statName(int stat) {
+  CHECK(stat >= 0 && stat < STAT_END);
+  return stat_names[stat];
+}
+
+static double wallNow() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Every thread's, user and system both - if this is well under the wall time, we were waiting on the disk
+static double cpuNow() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+static double run_start = wallNow();
+static double run_cpustart = cpuNow();
+
+void resetStats() {
+  for(int i = 0; i < STAT_END; i++)
+    stat_counters[i] = 0;
+  for(int i = 0; i < PHASE_END; i++) {
+    CHECK(!phase_running[i]);
+    phase_wall[i] = 0;
+    phase_cpu[i] = 0;
+    phase_calls[i] = 0;
+  }
+  overlap_wall = 0;
+  run_start = wallNow();
+  run_cpustart = cpuNow();
+}
+
+static void trackOverlap(double now, int change) {
+  MutexLock lock(&overlap_mutex);
+  if(overlap_active > 1)
+    overlap_wall += now - overlap_since;
+  overlap_active += change;
+  overlap_since = now;
+}
+
+void startPhase(int phase) {
+  CHECK(phase >= 0 && phase < PHASE_END);
+  CHECK(!phase_running[phase]);
+  phase_running[phase] = true;
+  phase_startwall[phase] = wallNow();
+  phase_startcpu[phase] = cpuNow();
+  trackOverlap(phase_startwall[phase], 1);
+}
+
+void endPhase(int phase) {
+  CHECK(phase >= 0 && phase < PHASE_END);
+  CHECK(phase_running[phase]);
+  phase_running[phase] = false;
+  double now = wallNow();
+  trackOverlap(now, -1);
+  phase_wall[phase] += now - phase_startwall[phase];
+  phase_cpu[phase] += cpuNow() - phase_startcpu[phase];
+  phase_calls[phase]++;
+}
+
+void printRunReport() {
+  printf("Run took %.2fs\n", wallNow() - run_start);
+  for(int i = 0; i < PHASE_END; i++)
+    if(phase_calls[i])
+      printf("  %-10s %9.2fs wall %9.2fs cpu\n", phase_names[i], phase_wall[i], phase_cpu[i]);
+  printf("  %-10s %9.2fs wall with phases running alongside each other\n", "overlap", overlap_wall);
+  for(int i = 0; i < STAT_END; i++)
+    printf("  %-16s %lld\n", stat_names[i], stat_counters[i]);
+}
+
+void appendRunReport(const string &fname, const string &command, int stateid) {
+  FILE *fil = fopen(fname.c_str(), "a");
+  if(!fil) {
+    printf("Couldn't write run report to %s\n", fname.c_str());
+    return;
+  }
+  fprintf(fil, "{\"command\":\"%s\",\"state\":%d,\"started\":%lld,\"wall\":%.3f,\"cpu\":%.3f,\"phases\":{", command.c_str(), stateid, (long long)run_start, wallNow() - run_start, cpuNow() - run_cpustart);
+  bool first = true;
+  for(int i = 0; i < PHASE_END; i++) {
+    if(!phase_calls[i])
+      continue;
+    fprintf(fil, "%s\"%s\":{\"wall\":%.3f,\"cpu\":%.3f,\"calls\":%d}", first ? "" : ",", phase_names[i], phase_wall[i], phase_cpu[i], phase_calls[i]);
+    first = false;
+  }
+  fprintf(fil, "},\"overlap\":%.3f,\"counters\":{", overlap_wall);
+  for(int i = 0; i < STAT_END; i++)
+    fprintf(fil, "%s\"%s\":%lld", i ? "," : "", stat_names[i], stat_counters[i]);
+  fprintf(fil, "}}\n");
+  fclose(fil);
+}
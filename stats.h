@@ -0,0 +1,71 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_STATS
+#define PUREBACKUP_STATS
+
+#include <string>
+
+using namespace std;
+
+// Where a run's time went, and how much work got done along the way. Phases can be timed from any thread, so long as
+// each one is only ever running on one thread at a time; counters get bumped from the hashing threads too, so they're
+// atomic.
+
+enum { PHASE_CONFIG, PHASE_SCAN, PHASE_STATELOAD, PHASE_PREHASH, PHASE_PLAN, PHASE_DELOOP, PHASE_SORT, PHASE_ARCHIVE, PHASE_STATEWRITE, PHASE_END };
+enum { STAT_BYTESREAD, STAT_BYTESHASHED, STAT_BYTESCOMPRESSED, STAT_BYTESSPARSE, STAT_FILESSTATED, STAT_CACHEHITS, STAT_CACHEMISSES, STAT_END };
+
+extern long long stat_counters[STAT_END];
+
+inline void countStat(int stat, long long amount) {
+  __sync_fetch_and_add(&stat_counters[stat], amount);
+}
+
+// Adds the wall and CPU time between the two to a phase. A phase may be entered more than once, but not inside itself.
+// Wall time where two or more phases were running at once - the scan on one thread and the state load or hashing
+// on another - is reported as overlap. CPU time is the whole process's, so overlapping phases each count it.
+void startPhase(int phase);
+void endPhase(int phase);
+
+// Same thing, for a scope
+class PhaseTimer {
+public:
+  PhaseTimer(int in_phase) : phase(in_phase) { startPhase(phase); }
+  ~PhaseTimer() { endPhase(phase); }
+
+private:
+  int phase;
+
+  PhaseTimer(const PhaseTimer &pt); // do not implement
+  void operator=(const PhaseTimer &pt); // do not implement
+};
+
+// The names the report uses
+const char *phaseName(int phase);
+const char *statName(int stat);
+
+// Starts a new run from zero, for processes that do more than one
+void resetStats();
+
+// One line per phase and counter, for the console
+void printRunReport();
+
+// Appends the whole run as a single line of JSON, so a file of them can be charted run over run
+void appendRunReport(const string &fname, const string &command, int stateid);
+
+#endif
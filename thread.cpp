@@ -0,0 +1,136 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "thread.h"
+
+#include "debug.h"
+
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+void Mutex::lock() {
+  CHECK(!pthread_mutex_lock(&mutex));
+}
+void Mutex::unlock() {
+  CHECK(!pthread_mutex_unlock(&mutex));
+}
+
+Mutex::Mutex() {
+  CHECK(!pthread_mutex_init(&mutex, NULL));
+}
+Mutex::~Mutex() {
+  pthread_mutex_destroy(&mutex);
+}
+
+void Condition::wait(Mutex *mutex) {
+  CHECK(!pthread_cond_wait(&cond, &mutex->mutex));
+}
+void Condition::signal() {
+  CHECK(!pthread_cond_broadcast(&cond));
+}
+
+Condition::Condition() {
+  CHECK(!pthread_cond_init(&cond, NULL));
+}
+Condition::~Condition() {
+  pthread_cond_destroy(&cond);
+}
+
+int threadCount() {
+  long procs = sysconf(_SC_NPROCESSORS_ONLN);
+  if(procs < 1)
+    return 1;
+  return procs;
+}
+
+class ParallelForState {
+public:
+  Mutex mutex;
+  int next;
+  int tasks;
+  void (*func)(int task, void *data);
+  void *data;
+};
+
+static void *parallelForWorker(void *in_state) {
+  ParallelForState *state = (ParallelForState *)in_state;
+  while(1) {
+    int task;
+    {
+      MutexLock lock(&state->mutex);
+      if(state->next == state->tasks)
+        return NULL;
+      task = state->next++;
+    }
+    state->func(task, state->data);
+  }
+}
+
+void parallelFor(int tasks, void (*func)(int task, void *data), void *data, int threads) {
+  if(threads == -1)
+    threads = threadCount();
+  if(threads > tasks)
+    threads = tasks;
+  
+  ParallelForState state;
+  state.next = 0;
+  state.tasks = tasks;
+  state.func = func;
+  state.data = data;
+  
+  if(threads <= 1) {
+    parallelForWorker(&state);
+    return;
+  }
+  
+  // The calling thread does its share too
+  vector<pthread_t> workers(threads - 1);
+  for(int i = 0; i < workers.size(); i++)
+    CHECK(!pthread_create(&workers[i], NULL, parallelForWorker, &state));
+  parallelForWorker(&state);
+  for(int i = 0; i < workers.size(); i++)
+    CHECK(!pthread_join(workers[i], NULL));
+}
+
+class StartThreadState {
+public:
+  void (*func)(void *data);
+  void *data;
+};
+
+static void *startThreadWorker(void *in_state) {
+  StartThreadState *state = (StartThreadState *)in_state;
+  state->func(state->data);
+  delete state;
+  return NULL;
+}
+
+pthread_t startThread(void (*func)(void *data), void *data) {
+  StartThreadState *state = new StartThreadState;
+  state->func = func;
+  state->data = data;
+  pthread_t thread;
+  CHECK(!pthread_create(&thread, NULL, startThreadWorker, state));
+  return thread;
+}
+
+void joinThread(pthread_t thread) {
+  CHECK(!pthread_join(thread, NULL));
+}
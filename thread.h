@@ -0,0 +1,78 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_THREAD
+#define PUREBACKUP_THREAD
+
+#include <pthread.h>
+
+class Mutex {
+public:
+  void lock();
+  void unlock();
+
+  Mutex();
+  ~Mutex();
+
+private:
+  pthread_mutex_t mutex;
+
+  friend class Condition;
+
+  Mutex(const Mutex &mt); // do not implement
+  void operator=(const Mutex &mt); // do not implement
+};
+
+// For waiting until another thread has done something. wait() has to be called with the mutex held, and it can
+// return without anything having changed, so check again.
+class Condition {
+public:
+  void wait(Mutex *mutex);
+  void signal();  // wakes everyone waiting
+
+  Condition();
+  ~Condition();
+
+private:
+  pthread_cond_t cond;
+
+  Condition(const Condition &cd); // do not implement
+  void operator=(const Condition &cd); // do not implement
+};
+
+class MutexLock {
+public:
+  MutexLock(Mutex *in_mutex) : mutex(in_mutex) { mutex->lock(); }
+  ~MutexLock() { mutex->unlock(); }
+
+private:
+  Mutex *mutex;
+};
+
+// How many threads are worth running - one per processor
+int threadCount();
+
+// Calls func(i, data) for every i in [0, tasks), handing tasks out in order to whichever thread is free.
+// Returns once every task has finished. threads == -1 means threadCount().
+void parallelFor(int tasks, void (*func)(int task, void *data), void *data, int threads = -1);
+
+// Calls func(data) on a thread of its own, alongside whatever the caller goes on to do, until joinThread.
+pthread_t startThread(void (*func)(void *data), void *data);
+void joinThread(pthread_t thread);
+
+#endif
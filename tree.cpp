@@ -17,11 +17,17 @@
 */
 
 #include "tree.h"
+#include "journal.h"
+#include "mask.h"
+#include "exclude.h"
 #include "debug.h"
 
 #include <vector>
 #include <set>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 using namespace std;
 
 bool MountTree::checkSanity() const {
@@ -109,24 +115,87 @@ void MountTree::print(int indent) const {
 }
 
 int scanned = 0;
+int scan_listed = 0;
+int scan_reused = 0;
+int scan_masked = 0;
+
+// What a directory held as of the last backup. Subdirectories are only known by the files beneath them, which is
+// all the scan needs.
+static vector<DirListOut> previousList(const string &source, const string &path, const map<string, Item> &previous) {
+  vector<DirListOut> rv;
+  string prefix = path + "/";
+  map<string, Item>::const_iterator itr = previous.lower_bound(prefix);
+  while(itr != previous.end() && !itr->first.compare(0, prefix.size(), prefix)) {
+    string rest = itr->first.substr(prefix.size());
+    DirListOut dlo;
+    dlo.null = false;
+    string::size_type slash = rest.find('/');
+    if(slash == string::npos) {
+      dlo.directory = false;
+      dlo.itemname = rest;
+      dlo.size = itr->second.size();
+      dlo.timestamp = itr->second.metadata().timestamp;
+      dlo.mode = S_IFREG;
+      dlo.dev = itr->second.device();
+      dlo.ino = itr->second.inode();
+      itr++;
+    } else {
+      dlo.directory = true;
+      dlo.itemname = rest.substr(0, slash);
+      dlo.size = 0;
+      dlo.timestamp = 0;
+      dlo.mode = S_IFDIR;
+      dlo.dev = 0;
+      dlo.ino = 0;
+      itr = previous.lower_bound(prefix + dlo.itemname + "0");  // '0' sorts right after '/'
+    }
+    dlo.full_path = source + "/" + dlo.itemname;
+    rv.push_back(dlo);
+  }
+  return rv;
+}
 
-void MountTree::scan() {
+void MountTree::scan(const string &path, const Journal *journal, const map<string, Item> *previous, int maskstate, void (*finished)(const string &path, const MountTree &dir, void *ctx), void *ctx) {
+  if(maskstate == -1)
+    maskstate = masks.step(masks.start(), path);
+  
   if(type == MTT_VIRTUAL) {
     for(map<string, MountTree>::iterator itr = links.begin(); itr != links.end(); itr++) {
-      itr->second.scan();
+      int childmask = masks.step(maskstate, "/" + itr->first);
+      if(masks.matches(childmask)) {
+        scan_masked++;
+        continue;
+      }
+      itr->second.scan(path + "/" + itr->first, journal, previous, childmask, finished, ctx);
     }
   } else if(type == MTT_FILE) {
     CHECK(!file_scanned);
   
     file_scanned = true;
-    pair<bool, vector<DirListOut> > tfils = getDirList(file_source);
+    pair<bool, vector<DirListOut> > tfils;
+    if(journal && !journal->changed(path)) {
+      tfils = make_pair(false, previousList(file_source, path, *previous));
+      scan_reused++;
+    } else {
+      tfils = getDirList(file_source);
+      scan_listed++;
+    }
     if(tfils.first) {
       *this = MountTree();
       type = MTT_NULL;
       return;
     }
     vector<DirListOut> fils = tfils.second;
+    if(excludeDirectory(path, file_source, fils))
+      fils.clear();
     for(int i = 0; i < fils.size(); i++) {
+      int childmask = masks.step(maskstate, "/" + fils[i].itemname);
+      if(masks.matches(childmask)) {
+        scan_masked++;
+        continue;
+      }
+      if(excludeFile(path + "/" + fils[i].itemname, fils[i]))
+        continue;
       if(links[fils[i].itemname].type == MTT_MASKED)
         continue;
       scanned++;
@@ -147,12 +216,24 @@ void MountTree::scan() {
         links[fils[i].itemname].type = MTT_FILE;
         links[fils[i].itemname].file_source = fils[i].full_path;
         links[fils[i].itemname].file_scanned = false;
-        links[fils[i].itemname].scan();
+        links[fils[i].itemname].scan(path + "/" + fils[i].itemname, journal, previous, childmask, finished, ctx);
       } else {
         links[fils[i].itemname].type = MTT_ITEM;
-        links[fils[i].itemname].item = Item::MakeLocal(fils[i].full_path, fils[i].size, Metadata(fils[i].timestamp));
+        // If we already have this very file from an earlier scan in this process, it keeps whatever's been hashed.
+        // If it's changed since, it still keeps its path, so a process that runs for months doesn't pool it again
+        // every time.
+        map<string, Item>::const_iterator pitr = previous ? previous->find(path + "/" + fils[i].itemname) : map<string, Item>::const_iterator();
+        bool prior = previous && pitr != previous->end() && pitr->second.localPath() && fils[i].full_path == pitr->second.localPath();
+        if(prior && pitr->second.size() == fils[i].size && pitr->second.metadata() == Metadata(fils[i].timestamp) && pitr->second.inode() == fils[i].ino)
+          links[fils[i].itemname].item = pitr->second;
+        else if(prior)
+          links[fils[i].itemname].item = Item::RemakeLocal(pitr->second, fils[i].size, Metadata(fils[i].timestamp), fils[i].dev, fils[i].ino);
+        else
+          links[fils[i].itemname].item = Item::MakeLocal(fils[i].full_path, fils[i].size, Metadata(fils[i].timestamp), fils[i].dev, fils[i].ino);
       }
     }
+    if(finished)
+      finished(path, *this, ctx);
   } else if(type == MTT_SSH) {
     CHECK(0);
   } else {
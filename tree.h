@@ -27,6 +27,8 @@
 
 using namespace std;
 
+class Journal;
+
 enum { MTT_VIRTUAL, MTT_IMPLIED, MTT_MASKED, MTT_FILE, MTT_SSH, MTT_ITEM, MTT_NULL, MTT_END, MTT_UNINITTED };
 
 class MountTree {
@@ -50,7 +52,11 @@ public:
   
   void print(int indent) const;
   
-  void scan();
+  // With a journal, directories it says haven't changed are filled in from the previous state's items instead of
+  // being listed again. Local items in previous that still match what's on disk are reused as they are. maskstate is
+  // where the pattern masks are after path, or -1 to work it out. If finished is given, it's called for each
+  // directory once everything under it has been scanned, so the files in it can be dealt with before the scan's done.
+  void scan(const string &path = "", const Journal *journal = NULL, const map<string, Item> *previous = NULL, int maskstate = -1, void (*finished)(const string &path, const MountTree &dir, void *ctx) = NULL, void *ctx = NULL);
 
   void dumpItems(map<string, Item> *items, string cpath) const;
 
@@ -61,4 +67,10 @@ public:
 
 MountTree *getRoot();
 
+// Directories the last scan listed from disk, ones it took from the previous state, and files and directories the
+// pattern masks dropped
+extern int scan_listed;
+extern int scan_reused;
+extern int scan_masked;
+
 #endif
@@ -19,6 +19,7 @@
 #include "util.h"
 #include "debug.h"
 #include "parse.h"
+#include "stats.h"
 
 #include <stdarg.h>
 #include <sys/types.h>
@@ -54,11 +55,15 @@ void readHex(unsigned char *dest, int size, const string &dat) {
   CHECK(outputHex(dest, size) == dat);
 }
 
+const char *const hash_names[HASH_END] = { "sha1", "blake3" };
+
 string Checksum::toString() const {
   kvData kvd;
   kvd.category = "checksum";
-  kvd.kv["sha1"] = outputHex(bytes, sizeof(bytes));
+  kvd.kv[hash_names[(int)algo]] = outputHex(bytes, sizeof(bytes));
   kvd.kv["signature"] = outputHex(signature, sizeof(signature));
+  if(sampled)
+    kvd.kv["sample"] = StringPrintf("%016llx", sample);
   return putkvDataInlineString(kvd);
 }
 
@@ -67,8 +72,14 @@ Checksum atochecksum(const char *in) {
   CHECK(kvd.category == "checksum");
   Checksum cs;
   
-  readHex(cs.bytes, sizeof(cs.bytes), kvd.consume("sha1"));
+  if(kvd.kv.count(hash_names[HASH_BLAKE3]))
+    cs.algo = HASH_BLAKE3;
+  readHex(cs.bytes, sizeof(cs.bytes), kvd.consume(hash_names[(int)cs.algo]));
   readHex(cs.signature, sizeof(cs.signature), kvd.consume("signature"));
+  if(kvd.kv.count("sample")) {
+    CHECK(sscanf(kvd.consume("sample").c_str(), "%llx", &cs.sample) == 1);
+    cs.sampled = true;
+  }
   
   return cs;
 }
@@ -106,6 +117,7 @@ pair<bool, vector<DirListOut> > getDirList(const string &path) {
     struct stat stt;
     //printf("%s\n", (path + "/" + dire->d_name).c_str());
     DirListOut dlo;
+    countStat(STAT_FILESSTATED, 1);
     if(lstat((path + "/" + dire->d_name).c_str(), &stt)) {
       printf("Error reading %s\n", (path + "/" + dire->d_name).c_str());
       perror(NULL);
@@ -115,6 +127,9 @@ pair<bool, vector<DirListOut> > getDirList(const string &path) {
       dlo.itemname = dire->d_name;
       dlo.size = 0;
       dlo.timestamp = 0;
+      dlo.mode = 0;
+      dlo.dev = 0;
+      dlo.ino = 0;
     } else {
       dlo.null = false;
       dlo.directory = stt.st_mode & S_IFDIR;
@@ -122,6 +137,9 @@ pair<bool, vector<DirListOut> > getDirList(const string &path) {
       dlo.itemname = dire->d_name;
       dlo.size = stt.st_size;
       dlo.timestamp = stt.st_mtime;
+      dlo.mode = stt.st_mode & S_IFMT;
+      dlo.dev = stt.st_dev;
+      dlo.ino = stt.st_nlink > 1 && !dlo.directory ? stt.st_ino : 0;
     }
     rv.push_back(dlo);
   }
@@ -130,6 +148,6 @@ pair<bool, vector<DirListOut> > getDirList(const string &path) {
 }
 
 bool operator==(const Checksum &lhs, const Checksum &rhs) {
-  return !memcmp(lhs.bytes, rhs.bytes, sizeof(lhs.bytes)) && !memcmp(lhs.signature, rhs.signature, sizeof(lhs.signature)) ;
+  return lhs.algo == rhs.algo && !memcmp(lhs.bytes, rhs.bytes, sizeof(lhs.bytes)) && !memcmp(lhs.signature, rhs.signature, sizeof(lhs.signature)) ;
 }
 
@@ -24,13 +24,25 @@
 
 using namespace std;
 
+// Full checksums are one or the other - states written before BLAKE3 was an option are all SHA-1
+enum { HASH_SHA1, HASH_BLAKE3, HASH_END };
+extern const char *const hash_names[HASH_END];
+
 class Checksum {
 public:
-  unsigned char bytes[20];
+  unsigned char bytes[20];  // BLAKE3 gets cut down to fit
+  char algo;
 
   unsigned char signature[32];   // A chunk in the middle, rounded down, or the entire file with 0's appended.
 
+  // Hash of the head, the tail and a handful of windows in between. Only compared when both sides have one, since
+  // states written before it existed don't, and it isn't part of operator==.
+  unsigned long long sample;
+  bool sampled;
+
   string toString() const;
+
+  Checksum() : algo(HASH_SHA1), sample(0), sampled(false) { };
 };
 
 bool operator==(const Checksum &lhs, const Checksum &rhs);
@@ -39,6 +51,9 @@ inline bool operator!=(const Checksum &lhs, const Checksum &rhs) { return !(lhs
 long long atoll(const char *);
 Checksum atochecksum(const char *);
 
+string outputHex(const unsigned char *dat, int size);
+void readHex(unsigned char *dest, int size, const string &dat);
+
 string StringPrintf( const char *bort, ... ) __attribute__((format(printf,1,2)));
 
 struct DirListOut {
@@ -49,6 +64,9 @@ public:
   string itemname;
   long long size;
   long long timestamp;
+  int mode;  // just the file type bits, 0 if it's null
+  long long dev;
+  long long ino;  // 0 unless something else is hardlinked to it
 };
 
 pair<bool, vector<DirListOut> > getDirList(const string &path);
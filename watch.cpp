@@ -0,0 +1,385 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#include "watch.h"
+#include "journal.h"
+#include "tree.h"
+#include "util.h"
+#include "parse.h"
+#include "mask.h"
+#include "debug.h"
+
+#include <vector>
+#include <map>
+#include <set>
+
+#if defined(__linux__) && !defined(WIN32API)
+
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Each mountpoint's path in the tree, and where it really is
+static vector<pair<string, string> > mounts;
+
+// We don't want to hear about our own journal, in case someone's backing up the directory it lives in
+static string statesdir;
+
+static void findMounts(const MountTree *node, const string &path) {
+  if(node->type == MTT_FILE) {
+    char real[PATH_MAX];
+    mounts.push_back(make_pair(path, realpath(node->file_source.c_str(), real) ? string(real) : node->file_source));
+  } else if(node->type == MTT_VIRTUAL) {
+    for(map<string, MountTree>::const_iterator itr = node->links.begin(); itr != node->links.end(); itr++)
+      findMounts(&itr->second, path + "/" + itr->first);
+  }
+}
+
+static bool masked(const string &path) {
+  if(masks.covers(path))
+    return true;
+  const MountTree *node = getRoot();
+  vector<string> parts = tokenize(path, "/");
+  for(int i = 0; i < parts.size(); i++) {
+    map<string, MountTree>::const_iterator itr = node->links.find(parts[i]);
+    if(itr == node->links.end())
+      return false;
+    node = &itr->second;
+    if(node->type == MTT_MASKED)
+      return true;
+  }
+  return false;
+}
+
+static set<string> pending_dirty;
+static set<string> pending_recursive;
+static string pending_gap;  // why we can't trust the rest, if we can't
+
+static void flushPending() {
+  if(pending_dirty.size() || pending_recursive.size())
+    journalDirty(pending_dirty, pending_recursive);
+  if(pending_gap.size())
+    journalGap(pending_gap);
+  pending_dirty.clear();
+  pending_recursive.clear();
+  pending_gap.clear();
+}
+
+// A change to name in the directory at path. A directory that's new to us might have filled up before anyone was
+// watching it, so it gets scanned whole. So does one that was deleted or moved away, since everything the state has
+// under it is gone from there, and the events for what was inside can't always be traced back to it any more.
+static void noteChange(const string &path, const string &name, bool wholetree) {
+  if(masked(path + "/" + name))
+    return;
+  pending_dirty.insert(path);
+  if(wholetree)
+    pending_recursive.insert(path + "/" + name);
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stopWatching(int sig) {
+  stopping = 1;
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+
+static int fanotify_fd = -1;
+static vector<int> mount_fds;  // for turning file handles back into paths
+
+static bool startFanotify() {
+  fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC, O_RDONLY);
+  if(fanotify_fd == -1)
+    return false;
+  for(int i = 0; i < mounts.size(); i++) {
+    if(fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_MODIFY | FAN_ATTRIB | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR, AT_FDCWD, mounts[i].second.c_str())) {
+      close(fanotify_fd);
+      for(int j = 0; j < mount_fds.size(); j++)
+        close(mount_fds[j]);
+      mount_fds.clear();
+      return false;
+    }
+    mount_fds.push_back(open(mounts[i].second.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  }
+  return true;
+}
+
+// Empty if it's gone already, in which case whatever removed it told us about its parent
+static string handlePath(struct file_handle *handle) {
+  for(int i = 0; i < mount_fds.size(); i++) {
+    int fd = open_by_handle_at(mount_fds[i], handle, O_PATH | O_CLOEXEC);
+    if(fd == -1)
+      continue;
+    char link[64];
+    char target[PATH_MAX];
+    sprintf(link, "/proc/self/fd/%d", fd);
+    int len = readlink(link, target, sizeof(target));
+    close(fd);
+    if(len > 0 && len < sizeof(target))
+      return string(target, len);
+  }
+  return "";
+}
+
+// Where a real path is in the tree, or empty if it isn't in any of our mountpoints
+static string treePath(const string &real) {
+  for(int i = 0; i < mounts.size(); i++) {
+    const string &source = mounts[i].second;
+    if(real == source)
+      return mounts[i].first;
+    if(real.size() > source.size() && real[source.size()] == '/' && !real.compare(0, source.size(), source))
+      return mounts[i].first + real.substr(source.size());
+  }
+  return "";
+}
+
+static bool readFanotify() {
+  char buf[65536] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+  int len = read(fanotify_fd, buf, sizeof(buf));
+  if(len <= 0)
+    return true;
+  for(struct fanotify_event_metadata *ev = (struct fanotify_event_metadata *)buf; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+    if(ev->mask & FAN_Q_OVERFLOW) {
+      pending_gap = "the fanotify queue overflowed";
+      continue;
+    }
+    struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(ev + 1);
+    if((char *)fid + sizeof(*fid) > (char *)ev + ev->event_len || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+      continue;
+    struct file_handle *handle = (struct file_handle *)fid->handle;
+    string name = (const char *)(handle->f_handle + handle->handle_bytes);
+    string dir = handlePath(handle);
+    if(dir.empty() || dir == statesdir)
+      continue;
+    string path = treePath(dir);
+    if(path.empty() || masked(path) || name == ".")
+      continue;
+    noteChange(path, name, (ev->mask & FAN_ONDIR) && (ev->mask & (FAN_CREATE | FAN_MOVED_TO | FAN_DELETE | FAN_MOVED_FROM)));
+  }
+  return true;
+}
+
+#else
+
+static int fanotify_fd = -1;
+static bool startFanotify() { return false; }
+static bool readFanotify() { return true; }
+
+#endif
+
+static int inotify_fd = -1;
+static map<int, pair<string, string> > watches;  // watch descriptor -> path in the tree, real path
+static map<string, int> watched;                 // path in the tree -> watch descriptor
+
+// False if we've run out of watches, in which case there's no point carrying on
+static bool watchTree(const string &path, const string &source) {
+  int wd = inotify_add_watch(inotify_fd, source.c_str(), IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+  if(wd == -1) {
+    if(errno == ENOSPC) {
+      printf("Out of inotify watches at %s - fs.inotify.max_user_watches needs raising\n", source.c_str());
+      return false;
+    }
+    return true;  // gone, or not a directory after all - whoever did that told its parent
+  }
+  watches[wd] = make_pair(path, source);
+  watched[path] = wd;
+  
+  pair<bool, vector<DirListOut> > fils = getDirList(source);
+  if(fils.first)
+    return true;
+  for(int i = 0; i < fils.second.size(); i++) {
+    const DirListOut &dlo = fils.second[i];
+    if(dlo.directory && !dlo.null && !masked(path + "/" + dlo.itemname) && !watchTree(path + "/" + dlo.itemname, dlo.full_path))
+      return false;
+  }
+  return true;
+}
+
+// Once a directory moves, its watches would tell us about the wrong paths
+static void unwatchTree(const string &path) {
+  map<string, int>::iterator itr = watched.lower_bound(path);
+  while(itr != watched.end() && !itr->first.compare(0, path.size(), path)) {
+    if(itr->first.size() == path.size() || itr->first[path.size()] == '/') {
+      inotify_rm_watch(inotify_fd, itr->second);
+      watches.erase(itr->second);
+      watched.erase(itr++);
+    } else {
+      itr++;
+    }
+  }
+}
+
+static bool readInotify() {
+  char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int len = read(inotify_fd, buf, sizeof(buf));
+  if(len <= 0)
+    return true;
+  for(char *pos = buf; pos < buf + len; ) {
+    const struct inotify_event *ev = (const struct inotify_event *)pos;
+    pos += sizeof(struct inotify_event) + ev->len;
+    if(ev->mask & IN_Q_OVERFLOW) {
+      pending_gap = "the inotify queue overflowed";
+      continue;
+    }
+    map<int, pair<string, string> >::iterator itr = watches.find(ev->wd);
+    if(itr == watches.end())
+      continue;
+    string path = itr->second.first;
+    string source = itr->second.second;
+    if(ev->mask & IN_IGNORED) {
+      if(watched.count(path) && watched[path] == ev->wd)
+        watched.erase(path);
+      watches.erase(itr);
+      continue;
+    }
+    if(!ev->len || source == statesdir)
+      continue;
+    string name = ev->name;
+    bool newdir = (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO));
+    noteChange(path, name, newdir || ((ev->mask & IN_ISDIR) && (ev->mask & (IN_DELETE | IN_MOVED_FROM))));
+    if((ev->mask & IN_ISDIR) && (ev->mask & IN_MOVED_FROM))
+      unwatchTree(path + "/" + name);
+    if(newdir && !masked(path + "/" + name) && !watchTree(path + "/" + name, source + "/" + name))
+      return false;
+  }
+  return true;
+}
+
+static int watch_fd = -1;
+static bool (*readEvents)();
+static bool failed = false;
+
+bool startWatching() {
+  findMounts(getRoot(), "");
+  if(!mounts.size()) {
+    printf("No file mountpoints to watch\n");
+    return false;
+  }
+  {
+    char real[PATH_MAX];
+    if(realpath("states", real))
+      statesdir = real;
+  }
+  
+  signal(SIGINT, stopWatching);
+  signal(SIGTERM, stopWatching);
+  
+  if(startFanotify()) {
+    printf("Watching %d mountpoints with fanotify\n", (int)mounts.size());
+    watch_fd = fanotify_fd;
+    readEvents = readFanotify;
+  } else {
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    CHECK(inotify_fd != -1);
+    for(int i = 0; i < mounts.size(); i++)
+      if(!watchTree(mounts[i].first, mounts[i].second))
+        return false;
+    printf("Watching %d directories with inotify\n", (int)watches.size());
+    watch_fd = inotify_fd;
+    readEvents = readInotify;
+  }
+  return true;
+}
+
+bool waitForChanges(int ms) {
+  if(!stopping && !failed) {
+    struct pollfd pfd;
+    pfd.fd = watch_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, ms) > 0 && !readEvents()) {
+      failed = true;
+      pending_gap = "the watcher ran out of inotify watches";
+    }
+  }
+  return pending_dirty.size() || pending_recursive.size() || pending_gap.size();
+}
+
+void takeChanges(Journal *jn) {
+  jn->dirty.insert(pending_dirty.begin(), pending_dirty.end());
+  jn->recursive.insert(pending_recursive.begin(), pending_recursive.end());
+  if(pending_gap.size()) {
+    jn->complete = false;
+    jn->reason = pending_gap;
+  }
+  pending_dirty.clear();
+  pending_recursive.clear();
+  pending_gap.clear();
+}
+
+bool stopRequested() {
+  return stopping || failed;
+}
+
+int runWatcher(const string &conffile) {
+  if(!startWatching())
+    return 1;
+  
+  // Anything that changed before this point was missed, so the next backup knows to scan everything
+  journalStart(conffile);
+  
+  time_t lastflush = time(NULL);
+  while(!stopRequested()) {
+    waitForChanges(1000);
+    if(time(NULL) != lastflush) {
+      flushPending();
+      lastflush = time(NULL);
+    }
+  }
+  
+  flushPending();
+  if(failed)
+    return 1;
+  journalGap("the watcher stopped");
+  printf("Stopped watching\n");
+  return 0;
+}
+
+#else
+
+int runWatcher(const string &conffile) {
+  printf("Watching for changes needs Linux - backups will scan everything\n");
+  return 1;
+}
+
+bool startWatching() {
+  printf("Watching for changes needs Linux\n");
+  return false;
+}
+
+bool waitForChanges(int ms) {
+  return false;
+}
+
+void takeChanges(Journal *jn) {
+}
+
+bool stopRequested() {
+  return true;
+}
+
+#endif
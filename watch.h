@@ -0,0 +1,42 @@
+/*
+  PureBackup - human-readable backup output
+  Copyright (C) 2005 Ben Wilhelm
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the license only.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 
+*/
+
+#ifndef PUREBACKUP_WATCH
+#define PUREBACKUP_WATCH
+
+#include <string>
+
+using namespace std;
+
+class Journal;
+
+// Watches every file mountpoint in the config, writing the directories that change to the journal so the next
+// backup only has to list those. Uses fanotify on the whole filesystem if we're allowed, and an inotify watch on
+// every directory if not. Runs until it's killed, and returns the exit code.
+int runWatcher(const string &conffile);
+
+// The same watching, for a process that wants the changes itself instead of through the journal. startWatching()
+// returns false if there's nothing it can watch. waitForChanges() waits up to ms milliseconds and returns whether
+// anything's pending, and takeChanges() moves it all into jn, which stops being complete if we lost track somewhere.
+// stopRequested() is true once we've been told to quit, or can't keep watching.
+bool startWatching();
+bool waitForChanges(int ms);
+void takeChanges(Journal *jn);
+bool stopRequested();
+
+#endif